@@ -0,0 +1,570 @@
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "data.h"
+
+#define MAX_TRAMA_ESPNOW 250 // Tamaño máximo de una trama ESP-NOW (ESP_NOW_MAX_DATA_LEN)
+#define MAX_TOPIC 64         // Tamaño máximo de un topic MQTT publicado por el gateway
+#define MAX_PAYLOAD 192      // Tamaño máximo de un payload MQTT publicado por el gateway
+
+#define NUM_TRAMAS_RX 16         // Bloques para tramas recibidas por ESP-NOW pendientes de procesar
+#define NUM_PUBLICACIONES 96     // Bloques para publicaciones MQTT pendientes (un batch completo genera 3 por lectura)
+#define NUM_REGISTROS_BACKLOG 48 // Bloques para publicaciones aparcadas mientras el broker no está disponible
+
+#define MAX_NODOS 32                 // Nodos sensores de los que se sigue la secuencia (también los que envían a otros gateways)
+#define MAX_HUECO_BACKFILL 10880     // Lecturas máximas que se piden en un backfill (lo que cabe en el log de flash del nodo)
+#define MAX_HUECOS_NODO 4            // Rangos pendientes de backfill por nodo (BACKFILL_MAX_PETICIONES en sensor.node.esp32)
+#define BATCHES_REINTENTO_BACKFILL 8 // Batches de un nodo sin recibir nada de lo pedido por backfill antes de volver a pedirlo
+#define PUBLICACIONES_POR_LECTURA 3  // Temperatura, humedad y potenciómetro
+#define TIPO_SECUENCIA "sequence"    // Tipo de dato de los topics con la secuencia esperada de cada nodo, compartidos entre gateways
+
+typedef struct // Trama ESP-NOW recibida, tal cual llega al callback
+{
+  uint8_t mac[6];
+  uint8_t len;
+  uint64_t rxMicros; // Instante de recepción (esp_timer_get_time(), no da la vuelta como micros())
+  uint8_t data[MAX_TRAMA_ESPNOW];
+} RxFrame;
+
+typedef struct // Publicación MQTT lista para enviar al broker
+{
+  char topic[MAX_TOPIC];
+  char payload[MAX_PAYLOAD];
+  bool retener; // El broker guarda la última publicación del topic para los que se suscriban después
+} PendingPublish;
+
+typedef struct BacklogRecord // Publicación que no se pudo enviar, encolada hasta que vuelva el broker
+{
+  PendingPublish *publicacion;
+  uint32_t primerFalloMs; // millis() del primer intento fallido
+  uint8_t intentos;
+  struct BacklogRecord *siguiente;
+} BacklogRecord;
+
+typedef struct // Rango de lecturas de un nodo que no se ha publicado y se recupera por backfill
+{
+  uint32_t desde, hasta;
+  bool pedido; // Ya se envió la BackfillRequest
+} HuecoSecuencias;
+
+typedef struct // Última secuencia recibida de cada nodo sensor
+{
+  uint8_t mac[6];
+  uint32_t siguienteSeq; // Secuencia que se espera en el próximo batch
+  uint32_t recibidoDesde; // De aquí a siguienteSeq este gateway ha seguido el nodo: lo que no está en sus huecos lo ha publicado él
+  HuecoSecuencias huecos[MAX_HUECOS_NODO]; // Ordenados por secuencia
+  uint8_t numHuecos;
+  uint8_t batchesSinBackfill; // Batches recibidos con huecos pedidos sin que llegue ningún backfill
+} EstadoNodo;
+
+typedef enum // Resultado de registrar un batch en SeguimientoSecuencias
+{
+  SECUENCIA_NUEVA = 0, // Continúa la secuencia (o es el primer batch del nodo)
+  SECUENCIA_HUECO,     // Antes del batch falta un rango que hay que pedir por backfill
+  SECUENCIA_REPETIDA,  // Todas sus lecturas ya se recibieron, por este gateway o por otro: no se publica
+} ResultadoSecuencia;
+
+// Sigue los números de secuencia de los batches de cada nodo para detectar lecturas perdidas y repetidas. Con varios
+// gateways, cada uno incorpora con avanzar() el progreso que publican los demás, así que un batch reenviado a otro
+// gateway tras un fallo de confirmación se reconoce como repetido.
+//
+// Las lecturas que no se han publicado quedan como huecos hasta que llegan por backfill: las que faltan antes de un
+// batch y también las de un batch recibido que no se pudieron encolar (pools o colas llenos). La secuencia esperada
+// puede avanzar así en cuanto llega el batch sin que se pierda nada, y un MSG_BACKFILL_DATA solo se publica en la
+// parte que cae dentro de un hueco. Cada gateway anuncia además el tramo que ha seguido él mismo y sus huecos, y los
+// demás quitan de sus huecos lo que ese gateway ya ha publicado: tras un cambio de gateway, el nuevo puede haber visto
+// un hueco antes de que le llegara la secuencia del anterior, y sin eso pediría y publicaría otra vez lo mismo.
+class SeguimientoSecuencias
+{
+public:
+  // Fija la secuencia esperada de un nodo y sus huecos, por ejemplo los guardados antes de un reinicio del gateway. Los
+  // huecos se vuelven a pedir.
+  void restaurar(const uint8_t *mac, uint32_t siguienteSeq, const HuecoSecuencias *huecos = NULL, uint8_t numHuecos = 0)
+  {
+    EstadoNodo *nodo = buscar(mac, true);
+    if (nodo == NULL)
+      return;
+    nodo->siguienteSeq = siguienteSeq;
+    nodo->recibidoDesde = siguienteSeq;
+    nodo->numHuecos = 0;
+    for (uint8_t i = 0; i < numHuecos && i < MAX_HUECOS_NODO; i++)
+      insertarHueco(nodo, huecos[i].desde, huecos[i].hasta);
+  }
+
+  // Incorpora la secuencia esperada que anuncia otro gateway (solo la hace avanzar) y quita de los huecos lo que ese
+  // gateway ha publicado: el tramo [recibidoDesde, siguienteSeq) menos sus propios huecos, ordenados
+  void avanzar(const uint8_t *mac, uint32_t siguienteSeq, uint32_t recibidoDesde, const HuecoSecuencias *huecos, uint8_t numHuecos)
+  {
+    EstadoNodo *nodo = buscar(mac, true);
+    if (nodo == NULL)
+      return;
+    if (siguienteSeq > nodo->siguienteSeq)
+    {
+      // El tramo que se salta lo ha seguido el otro gateway: sus huecos se copian como ya pedidos (los pide él) para
+      // no anunciarlos como publicados. Si no los recupera, reintentarBackfill acaba pidiéndolos desde aquí.
+      if (recibidoDesde > nodo->siguienteSeq)
+        nodo->recibidoDesde = recibidoDesde; // Lo de antes no lo ha seguido nadie que se sepa
+      for (uint8_t i = 0; i < numHuecos; i++)
+      {
+        uint32_t desde = huecos[i].desde > nodo->siguienteSeq ? huecos[i].desde : nodo->siguienteSeq;
+        uint32_t hasta = huecos[i].hasta < siguienteSeq ? huecos[i].hasta : siguienteSeq - 1;
+        if (desde >= nodo->recibidoDesde && desde <= hasta)
+          insertarHueco(nodo, desde, hasta, true);
+      }
+      nodo->siguienteSeq = siguienteSeq;
+    }
+    uint32_t desde = recibidoDesde;
+    for (uint8_t i = 0; i < numHuecos && desde < siguienteSeq; i++)
+    {
+      if (huecos[i].hasta < desde)
+        continue;
+      if (huecos[i].desde > desde)
+        recortarHuecos(nodo, desde, (huecos[i].desde < siguienteSeq ? huecos[i].desde : siguienteSeq) - 1);
+      desde = huecos[i].hasta + 1;
+    }
+    if (desde < siguienteSeq)
+      recortarHuecos(nodo, desde, siguienteSeq - 1);
+  }
+
+  bool conocido(const uint8_t *mac) { return buscar(mac, false) != NULL; }
+
+  // Registra un MSG_DATA_BATCH. Si antes de él falta un rango, queda como hueco para pedirlo por backfill.
+  // primeraNueva es la secuencia de su primera lectura no recibida antes; las anteriores no hay que publicarlas.
+  ResultadoSecuencia registrar(const uint8_t *mac, uint32_t primerSeq, uint8_t numLecturas, uint32_t &primeraNueva)
+  {
+    EstadoNodo *nodo = buscar(mac, false);
+    ResultadoSecuencia resultado = SECUENCIA_NUEVA;
+    primeraNueva = primerSeq;
+
+    if (nodo == NULL) // Primer batch del nodo: no hay referencia con la que comparar
+    {
+      nodo = buscar(mac, true);
+      if (nodo == NULL)
+        return SECUENCIA_NUEVA;
+      nodo->recibidoDesde = primerSeq;
+    }
+    else if (primerSeq > nodo->siguienteSeq)
+    {
+      insertarHueco(nodo, nodo->siguienteSeq, primerSeq - 1);
+      resultado = SECUENCIA_HUECO;
+    }
+    else if (primerSeq + numLecturas + LECTURAS_POR_BATCH < nodo->siguienteSeq)
+    {
+      // La secuencia ha retrocedido: el nodo ha perdido su log (por ejemplo, partición borrada) y empieza de cero
+      nodo->numHuecos = 0;
+      nodo->recibidoDesde = primerSeq;
+    }
+    else if (primerSeq + numLecturas <= nodo->siguienteSeq)
+    {
+      primeraNueva = primerSeq + numLecturas;
+      return SECUENCIA_REPETIDA;
+    }
+    else
+    {
+      primeraNueva = nodo->siguienteSeq; // Se solapa con lo ya recibido
+    }
+
+    nodo->siguienteSeq = primerSeq + numLecturas;
+    descartarHuecosAntiguos(nodo);
+    reintentarBackfill(nodo);
+    return resultado;
+  }
+
+  // Registra un MSG_BACKFILL_DATA. Devuelve false si ninguna de sus lecturas está en un hueco; si no, [primeraNueva,
+  // ultimaNueva] es lo que hay que publicar y deja de ser hueco. Lo anterior del mismo hueco ya no está en el log del
+  // nodo (el backfill sigue por la primera lectura que conserva) y también se da por perdido.
+  bool registrarBackfill(const uint8_t *mac, uint32_t primerSeq, uint8_t numLecturas, uint32_t &primeraNueva, uint32_t &ultimaNueva)
+  {
+    EstadoNodo *nodo = buscar(mac, false);
+    if (nodo == NULL || numLecturas == 0)
+      return false;
+    uint32_t fin = primerSeq + numLecturas - 1;
+    for (int i = 0; i < nodo->numHuecos; i++)
+    {
+      HuecoSecuencias &hueco = nodo->huecos[i];
+      if (hueco.desde > fin || hueco.hasta < primerSeq)
+        continue;
+      nodo->batchesSinBackfill = 0;
+      primeraNueva = primerSeq > hueco.desde ? primerSeq : hueco.desde;
+      ultimaNueva = fin < hueco.hasta ? fin : hueco.hasta;
+      if (ultimaNueva >= hueco.hasta)
+        quitarHueco(nodo, i);
+      else
+        hueco.desde = ultimaNueva + 1;
+      return true;
+    }
+    return false;
+  }
+
+  // Devuelve a los huecos las lecturas [desde, hasta] ya registradas que no se han podido encolar, para pedirlas otra vez
+  void aplazar(const uint8_t *mac, uint32_t desde, uint32_t hasta)
+  {
+    EstadoNodo *nodo = buscar(mac, false);
+    if (nodo != NULL && desde <= hasta)
+      insertarHueco(nodo, desde, hasta);
+  }
+
+  // Devuelve un hueco que aún no se ha pedido y lo marca como pedido. Se limita a lo que cabe en el log del nodo.
+  bool huecoSinPedir(const uint8_t *mac, uint32_t &desde, uint32_t &hasta)
+  {
+    EstadoNodo *nodo = buscar(mac, false);
+    if (nodo == NULL)
+      return false;
+    for (int i = 0; i < nodo->numHuecos; i++)
+    {
+      HuecoSecuencias &hueco = nodo->huecos[i];
+      if (hueco.pedido)
+        continue;
+      if (hueco.hasta - hueco.desde + 1 > MAX_HUECO_BACKFILL)
+        hueco.desde = hueco.hasta + 1 - MAX_HUECO_BACKFILL; // Lo más antiguo ya no estará en el nodo
+      hueco.pedido = true;
+      desde = hueco.desde;
+      hasta = hueco.hasta;
+      return true;
+    }
+    return false;
+  }
+
+  // Copia los huecos de un nodo (para guardarlos) y devuelve cuántos son
+  uint8_t huecos(const uint8_t *mac, HuecoSecuencias *copia)
+  {
+    EstadoNodo *nodo = buscar(mac, false);
+    if (nodo == NULL)
+      return 0;
+    memcpy(copia, nodo->huecos, nodo->numHuecos * sizeof(HuecoSecuencias));
+    return nodo->numHuecos;
+  }
+
+  uint32_t recibidoDesde(const uint8_t *mac)
+  {
+    EstadoNodo *nodo = buscar(mac, false);
+    return nodo != NULL ? nodo->recibidoDesde : 0;
+  }
+
+  uint32_t siguienteSeq(const uint8_t *mac)
+  {
+    EstadoNodo *nodo = buscar(mac, false);
+    return nodo != NULL ? nodo->siguienteSeq : 0;
+  }
+
+private:
+  EstadoNodo *buscar(const uint8_t *mac, bool crear)
+  {
+    for (int i = 0; i < numNodos; i++)
+    {
+      if (memcmp(nodos[i].mac, mac, sizeof(nodos[i].mac)) == 0)
+        return &nodos[i];
+    }
+    if (!crear || numNodos >= MAX_NODOS)
+      return NULL;
+    memcpy(nodos[numNodos].mac, mac, sizeof(nodos[numNodos].mac));
+    nodos[numNodos].siguienteSeq = 0;
+    nodos[numNodos].recibidoDesde = 0;
+    nodos[numNodos].numHuecos = 0;
+    nodos[numNodos].batchesSinBackfill = 0;
+    return &nodos[numNodos++];
+  }
+
+  // Inserta un hueco en orden, uniéndolo con los vecinos que se solapan o son contiguos y están igual de pedidos. Con
+  // la tabla llena se da por perdido el hueco más antiguo: unir dos huecos separados haría pedir y publicar otra vez
+  // las lecturas de en medio, que ya se publicaron.
+  void insertarHueco(EstadoNodo *nodo, uint32_t desde, uint32_t hasta, bool pedido = false)
+  {
+    int i = 0;
+    while (i < nodo->numHuecos && nodo->huecos[i].desde < desde)
+      i++;
+    bool unirAnterior = i > 0 && nodo->huecos[i - 1].pedido == pedido && nodo->huecos[i - 1].hasta + 1 >= desde;
+    bool unirSiguiente = i < nodo->numHuecos && nodo->huecos[i].pedido == pedido && hasta + 1 >= nodo->huecos[i].desde;
+    if (!unirAnterior && !unirSiguiente)
+    {
+      if (nodo->numHuecos == MAX_HUECOS_NODO)
+      {
+        if (i == 0)
+          return; // El nuevo es el más antiguo
+        quitarHueco(nodo, 0);
+        i--;
+      }
+      memmove(&nodo->huecos[i + 1], &nodo->huecos[i], (nodo->numHuecos - i) * sizeof(HuecoSecuencias));
+      nodo->huecos[i] = HuecoSecuencias{desde, hasta, pedido};
+      nodo->numHuecos++;
+      return;
+    }
+    if (unirAnterior)
+      i--;
+
+    HuecoSecuencias &hueco = nodo->huecos[i];
+    hueco.desde = desde < hueco.desde ? desde : hueco.desde;
+    hueco.hasta = hasta > hueco.hasta ? hasta : hueco.hasta;
+    while (i + 1 < nodo->numHuecos && nodo->huecos[i + 1].desde <= hueco.hasta + 1) // El hueco ampliado puede alcanzar al siguiente
+    {
+      if (nodo->huecos[i + 1].hasta > hueco.hasta)
+        hueco.hasta = nodo->huecos[i + 1].hasta;
+      quitarHueco(nodo, i + 1);
+    }
+  }
+
+  // Quita [desde, hasta] de los huecos. Si hay que partir un hueco y la tabla está llena se queda solo la parte
+  // posterior: como en insertarHueco, se pierde lo más antiguo antes que publicar algo dos veces.
+  void recortarHuecos(EstadoNodo *nodo, uint32_t desde, uint32_t hasta)
+  {
+    for (int i = 0; i < nodo->numHuecos; i++)
+    {
+      HuecoSecuencias &hueco = nodo->huecos[i];
+      if (hueco.desde > hasta || hueco.hasta < desde)
+        continue;
+      if (hueco.desde >= desde && hueco.hasta <= hasta)
+      {
+        quitarHueco(nodo, i--);
+      }
+      else if (hueco.desde >= desde)
+      {
+        hueco.desde = hasta + 1;
+      }
+      else if (hueco.hasta <= hasta)
+      {
+        hueco.hasta = desde - 1;
+      }
+      else if (nodo->numHuecos == MAX_HUECOS_NODO)
+      {
+        hueco.desde = hasta + 1;
+      }
+      else
+      {
+        memmove(&nodo->huecos[i + 1], &nodo->huecos[i], (nodo->numHuecos - i) * sizeof(HuecoSecuencias));
+        nodo->numHuecos++;
+        nodo->huecos[i].hasta = desde - 1;
+        nodo->huecos[i + 1].desde = hasta + 1;
+        i++;
+      }
+    }
+  }
+
+  void quitarHueco(EstadoNodo *nodo, int i)
+  {
+    memmove(&nodo->huecos[i], &nodo->huecos[i + 1], (nodo->numHuecos - i - 1) * sizeof(HuecoSecuencias));
+    nodo->numHuecos--;
+  }
+
+  // Si la petición o su respuesta se han perdido (o el nodo tenía la cola de peticiones llena), el nodo sigue enviando
+  // batches sin que llegue nada del backfill: los huecos pedidos se vuelven a pedir
+  void reintentarBackfill(EstadoNodo *nodo)
+  {
+    bool pedidos = false;
+    for (int i = 0; i < nodo->numHuecos; i++)
+      pedidos = pedidos || nodo->huecos[i].pedido;
+    if (!pedidos || ++nodo->batchesSinBackfill < BATCHES_REINTENTO_BACKFILL)
+      return;
+    for (int i = 0; i < nodo->numHuecos; i++)
+      nodo->huecos[i].pedido = false;
+    nodo->batchesSinBackfill = 0;
+  }
+
+  // Lo que ha quedado más de MAX_HUECO_BACKFILL lecturas por detrás ya no está en el log del nodo
+  void descartarHuecosAntiguos(EstadoNodo *nodo)
+  {
+    while (nodo->numHuecos > 0 && nodo->siguienteSeq - nodo->huecos[0].hasta > MAX_HUECO_BACKFILL)
+      quitarHueco(nodo, 0);
+  }
+
+  EstadoNodo nodos[MAX_NODOS];
+  int numNodos = 0;
+};
+
+// Lee la cabecera de un MSG_DATA_BATCH/MSG_BACKFILL_DATA sin copiar las lecturas
+inline bool leerCabeceraBatch(const RxFrame *trama, uint32_t &primerSeq, uint8_t &numLecturas)
+{
+  if (trama->len < offsetof(DataBatch, lecturas))
+    return false;
+  memcpy(&numLecturas, &trama->data[offsetof(DataBatch, numLecturas)], sizeof(numLecturas));
+  memcpy(&primerSeq, &trama->data[offsetof(DataBatch, primerSeq)], sizeof(primerSeq));
+  return true;
+}
+
+inline void formatearIdNodo(const uint8_t *mac, char *id) // MAC sin separadores, usada como node_id en los topics
+{
+  snprintf(id, 13, "%02x%02x%02x%02x%02x%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
+// Publicación retenida con la secuencia esperada de un nodo. Los demás gateways la incorporan a su seguimiento, así
+// no publican otra vez los batches que el nodo les reenvíe tras un fallo ni piden backfill de lo que ya llegó por este.
+// Los huecos van al final, como lista plana [desde, hasta, desde, hasta, ...].
+inline void construirPublicacionSecuencia(PendingPublish *publicacion, const char *red, const char *gateway, const uint8_t *mac, uint32_t siguienteSeq,
+                                         uint32_t recibidoDesde, const HuecoSecuencias *huecos, uint8_t numHuecos)
+{
+  char nodo[13];
+  formatearIdNodo(mac, nodo);
+  snprintf(publicacion->topic, sizeof(publicacion->topic), "/%s/%s/%s", red, TIPO_SECUENCIA, nodo);
+  char lista[MAX_HUECOS_NODO * 24] = "";
+  for (uint8_t i = 0; i < numHuecos && i < MAX_HUECOS_NODO; i++)
+  {
+    size_t len = strlen(lista);
+    snprintf(lista + len, sizeof(lista) - len, "%s%u, %u", i > 0 ? ", " : "", (unsigned)huecos[i].desde, (unsigned)huecos[i].hasta);
+  }
+  snprintf(publicacion->payload, sizeof(publicacion->payload), "{\"siguiente\": %u, \"desde\": %u, \"gateway\": \"%s\", \"huecos\": [%s]}",
+           (unsigned)siguienteSeq, (unsigned)recibidoDesde, gateway, lista);
+  publicacion->retener = true;
+}
+
+// Lee una publicación de secuencia. Devuelve false si el mensaje no lo es o si lo publicó el propio gateway. Sin
+// "desde" (gateways con firmware anterior) el tramo seguido queda vacío. huecos debe tener sitio para MAX_HUECOS_NODO.
+inline bool leerPublicacionSecuencia(const char *topic, const uint8_t *payload, size_t len, const char *gateway, uint8_t *mac, uint32_t &siguienteSeq,
+                                     uint32_t &recibidoDesde, HuecoSecuencias *huecos, uint8_t &numHuecos)
+{
+  const char *nodo = strrchr(topic, '/');
+  if (nodo == NULL || strlen(nodo + 1) != 12 || len >= MAX_PAYLOAD)
+    return false;
+  for (int i = 0; i < 6; i++)
+  {
+    unsigned int byte;
+    if (sscanf(nodo + 1 + 2 * i, "%2x", &byte) != 1)
+      return false;
+    mac[i] = (uint8_t)byte;
+  }
+
+  char texto[MAX_PAYLOAD]; // El payload de MQTT no termina en '\0'
+  memcpy(texto, payload, len);
+  texto[len] = '\0';
+  const char *siguiente = strstr(texto, "\"siguiente\":");
+  const char *origen = strstr(texto, "\"gateway\":");
+  if (siguiente == NULL)
+    return false;
+  if (origen != NULL)
+  {
+    origen = strchr(origen + 10, '"');
+    if (origen != NULL && strncmp(origen + 1, gateway, strlen(gateway)) == 0 && origen[1 + strlen(gateway)] == '"')
+      return false;
+  }
+  siguienteSeq = (uint32_t)strtoul(siguiente + 12, NULL, 10);
+  const char *desde = strstr(texto, "\"desde\":");
+  recibidoDesde = desde != NULL ? (uint32_t)strtoul(desde + 8, NULL, 10) : siguienteSeq;
+  numHuecos = 0;
+  const char *lista = strstr(texto, "\"huecos\": [");
+  if (lista == NULL)
+    return true;
+  char *fin = (char *)lista + 11;
+  while (numHuecos < MAX_HUECOS_NODO && *fin != ']')
+  {
+    char *siguienteValor;
+    huecos[numHuecos].desde = (uint32_t)strtoul(fin, &siguienteValor, 10);
+    if (siguienteValor == fin || *siguienteValor != ',')
+      break;
+    huecos[numHuecos].hasta = (uint32_t)strtoul(siguienteValor + 1, &fin, 10);
+    huecos[numHuecos].pedido = false;
+    numHuecos++;
+    if (*fin == ',')
+      fin++;
+  }
+  return true;
+}
+
+inline const char *formatearValor(float valor, char *texto, size_t len) // Las lecturas fallidas del DHT (NaN) se publican como null
+{
+  if (isnan(valor))
+    snprintf(texto, len, "null");
+  else
+    snprintf(texto, len, "%.2f", valor);
+  return texto;
+}
+
+// Convierte una trama recibida en sus publicaciones MQTT, siguiendo el esquema /red/tipo_dato/nodo.
+// reservar() devuelve un bloque libre (o NULL) y entregar() pasa el bloque a la siguiente etapa, que se queda con él.
+// Solo se publican las lecturas de un batch con secuencia entre primeraNueva y ultimaNueva; el resto ya se publicaron.
+// Es independiente del hardware para poder ejecutarse también en el host. Devuelve el número de publicaciones entregadas.
+template <typename Reservar, typename Entregar>
+size_t construirPublicaciones(const RxFrame *trama, const char *red, Reservar reservar, Entregar entregar, uint32_t primeraNueva = 0,
+                              uint32_t ultimaNueva = UINT32_MAX)
+{
+  char nodo[13];
+  char valor[16];
+  size_t entregadas = 0;
+  formatearIdNodo(trama->mac, nodo);
+
+  if (trama->len < 1)
+    return 0;
+
+  switch ((MessageType)trama->data[0])
+  {
+  case MSG_DATA_BATCH:
+  case MSG_BACKFILL_DATA:
+  {
+    DataBatch batch;
+    if (trama->len < offsetof(DataBatch, lecturas) || trama->len > sizeof(batch))
+      return 0;
+    memcpy(&batch, trama->data, trama->len);
+    if (batch.numLecturas > LECTURAS_POR_BATCH || trama->len != offsetof(DataBatch, lecturas) + batch.numLecturas * sizeof(DataReading))
+      return 0;
+
+    uint32_t omitidas = primeraNueva > batch.primerSeq ? primeraNueva - batch.primerSeq : 0; // Ya publicadas
+    for (uint32_t i = omitidas; i < batch.numLecturas && batch.primerSeq + i <= ultimaNueva; i++)
+    {
+      const DataReading &lectura = batch.lecturas[i];
+      const char *tipos[PUBLICACIONES_POR_LECTURA] = {"temperature", "humidity", "potentiometer"};
+      for (int t = 0; t < PUBLICACIONES_POR_LECTURA; t++)
+      {
+        PendingPublish *publicacion = reservar();
+        if (publicacion == NULL)
+          return entregadas;
+
+        if (t == 0)
+          formatearValor(lectura.temperatura, valor, sizeof(valor));
+        else if (t == 1)
+          formatearValor(lectura.humedad, valor, sizeof(valor));
+        else
+          snprintf(valor, sizeof(valor), "%d", (int)lectura.porcentaje);
+
+        snprintf(publicacion->topic, sizeof(publicacion->topic), "/%s/%s/%s", red, tipos[t], nodo);
+        publicacion->retener = false;
+        snprintf(publicacion->payload, sizeof(publicacion->payload), "{\"valor\": %s, \"timestamp\": %u, \"seq\": %u}",
+                 valor, (unsigned)lectura.timestamp, (unsigned)(batch.primerSeq + i));
+        entregar(publicacion);
+        entregadas++;
+      }
+    }
+    break;
+  }
+  case MSG_PRESENCE:
+  {
+    PresenceNotification notificacion;
+    if (trama->len != sizeof(notificacion))
+      return 0;
+    memcpy(&notificacion, trama->data, sizeof(notificacion));
+
+    PendingPublish *publicacion = reservar();
+    if (publicacion == NULL)
+      return 0;
+    snprintf(publicacion->topic, sizeof(publicacion->topic), "/%s/presence/%s", red, nodo);
+    publicacion->retener = false;
+    snprintf(publicacion->payload, sizeof(publicacion->payload), "{\"valor\": %s, \"timestamp\": %u}",
+             notificacion.presencia ? "true" : "false", (unsigned)notificacion.timestamp);
+    entregar(publicacion);
+    entregadas++;
+    break;
+  }
+  case MSG_NODE_STATUS:
+  {
+    NodeStatus estado;
+    if (trama->len != sizeof(estado))
+      return 0;
+    memcpy(&estado, trama->data, sizeof(estado));
+
+    PendingPublish *publicacion = reservar();
+    if (publicacion == NULL)
+      return 0;
+    snprintf(publicacion->topic, sizeof(publicacion->topic), "/%s/board_status/%s", red, nodo);
+    publicacion->retener = false;
+    snprintf(publicacion->payload, sizeof(publicacion->payload), "{\"reboot_count\": %d, \"uptime\": %u}",
+             (int)estado.rebootCount, (unsigned)estado.uptime);
+    entregar(publicacion);
+    entregadas++;
+    break;
+  }
+  default: // Los mensajes de control (hora, backfill) no se publican
+    break;
+  }
+  return entregadas;
+}
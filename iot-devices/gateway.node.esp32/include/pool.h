@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef ARDUINO
+#include <freertos/FreeRTOS.h>
+#else
+#include <mutex>
+#endif
+
+// Pool de bloques de tamaño fijo reservado de forma estática en el arranque. Evita pasar por el heap
+// en el camino de los mensajes, por lo que la fragmentación no crece aunque el gateway funcione durante meses.
+// Los bloques se entregan como punteros: quien hace allocate() es el propietario hasta que lo pasa a otra etapa
+// (por ejemplo a través de una cola de FreeRTOS) o llama a release().
+template <typename T, size_t N>
+class StaticPool
+{
+public:
+  StaticPool()
+  {
+    for (size_t i = 0; i < N; i++)
+    {
+      libres[i] = &bloques[N - 1 - i]; // Se apilan al revés para entregar primero el bloque 0
+    }
+    numLibres = N;
+  }
+
+  T *allocate()
+  {
+    T *bloque = nullptr;
+    bloquear();
+    if (numLibres > 0)
+    {
+      bloque = libres[--numLibres];
+      totalReservas++;
+      if (N - numLibres > maxOcupados)
+        maxOcupados = N - numLibres;
+    }
+    else
+    {
+      fallosReserva++; // Pool agotado: el llamante decide si descarta el mensaje
+    }
+    desbloquear();
+    return bloque;
+  }
+
+  void release(T *bloque)
+  {
+    if (bloque == nullptr)
+      return;
+    bloquear();
+    libres[numLibres++] = bloque;
+    desbloquear();
+  }
+
+  bool owns(const T *bloque) const { return bloque >= &bloques[0] && bloque < &bloques[N]; }
+
+  size_t capacity() const { return N; }
+  size_t inUse() const { return N - numLibres; }
+  size_t highWater() const { return maxOcupados; }
+  uint32_t failures() const { return fallosReserva; }
+  uint32_t allocations() const { return totalReservas; }
+
+private:
+#ifdef ARDUINO
+  void bloquear() { portENTER_CRITICAL(&mux); }
+  void desbloquear() { portEXIT_CRITICAL(&mux); }
+  portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED; // Protege la lista libre entre el callback de ESP-NOW y las tareas
+#else
+  void bloquear() { mux.lock(); }
+  void desbloquear() { mux.unlock(); }
+  std::mutex mux; // En el host (herramientas nativas) basta con un mutex normal
+#endif
+
+  T bloques[N];               // Almacenamiento de los bloques, reservado una sola vez
+  T *libres[N];               // Pila de bloques libres
+  volatile size_t numLibres;  // Número de bloques disponibles
+  size_t maxOcupados = 0;     // Máximo de bloques ocupados a la vez (marca de agua)
+  uint32_t fallosReserva = 0; // Veces que se pidió un bloque con el pool vacío
+  uint32_t totalReservas = 0; // Total de reservas servidas
+};
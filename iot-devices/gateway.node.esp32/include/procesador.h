@@ -0,0 +1,327 @@
+#pragma once
+
+#include "pipeline.h"
+#include "pool.h"
+
+// Camino de los mensajes del gateway desde que frame_processor saca una trama de rxQueue hasta que loop() la publica
+// o la aparca en el backlog. No depende del hardware: el firmware, el replay (src/replay) y la prueba de resistencia
+// (src/soak) ejecutan este mismo código, cada uno con su Plataforma, que pone lo que sí depende del entorno:
+//
+//   bool encolar(PendingPublish *p)        pasa p a pubQueue sin esperar (xQueueSend con timeout 0)
+//   size_t huecosCola()                    huecos libres en pubQueue (uxQueueSpacesAvailable)
+//   bool sacar(PendingPublish *&p)         saca de pubQueue sin esperar (xQueueReceive con timeout 0)
+//   bool publicar(const PendingPublish *p) publica en el broker
+//   bool conBroker()                       hay conexión con el broker (sin ella no se pide backfill)
+//   bool alcanzable(const uint8_t *mac)    se le puede enviar al nodo (está o se ha podido registrar como peer)
+//   void enviar(const uint8_t *mac, const uint8_t *datos, size_t len)  trama ESP-NOW a un nodo
+//   void atenderHora(const RxFrame *t)     responde a un MSG_TIME_REQUEST
+//   void bloquear(), desbloquear()         exclusión de las secuencias entre frame_processor y el callback MQTT
+//   bool cargarSecuencia(const uint8_t *mac, uint32_t &siguienteSeq, HuecoSecuencias *huecos, uint8_t &numHuecos)
+//   void guardarSecuencia(const uint8_t *mac, uint32_t siguienteSeq, const HuecoSecuencias *huecos, uint8_t numHuecos)
+//   uint32_t ahoraMs()                     millis()
+//
+// procesarTrama() lo llama solo frame_processor; vaciarPublicaciones() e incorporarSecuencia() solo loop(). El backlog
+// es de loop() y no se protege; las secuencias se comparten y van siempre entre bloquear() y desbloquear().
+template <typename Plataforma, typename PoolPublicaciones = StaticPool<PendingPublish, NUM_PUBLICACIONES>,
+          typename PoolBacklog = StaticPool<BacklogRecord, NUM_REGISTROS_BACKLOG>>
+class ProcesadorTramas
+{
+public:
+  ProcesadorTramas(Plataforma &plataforma, PoolPublicaciones &pubPool, PoolBacklog &backlogPool, const char *red, const char *gateway)
+      : plataforma(plataforma), pubPool(pubPool), backlogPool(backlogPool), red(red), gateway(gateway) {}
+
+  // Trabajo de frame_processor con una trama; la trama sigue siendo del llamante, que la devuelve a su pool
+  void procesarTrama(const RxFrame *trama)
+  {
+    if (trama->len < 1)
+      return;
+    switch ((MessageType)trama->data[0]) // El primer byte indica el tipo de mensaje
+    {
+    case MSG_TIME_REQUEST:
+      plataforma.atenderHora(trama);
+      break;
+    case MSG_DATA_BATCH:
+    case MSG_BACKFILL_DATA:
+      procesarBatch(trama);
+      break;
+    default:
+      publicarTrama(trama, 0, UINT32_MAX, 0);
+      break;
+    }
+  }
+
+  // Trabajo de loop() en cada vuelta. Primero lo que quedó en el backlog, para mantener el orden de publicación. Con el
+  // backlog lleno se deja de sacar de pubQueue en lugar de descartar publicaciones ya aceptadas: al llenarse la cola,
+  // frame_processor no puede encolar y devuelve esas lecturas a los huecos del nodo para pedirlas por backfill.
+  void vaciarPublicaciones(bool conBroker)
+  {
+    vaciarBacklog(conBroker);
+
+    PendingPublish *publicacion;
+    while (backlogPool.inUse() < backlogPool.capacity() && plataforma.sacar(publicacion))
+    {
+      // Con el backlog sin vaciar lo nuevo va detrás, aunque el broker haya vuelto
+      if (backlogHead == NULL && conBroker && plataforma.publicar(publicacion))
+        pubPool.release(publicacion); // Publicada: el bloque vuelve al pool
+      else
+        aparcarEnBacklog(publicacion); // El backlog pasa a ser el propietario del bloque
+    }
+  }
+
+  // Publicación de secuencia de otro gateway, recibida por MQTT en loop()
+  void incorporarSecuencia(const char *topic, const uint8_t *payload, size_t len)
+  {
+    uint8_t mac[6];
+    uint32_t siguienteSeq, recibidoDesde;
+    HuecoSecuencias huecos[MAX_HUECOS_NODO];
+    uint8_t numHuecos;
+    if (!leerPublicacionSecuencia(topic, payload, len, gateway, mac, siguienteSeq, recibidoDesde, huecos, numHuecos))
+      return;
+
+    plataforma.bloquear();
+    secuencias.avanzar(mac, siguienteSeq, recibidoDesde, huecos, numHuecos);
+    plataforma.desbloquear();
+  }
+
+  // Pasa una publicación a loop(). Si la cola está llena, libera el bloque y cuenta el descarte.
+  bool encolarPublicacion(PendingPublish *publicacion)
+  {
+    if (!plataforma.encolar(publicacion))
+    {
+      pubPool.release(publicacion);
+      publicacionesDescartadas++;
+      return false;
+    }
+    return true;
+  }
+
+  // Olvida la secuencia de todos los nodos, como un gateway recién arrancado (la guardada la vuelve a cargar la plataforma)
+  void reiniciarSecuencias()
+  {
+    plataforma.bloquear();
+    secuencias = SeguimientoSecuencias();
+    plataforma.desbloquear();
+  }
+
+  uint32_t publicacionesDescartadas = 0; // Publicaciones perdidas por pool, cola o backlog llenos
+  uint32_t tramasRepetidas = 0;          // Batches y backfills sin nada nuevo (reintentos, o ya publicados por otro gateway)
+  uint32_t huecosDetectados = 0;         // Batches que llegan con lecturas perdidas antes
+  uint32_t backfillsPedidos = 0;         // Peticiones de backfill enviadas
+
+private:
+  // Sigue la secuencia del nodo y publica solo lo que no se ha publicado aún: de un MSG_DATA_BATCH lo que no había
+  // llegado antes (a este gateway o a otro) y de un MSG_BACKFILL_DATA lo que cae en un hueco. Las lecturas que no se
+  // pueden encolar vuelven a los huecos, de modo que la secuencia guardada nunca da por publicado algo que se ha perdido.
+  // Nada de Serial por batch: a 9600 baudios bloquearía frame_processor. Se cuenta y lo informa memory_status_updater.
+  void procesarBatch(const RxFrame *trama)
+  {
+    uint32_t primerSeq;
+    uint8_t numLecturas;
+    if (!leerCabeceraBatch(trama, primerSeq, numLecturas) || numLecturas == 0)
+      return;
+
+    bool backfill = trama->data[0] == MSG_BACKFILL_DATA;
+    uint32_t primeraNueva = primerSeq, ultimaNueva = primerSeq + numLecturas - 1;
+    bool publicar;
+    PendingPublish *anuncio = NULL;
+    plataforma.bloquear();
+    if (!secuencias.conocido(trama->mac))
+    {
+      // Así también se detectan los huecos de cuando el gateway estaba apagado
+      uint32_t siguienteSeq;
+      HuecoSecuencias huecos[MAX_HUECOS_NODO];
+      uint8_t numHuecos = 0;
+      if (plataforma.cargarSecuencia(trama->mac, siguienteSeq, huecos, numHuecos))
+        secuencias.restaurar(trama->mac, siguienteSeq, huecos, numHuecos);
+    }
+    if (backfill)
+    {
+      publicar = secuencias.registrarBackfill(trama->mac, primerSeq, numLecturas, primeraNueva, ultimaNueva);
+    }
+    else
+    {
+      ResultadoSecuencia resultado = secuencias.registrar(trama->mac, primerSeq, numLecturas, primeraNueva);
+      publicar = resultado != SECUENCIA_REPETIDA;
+      if (resultado == SECUENCIA_HUECO)
+        huecosDetectados++;
+    }
+    plataforma.desbloquear();
+
+    if (!publicar)
+    {
+      // Ya publicado, por este gateway o por otro al que el nodo lo envió antes de cambiar de gateway
+      tramasRepetidas++;
+    }
+    else
+    {
+      // El anuncio se reserva antes que las lecturas: si se quedase sin sitio, otro gateway pediría y publicaría otra
+      // vez lo que se acaba de publicar. Se encola después, para que quien lo vea pueda darlas por publicadas.
+      anuncio = pubPool.allocate();
+      if (anuncio == NULL)
+        publicacionesDescartadas++;
+      uint32_t encoladas = publicarTrama(trama, primeraNueva, ultimaNueva, anuncio != NULL ? 1 : 0);
+      if (primeraNueva + encoladas <= ultimaNueva)
+      {
+        plataforma.bloquear();
+        secuencias.aplazar(trama->mac, primeraNueva + encoladas, ultimaNueva);
+        plataforma.desbloquear();
+      }
+      if (backfill && encoladas == 0 && anuncio != NULL) // Un backfill que no ha cabido no cambia nada que anunciar
+      {
+        pubPool.release(anuncio);
+        anuncio = NULL;
+      }
+    }
+
+    pedirBackfill(trama->mac);
+    guardarSecuencia(trama->mac);
+    if (anuncio != NULL)
+      anunciarSecuencia(trama->mac, anuncio);
+  }
+
+  // Devuelve cuántas lecturas de un batch, a partir de primeraNueva, han quedado encoladas completas. Se encolan solo
+  // lecturas completas y en orden, así que las que no caben son un rango al final que se puede pedir por backfill.
+  // reservadas son los huecos de pubQueue que hay que dejar libres para lo que se encola después.
+  uint32_t publicarTrama(const RxFrame *trama, uint32_t primeraNueva, uint32_t ultimaNueva, size_t reservadas)
+  {
+    PendingPublish *publicaciones[PUBLICACIONES_POR_LECTURA * LECTURAS_POR_BATCH];
+    size_t num = construirPublicaciones(
+        trama, red,
+        [this]() -> PendingPublish *
+        {
+          PendingPublish *publicacion = pubPool.allocate();
+          if (publicacion == NULL)
+            publicacionesDescartadas++;
+          return publicacion;
+        },
+        [&publicaciones, n = (size_t)0](PendingPublish *publicacion) mutable { publicaciones[n++] = publicacion; },
+        primeraNueva, ultimaNueva);
+
+    bool batch = trama->data[0] == MSG_DATA_BATCH || trama->data[0] == MSG_BACKFILL_DATA;
+    size_t encolables = num;
+    if (batch)
+    {
+      size_t libres = plataforma.huecosCola();
+      libres = libres > reservadas ? libres - reservadas : 0;
+      if (encolables > libres)
+        encolables = libres;
+      encolables -= encolables % PUBLICACIONES_POR_LECTURA;
+    }
+
+    size_t encoladas = 0;
+    for (size_t i = 0; i < num; i++)
+    {
+      if (encoladas == i && i < encolables)
+      {
+        if (encolarPublicacion(publicaciones[i])) // Si falla, ya libera el bloque y cuenta el descarte
+          encoladas++;
+      }
+      else
+      {
+        pubPool.release(publicaciones[i]);
+        publicacionesDescartadas++;
+      }
+    }
+    return encoladas / PUBLICACIONES_POR_LECTURA;
+  }
+
+  // Sin broker no se pide nada: lo que llegase se quedaría sin sitio. Los huecos siguen guardados y se piden con el
+  // primer batch del nodo después de reconectar.
+  void pedirBackfill(const uint8_t *mac)
+  {
+    if (!plataforma.conBroker() || !plataforma.alcanzable(mac))
+      return;
+
+    BackfillRequest peticion;
+    peticion.modo = BACKFILL_POR_SECUENCIA;
+    uint32_t desde, hasta; // BackfillRequest es packed: sus campos no se pueden pasar por referencia
+    for (;;)
+    {
+      plataforma.bloquear();
+      bool hayHueco = secuencias.huecoSinPedir(mac, desde, hasta);
+      plataforma.desbloquear();
+      if (!hayHueco)
+        return;
+      peticion.desde = desde;
+      peticion.hasta = hasta;
+      backfillsPedidos++;
+      plataforma.enviar(mac, (const uint8_t *)&peticion, sizeof(peticion));
+    }
+  }
+
+  void guardarSecuencia(const uint8_t *mac)
+  {
+    HuecoSecuencias huecos[MAX_HUECOS_NODO];
+    plataforma.bloquear();
+    uint32_t siguienteSeq = secuencias.siguienteSeq(mac);
+    uint8_t numHuecos = secuencias.huecos(mac, huecos);
+    plataforma.desbloquear();
+    plataforma.guardarSecuencia(mac, siguienteSeq, huecos, numHuecos);
+  }
+
+  void anunciarSecuencia(const uint8_t *mac, PendingPublish *publicacion)
+  {
+    HuecoSecuencias huecos[MAX_HUECOS_NODO];
+    plataforma.bloquear();
+    uint32_t siguienteSeq = secuencias.siguienteSeq(mac);
+    uint32_t recibidoDesde = secuencias.recibidoDesde(mac);
+    uint8_t numHuecos = secuencias.huecos(mac, huecos);
+    plataforma.desbloquear();
+    construirPublicacionSecuencia(publicacion, red, gateway, mac, siguienteSeq, recibidoDesde, huecos, numHuecos);
+    encolarPublicacion(publicacion);
+  }
+
+  void aparcarEnBacklog(PendingPublish *publicacion)
+  {
+    BacklogRecord *registro = backlogPool.allocate();
+    if (registro == NULL) // Backlog lleno: se descarta el registro más antiguo para hacer sitio
+    {
+      registro = backlogHead;
+      backlogHead = registro->siguiente;
+      if (backlogHead == NULL)
+        backlogTail = NULL;
+      pubPool.release(registro->publicacion);
+      publicacionesDescartadas++;
+    }
+
+    registro->publicacion = publicacion;
+    registro->primerFalloMs = plataforma.ahoraMs();
+    registro->intentos = 1;
+    registro->siguiente = NULL;
+
+    if (backlogTail != NULL)
+      backlogTail->siguiente = registro;
+    else
+      backlogHead = registro;
+    backlogTail = registro;
+  }
+
+  void vaciarBacklog(bool conBroker)
+  {
+    while (backlogHead != NULL && conBroker)
+    {
+      BacklogRecord *registro = backlogHead;
+      if (!plataforma.publicar(registro->publicacion))
+      {
+        if (registro->intentos < UINT8_MAX)
+          registro->intentos++;
+        return; // Se reintenta en la siguiente vuelta de loop()
+      }
+
+      backlogHead = registro->siguiente;
+      if (backlogHead == NULL)
+        backlogTail = NULL;
+      pubPool.release(registro->publicacion);
+      backlogPool.release(registro);
+    }
+  }
+
+  Plataforma &plataforma;
+  PoolPublicaciones &pubPool;
+  PoolBacklog &backlogPool;
+  const char *red;     // Identificador de la red IoT privada, primer nivel de los topics
+  const char *gateway; // Identificador de este gateway en las publicaciones de secuencia
+  SeguimientoSecuencias secuencias; // Secuencia esperada de cada nodo sensor, para detectar lecturas perdidas y repetidas
+  BacklogRecord *backlogHead = NULL; // Primer registro del backlog (solo lo usa loop())
+  BacklogRecord *backlogTail = NULL; // Último registro del backlog
+};
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "pipeline.h"
+
+// Formato binario de las trazas de tráfico ESP-NOW (compartido por el gateway y por la herramienta de replay):
+//
+//   cabecera: "ENTR" | versión (1 byte) | 3 bytes reservados | epoch UTC del inicio de la captura (4 bytes, little endian)
+//   registro: delta en microsegundos desde el registro anterior (varint) | MAC | longitud (1 byte) | datos
+//
+// La MAC se guarda como índice de 1 byte en la tabla de MACs de la traza; la primera vez que aparece una MAC se
+// escribe TRAZA_MAC_NUEVA seguido de los 6 bytes y recibe el siguiente índice libre. Así un registro típico añade
+// solo 3-4 bytes a la trama.
+
+#define TRAZA_MAGIC "ENTR"
+#define TRAZA_VERSION 1
+#define TRAZA_CABECERA 12           // Tamaño de la cabecera del fichero
+#define TRAZA_MAX_MACS 32           // MACs distintas que se indexan en una traza
+#define TRAZA_MAC_NUEVA 0xFF        // Marca de MAC que aún no está en la tabla
+#define TRAZA_MAX_REGISTRO (10 + 1 + 6 + 1 + MAX_TRAMA_ESPNOW) // Peor caso de un registro codificado
+
+inline size_t escribirCabeceraTraza(uint8_t *destino, uint32_t epoch)
+{
+  memcpy(destino, TRAZA_MAGIC, 4);
+  destino[4] = TRAZA_VERSION;
+  destino[5] = destino[6] = destino[7] = 0;
+  for (int i = 0; i < 4; i++)
+    destino[8 + i] = (uint8_t)(epoch >> (8 * i));
+  return TRAZA_CABECERA;
+}
+
+inline bool leerCabeceraTraza(const uint8_t *origen, size_t len, uint32_t &epoch)
+{
+  if (len < TRAZA_CABECERA || memcmp(origen, TRAZA_MAGIC, 4) != 0 || origen[4] != TRAZA_VERSION)
+    return false;
+  epoch = 0;
+  for (int i = 0; i < 4; i++)
+    epoch |= (uint32_t)origen[8 + i] << (8 * i);
+  return true;
+}
+
+class TablaMacs // Tabla de MACs de una traza, idéntica en el codificador y en el decodificador
+{
+public:
+  int buscar(const uint8_t *mac) const
+  {
+    for (int i = 0; i < numMacs; i++)
+    {
+      if (memcmp(macs[i], mac, 6) == 0)
+        return i;
+    }
+    return -1;
+  }
+
+  int insertar(const uint8_t *mac)
+  {
+    if (numMacs >= TRAZA_MAX_MACS)
+      return -1;
+    memcpy(macs[numMacs], mac, 6);
+    return numMacs++;
+  }
+
+  const uint8_t *mac(int indice) const { return indice >= 0 && indice < numMacs ? macs[indice] : NULL; }
+  void reset() { numMacs = 0; }
+
+private:
+  uint8_t macs[TRAZA_MAX_MACS][6];
+  int numMacs = 0;
+};
+
+class CodificadorTraza
+{
+public:
+  void reset()
+  {
+    tabla.reset();
+    ultimoMicros = 0;
+    primero = true;
+  }
+
+  // Codifica una trama recibida en destino (al menos TRAZA_MAX_REGISTRO bytes) y devuelve los bytes escritos
+  size_t codificar(const RxFrame *trama, uint8_t *destino)
+  {
+    return codificar(trama->mac, trama->data, trama->len, trama->rxMicros, destino);
+  }
+
+  // Igual, a partir de lo que recibe el callback de ESP-NOW, para grabar la trama antes de copiarla a un bloque del pool
+  size_t codificar(const uint8_t *mac, const uint8_t *data, uint8_t len, uint64_t rxMicros, uint8_t *destino)
+  {
+    size_t n = 0;
+    uint64_t delta = primero ? 0 : rxMicros - ultimoMicros;
+    ultimoMicros = rxMicros;
+    primero = false;
+
+    do // varint: 7 bits por byte, el bit alto indica que siguen más bytes
+    {
+      uint8_t octeto = delta & 0x7F;
+      delta >>= 7;
+      destino[n++] = octeto | (delta ? 0x80 : 0);
+    } while (delta);
+
+    int indice = tabla.buscar(mac);
+    if (indice >= 0)
+    {
+      destino[n++] = (uint8_t)indice;
+    }
+    else // MAC nueva (o tabla llena): se escribe completa
+    {
+      tabla.insertar(mac);
+      destino[n++] = TRAZA_MAC_NUEVA;
+      memcpy(&destino[n], mac, 6);
+      n += 6;
+    }
+
+    destino[n++] = len;
+    memcpy(&destino[n], data, len);
+    return n + len;
+  }
+
+private:
+  TablaMacs tabla;
+  uint64_t ultimoMicros = 0;
+  bool primero = true;
+};
+
+class DecodificadorTraza
+{
+public:
+  // Decodifica el registro que empieza en origen. Devuelve los bytes consumidos o 0 si el registro está incompleto o dañado.
+  size_t decodificar(const uint8_t *origen, size_t len, RxFrame *trama)
+  {
+    size_t n = 0;
+    uint64_t delta = 0;
+    for (int desplazamiento = 0;; desplazamiento += 7)
+    {
+      if (n >= len || desplazamiento > 63)
+        return 0;
+      uint8_t octeto = origen[n++];
+      delta |= (uint64_t)(octeto & 0x7F) << desplazamiento;
+      if (!(octeto & 0x80))
+        break;
+    }
+
+    if (n >= len)
+      return 0;
+    uint8_t indice = origen[n++];
+    if (indice == TRAZA_MAC_NUEVA)
+    {
+      if (n + 6 > len)
+        return 0;
+      memcpy(trama->mac, &origen[n], 6);
+      n += 6;
+      if (tabla.buscar(trama->mac) < 0)
+        tabla.insertar(trama->mac);
+    }
+    else
+    {
+      const uint8_t *mac = tabla.mac(indice);
+      if (mac == NULL)
+        return 0;
+      memcpy(trama->mac, mac, 6);
+    }
+
+    if (n >= len)
+      return 0;
+    trama->len = origen[n++];
+    if (trama->len > MAX_TRAMA_ESPNOW || n + trama->len > len)
+      return 0;
+    memcpy(trama->data, &origen[n], trama->len);
+
+    instante += delta;
+    trama->rxMicros = instante;
+    return n + trama->len;
+  }
+
+private:
+  TablaMacs tabla;
+  uint64_t instante = 0; // Instante acumulado del último registro, relativo al primero
+};
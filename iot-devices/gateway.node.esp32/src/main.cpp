@@ -4,7 +4,23 @@
 #include <time.h>
 #include <sys/time.h>
 #include <PubSubClient.h>
+#include <esp_heap_caps.h>
+#include <Preferences.h>
 #include "data.h"
+#include "pool.h"
+#include "pipeline.h"
+#include "procesador.h"
+
+#ifdef TRAZA_ESPNOW // Grabación de las tramas recibidas para reproducirlas en el host (ver src/replay)
+#include <LittleFS.h>
+#include <freertos/stream_buffer.h>
+#include "trace.h"
+
+#define TRAZA_FICHERO "/traza.bin"                  // Traza de la sesión actual
+#define TRAZA_FICHERO_ANTERIOR "/traza_anterior.bin" // Traza de la sesión anterior, se conserva un arranque
+#define TRAZA_MAX_BYTES (1024 * 1024)               // Tamaño máximo de la traza; al llegar se deja de grabar
+#define TRAZA_BUFFER 8192                           // Bytes de registros codificados pendientes de escribir en el fichero
+#endif
 
 #define RTC_SYNC_INTERVAL 3600000               // Intervalo de sincronización del RTC en milisegundos (1 hora)
 
@@ -14,10 +30,22 @@
 #define MQTT_USER "student"                     // Usuario para autenticación en el broker MQTT
 #define MQTT_PASSWORD "1234"                    // Contraseña para autenticación en el broker MQTT
 #define ID_RED_IOT_PRIVADA "gateway.node.esp32" // Identificador de la red IoT privada
+#define PREFIJO_ID_NODO "gateway"               // Identificador de este nodo en los topics MQTT, seguido del final de su MAC
+#define MQTT_BUFFER_SIZE 512                    // Tamaño del buffer de PubSubClient, reservado una única vez en el arranque
+#define MEMORY_STATUS_INTERVAL 60000            // Intervalo de publicación del estado de memoria en milisegundos (1 minuto)
+#define MQTT_TIMEOUT_S 2                        // Espera máxima de una respuesta del broker (PubSubClient espera 15 s por defecto)
+#define MQTT_REINTENTO_MIN_MS 1000              // Espera tras el primer intento fallido de conexión al broker
+#define MQTT_REINTENTO_MAX_MS 30000             // Espera máxima entre intentos de conexión (se dobla en cada fallo)
+#define BALIZA_INTERVALO_MS 2000                // Periodo de las balizas para los nodos sensores (BALIZA_INTERVALO_MS en sensor.node.esp32)
+#define MUESTREO_OCUPACION_MS 100               // Periodo de muestreo de la ocupación de las colas que se anuncia en las balizas
+#define MUESTRAS_OCUPACION 8                    // Peso de la media móvil exponencial de la ocupación (en muestras)
 
 // RCN RTC_DATA_ATTR es un atributo utilizado para declarar variables que deben ser almacenadas en la memoria RTC (Real-Time Clock) de un microcontrolador. La memoria RTC se conserva durante los reinicios y las entradas/salidas de modo de baja energía (deep sleep), lo que permite que las variables mantengan su valor a través de estos eventos. No obstante, si apagas la placa y vuelves a encender, el dato no se mantiene.
 RTC_DATA_ATTR int rebootCount = 0; // Contador de reinicio
 unsigned long lastWakeTime;        // Contador del tiempo activo
+unsigned long siguienteIntentoMqtt = 0;             // millis() a partir del cual se vuelve a intentar conectar al broker
+unsigned long esperaMqtt = MQTT_REINTENTO_MIN_MS;   // Espera actual entre intentos de conexión
+char idNodo[16];                   // PREFIJO_ID_NODO y los tres últimos bytes de la MAC: distinto en cada gateway de la red
 
 WiFiClient wifiClient;               // Creación de un cliente WiFi
 PubSubClient mqttClient(wifiClient); // Creación del cliente MQTT utilizando el cliente WiFi
@@ -25,13 +53,94 @@ PubSubClient mqttClient(wifiClient); // Creación del cliente MQTT utilizando el
 // RCN ¿Para qué necesitas un semáforo?
 SemaphoreHandle_t rtcSemaphore; // Semáforo para la sincronización del RTC
 
+StaticPool<RxFrame, NUM_TRAMAS_RX> rxPool;                    // Pool de tramas recibidas por ESP-NOW
+StaticPool<PendingPublish, NUM_PUBLICACIONES> pubPool;        // Pool de publicaciones MQTT pendientes
+StaticPool<BacklogRecord, NUM_REGISTROS_BACKLOG> backlogPool; // Pool de registros del backlog
+
+QueueHandle_t rxQueue;  // Cola de punteros a RxFrame: OnDataRecv -> frame_processor
+QueueHandle_t pubQueue; // Cola de punteros a PendingPublish: frame_processor -> loop()
+
+uint32_t tramasDescartadas = 0;        // Tramas perdidas por pool o cola llenos
+
+SemaphoreHandle_t secuenciasMutex; // Protege las secuencias de procesador entre frame_processor y el callback MQTT de loop()
+Preferences preferencias;          // NVS donde se guarda la secuencia esperada de cada nodo entre reinicios
+esp_now_peer_info_t peerInfo;      // Información de un nodo sensor como peer de ESPNOW
+
+uint8_t direccionDifusion[] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF}; // Destino de las balizas
+volatile bool brokerConectado = false;                               // Lo actualiza loop(); lo anuncian las balizas
+
+#ifdef TRAZA_ESPNOW
+CodificadorTraza codificadorTraza;                   // Solo lo usa OnDataRecv
+StaticStreamBuffer_t trazaStreamEstado;              // Estado del stream buffer, reservado estáticamente
+uint8_t trazaStreamAlmacen[TRAZA_BUFFER + 1];        // Almacenamiento del stream buffer
+StreamBufferHandle_t trazaStream;                    // Registros codificados: OnDataRecv -> trace_writer
+SemaphoreHandle_t trazaMutex;                        // Protege el fichero entre trace_writer y el volcado por consola
+uint32_t trazaDescartes = 0;                         // Registros perdidos por buffer lleno o fichero completo
+volatile bool trazaCompleta = false;                 // Se ha perdido un bloque al escribir: lo que viniera detrás no se podría decodificar
+#endif
+
 void internal_RTC_updater(void *parameter);                                               // Declaración de la función para actualizar el RTC internamente
 void handle_RTC_sync_request(const uint8_t *mac_addr, const uint8_t *data, int data_len); // Declaración de la función para manejar las solicitudes de sincronización RTC
 void setupWiFi();                                                                         // Declaración de la función para configurar la conexión WiFi
-void connectToMQTTBroker();                                                               // Declaración de la función para conectar con el broker MQTT
-void publishToMQTT(const char *topic, const char *payload);                               // Declaración de la función para publicar mensajes en MQTT
+bool connectToMQTTBroker();                                                               // Declaración de la función que hace un intento de conexión con el broker MQTT
+bool publishToMQTT(const char *topic, const char *payload, bool retener);                 // Declaración de la función para publicar mensajes en MQTT
 void configTimeAndSync();                                                                 // Declaración de la función para configurar y sincronizar el tiempo
 void OnDataRecv(const uint8_t *mac_addr, const uint8_t *data, int data_len);              // Declaración de la función para recibir datos por ESP-NOW
+void frame_processor(void *parameter);                                                    // Declaración de la tarea que convierte las tramas recibidas en publicaciones
+void memory_status_updater(void *parameter);                                              // Declaración de la tarea que informa del estado de los pools y del heap
+void OnMqttMessage(char *topic, uint8_t *payload, unsigned int len);                      // Declaración del callback de las publicaciones de secuencia de otros gateways
+void beacon_sender(void *parameter);                                                      // Declaración de la tarea que difunde las balizas con la ocupación de las colas
+bool asegurarPeer(const uint8_t *mac);                                                    // Declaración de la función para registrar un nodo como peer de ESPNOW
+#ifdef TRAZA_ESPNOW
+void grabarTraza(const uint8_t *mac, const uint8_t *data, int data_len, uint64_t rxMicros); // Declaración de la función que codifica una trama recibida en la traza
+void trace_writer(void *parameter);                                                       // Declaración de la tarea que escribe la traza en LittleFS
+void atenderConsola();                                                                    // Declaración de la función que atiende los comandos por el puerto serie
+#endif
+
+// Lo que el camino de mensajes compartido con las herramientas de host (procesador.h) necesita del ESP32
+struct PlataformaGateway
+{
+  bool encolar(PendingPublish *publicacion) { return xQueueSend(pubQueue, &publicacion, 0) == pdTRUE; }
+  size_t huecosCola() { return uxQueueSpacesAvailable(pubQueue); }
+  bool sacar(PendingPublish *&publicacion) { return xQueueReceive(pubQueue, &publicacion, 0) == pdTRUE; }
+  bool publicar(const PendingPublish *publicacion) { return publishToMQTT(publicacion->topic, publicacion->payload, publicacion->retener); }
+  bool conBroker() { return brokerConectado; }
+  bool alcanzable(const uint8_t *mac) { return asegurarPeer(mac); }
+  void enviar(const uint8_t *mac, const uint8_t *datos, size_t len) { esp_now_send(mac, datos, len); }
+  void atenderHora(const RxFrame *trama) { handle_RTC_sync_request(trama->mac, trama->data, trama->len); }
+  void bloquear() { xSemaphoreTake(secuenciasMutex, portMAX_DELAY); }
+  void desbloquear() { xSemaphoreGive(secuenciasMutex); }
+  uint32_t ahoraMs() { return millis(); }
+
+  // Las claves de NVS admiten hasta 15 caracteres: la MAC sin separadores, y la misma con una h delante para los huecos
+  bool cargarSecuencia(const uint8_t *mac, uint32_t &siguienteSeq, HuecoSecuencias *huecos, uint8_t &numHuecos)
+  {
+    char clave[13];
+    char claveHuecos[14] = "h";
+    formatearIdNodo(mac, clave);
+    if (!preferencias.isKey(clave))
+      return false;
+    formatearIdNodo(mac, claveHuecos + 1);
+    siguienteSeq = preferencias.getUInt(clave);
+    numHuecos = preferencias.getBytes(claveHuecos, huecos, MAX_HUECOS_NODO * sizeof(HuecoSecuencias)) / sizeof(HuecoSecuencias);
+    return true;
+  }
+
+  void guardarSecuencia(const uint8_t *mac, uint32_t siguienteSeq, const HuecoSecuencias *huecos, uint8_t numHuecos)
+  {
+    char clave[13];
+    char claveHuecos[14] = "h";
+    formatearIdNodo(mac, clave);
+    if (preferencias.getUInt(clave, UINT32_MAX) != siguienteSeq)
+      preferencias.putUInt(clave, siguienteSeq);
+    formatearIdNodo(mac, claveHuecos + 1);
+    if (numHuecos > 0 || preferencias.isKey(claveHuecos))
+      preferencias.putBytes(claveHuecos, huecos, numHuecos * sizeof(HuecoSecuencias));
+  }
+};
+
+PlataformaGateway plataforma;
+ProcesadorTramas<PlataformaGateway> procesador(plataforma, pubPool, backlogPool, ID_RED_IOT_PRIVADA, idNodo); // frame_processor y loop()
 
 void setup()
 {
@@ -40,6 +149,38 @@ void setup()
   WiFi.mode(WIFI_STA); // Configuración del modo WiFi en estación (cliente)
   setupWiFi();         // Llamada a la función de configuración de WiFi
 
+  uint8_t mac[6];
+  WiFi.macAddress(mac);
+  snprintf(idNodo, sizeof(idNodo), "%s%02x%02x%02x", PREFIJO_ID_NODO, mac[3], mac[4], mac[5]);
+
+  // Todas las reservas dinámicas del camino de mensajes se hacen aquí, una sola vez
+  mqttClient.setServer(MQTT_BROKER, MQTT_PORT);
+  mqttClient.setBufferSize(MQTT_BUFFER_SIZE);
+  mqttClient.setSocketTimeout(MQTT_TIMEOUT_S); // Un intento de conexión fallido no debe parar loop() mucho tiempo
+  mqttClient.setCallback(OnMqttMessage);
+  rxQueue = xQueueCreate(NUM_TRAMAS_RX, sizeof(RxFrame *));
+  pubQueue = xQueueCreate(NUM_PUBLICACIONES, sizeof(PendingPublish *));
+  preferencias.begin("secuencias", false);
+  secuenciasMutex = xSemaphoreCreateMutex();
+
+#ifdef TRAZA_ESPNOW
+  trazaStream = xStreamBufferCreateStatic(TRAZA_BUFFER, 1, trazaStreamAlmacen, &trazaStreamEstado);
+  trazaMutex = xSemaphoreCreateMutex();
+  if (LittleFS.begin(true))
+  {
+    if (LittleFS.exists(TRAZA_FICHERO))
+    {
+      LittleFS.remove(TRAZA_FICHERO_ANTERIOR);
+      LittleFS.rename(TRAZA_FICHERO, TRAZA_FICHERO_ANTERIOR); // Cada arranque empieza una traza nueva
+    }
+    xTaskCreatePinnedToCore(trace_writer, "Trace Writer", 4096, NULL, 1, NULL, 1);
+  }
+  else
+  {
+    Serial.println("Error al montar LittleFS, no se grabara la traza");
+  }
+#endif
+
   if (esp_now_init() != ESP_OK)
   {
     Serial.println("Error al inicializar ESP-NOW");
@@ -47,23 +188,234 @@ void setup()
   }
 
   esp_now_register_recv_cb(OnDataRecv); // Registro del callback para recibir datos por ESP-NOW
+  if (!asegurarPeer(direccionDifusion))
+  {
+    Serial.println("Error al registrar la direccion de difusion, no se enviaran balizas");
+  }
 
   rtcSemaphore = xSemaphoreCreateMutex(); // Creación del semáforo para la sincronización del RTC
 
   xTaskCreatePinnedToCore(internal_RTC_updater, "RTC Updater", 4096, NULL, 1, NULL, 1);
+  xTaskCreatePinnedToCore(frame_processor, "Frame Processor", 4096, NULL, 2, NULL, 1);
+  xTaskCreatePinnedToCore(memory_status_updater, "Memory Status", 3072, NULL, 1, NULL, 1);
+  xTaskCreatePinnedToCore(beacon_sender, "Beacon Sender", 2048, NULL, 1, NULL, 1);
 }
 
 void loop()
 {
-  // RCN esto no es necesario hacerlo dentro de loop()
-  if (!mqttClient.connected()) // Verificación de conexión con el broker MQTT
+  // Sin broker no se espera a que vuelva: se hace un intento cada cierto tiempo y, mientras tanto, las publicaciones
+  // siguen saliendo de pubQueue hacia el backlog, que es el que absorbe la caída
+  if (!mqttClient.connected() && (long)(millis() - siguienteIntentoMqtt) >= 0)
   {
-    connectToMQTTBroker(); // Conexión al broker MQTT si no está conectado
+    if (connectToMQTTBroker())
+    {
+      esperaMqtt = MQTT_REINTENTO_MIN_MS;
+    }
+    else
+    {
+      siguienteIntentoMqtt = millis() + esperaMqtt;
+      esperaMqtt = esperaMqtt * 2 > MQTT_REINTENTO_MAX_MS ? MQTT_REINTENTO_MAX_MS : esperaMqtt * 2;
+    }
   }
-  mqttClient.loop(); // Función de loop para mantener la comunicación con el broker MQTT
+  brokerConectado = mqttClient.connected();
+  if (brokerConectado)
+    mqttClient.loop(); // Función de loop para mantener la comunicación con el broker MQTT (y recibir las secuencias de otros gateways)
+
+#ifdef TRAZA_ESPNOW
+  atenderConsola();
+#endif
+
+  procesador.vaciarPublicaciones(brokerConectado); // Backlog y pubQueue, hacia el broker o hacia el backlog
   delay(100);
 }
 
+void frame_processor(void *parameter)
+{
+  RxFrame *trama;
+  for (;;)
+  {
+    if (xQueueReceive(rxQueue, &trama, portMAX_DELAY) != pdTRUE)
+      continue;
+    procesador.procesarTrama(trama);
+    rxPool.release(trama); // La trama ya no se necesita
+  }
+}
+
+#ifdef TRAZA_ESPNOW
+// Se llama desde OnDataRecv antes de reservar el bloque de la trama, así que también quedan en la traza las tramas que
+// después se descartan por pool o cola llenos y el replay reproduce la carga que de verdad llegó
+void grabarTraza(const uint8_t *mac, const uint8_t *data, int data_len, uint64_t rxMicros)
+{
+  // Si no cabe el peor caso se descarta antes de codificar, para no romper los deltas ni la tabla de MACs
+  if (trazaCompleta || xStreamBufferSpacesAvailable(trazaStream) < TRAZA_MAX_REGISTRO)
+  {
+    trazaDescartes++;
+    return;
+  }
+
+  uint8_t registro[TRAZA_MAX_REGISTRO];
+  size_t len = codificadorTraza.codificar(mac, data, (uint8_t)data_len, rxMicros, registro);
+  xStreamBufferSend(trazaStream, registro, len, 0);
+}
+
+void trace_writer(void *parameter)
+{
+  uint8_t bloque[512];
+  size_t escritos = 0;
+  for (;;)
+  {
+    size_t len = xStreamBufferReceive(trazaStream, bloque, sizeof(bloque), portMAX_DELAY);
+    if (len == 0)
+      continue;
+    // Los bloques no coinciden con registros: en cuanto uno no se escribe entero, la traza termina ahí, aunque después
+    // llegue otro más pequeño que sí cabría
+    if (trazaCompleta || escritos + len > TRAZA_MAX_BYTES)
+    {
+      trazaCompleta = true;
+      trazaDescartes++;
+      continue;
+    }
+
+    xSemaphoreTake(trazaMutex, portMAX_DELAY);
+    File fichero = LittleFS.open(TRAZA_FICHERO, FILE_APPEND);
+    if (fichero)
+    {
+      if (fichero.size() == 0) // La cabecera se escribe con el primer registro, cuando el RTC ya está sincronizado
+      {
+        uint8_t cabecera[TRAZA_CABECERA];
+        fichero.write(cabecera, escribirCabeceraTraza(cabecera, time(nullptr)));
+      }
+      if (fichero.write(bloque, len) != len)
+        trazaCompleta = true;
+      escritos = fichero.size();
+      fichero.close();
+    }
+    else
+    {
+      trazaCompleta = true;
+    }
+    xSemaphoreGive(trazaMutex);
+  }
+}
+
+void atenderConsola()
+{
+  // Comando "traza": vuelca la traza en hexadecimal entre marcas, para copiarla del monitor serie y pasarla a src/replay
+  static char linea[16];
+  static size_t len = 0;
+  while (Serial.available())
+  {
+    char c = Serial.read();
+    if (c != '\n' && c != '\r')
+    {
+      if (len < sizeof(linea) - 1)
+        linea[len++] = c;
+      continue;
+    }
+    linea[len] = '\0';
+    len = 0;
+    if (strcmp(linea, "traza") != 0)
+      continue;
+
+    xSemaphoreTake(trazaMutex, portMAX_DELAY);
+    File fichero = LittleFS.open(TRAZA_FICHERO, FILE_READ);
+    Serial.println("--- TRAZA INICIO ---");
+    uint8_t bloque[32];
+    size_t leidos;
+    while (fichero && (leidos = fichero.read(bloque, sizeof(bloque))) > 0)
+    {
+      for (size_t i = 0; i < leidos; i++)
+        Serial.printf("%02x", bloque[i]);
+      Serial.println();
+    }
+    Serial.println("--- TRAZA FIN ---");
+    Serial.printf("Registros descartados: %u\n", (unsigned)trazaDescartes);
+    if (fichero)
+      fichero.close();
+    xSemaphoreGive(trazaMutex);
+  }
+}
+#endif
+
+void OnMqttMessage(char *topic, uint8_t *payload, unsigned int len)
+{
+  // Se ejecuta dentro de mqttClient.loop(), en loop(): solo llegan las secuencias publicadas por los gateways
+  procesador.incorporarSecuencia(topic, payload, len);
+}
+
+// Difunde periódicamente la ocupación de las colas para que los nodos sensores elijan el gateway menos cargado. Las
+// publicaciones del backlog siguen ocupando su bloque de pubPool, así que también cuentan. Se anuncia una media móvil
+// y no la ocupación del instante: las colas se llenan y vacían en ráfagas, y una muestra suelta haría que los nodos
+// saltasen de un gateway a otro.
+void beacon_sender(void *parameter)
+{
+  GatewayBeacon baliza;
+  baliza.capacidadCola = rxPool.capacity() + pubPool.capacity();
+  float profundidadMedia = 0;
+  TickType_t ultimaBaliza = xTaskGetTickCount();
+  for (;;)
+  {
+    profundidadMedia += ((float)(rxPool.inUse() + pubPool.inUse()) - profundidadMedia) / MUESTRAS_OCUPACION;
+    if (xTaskGetTickCount() - ultimaBaliza >= pdMS_TO_TICKS(BALIZA_INTERVALO_MS))
+    {
+      ultimaBaliza = xTaskGetTickCount();
+      baliza.profundidadCola = (uint16_t)(profundidadMedia + 0.5f);
+      baliza.conBroker = brokerConectado;
+      esp_now_send(direccionDifusion, (uint8_t *)&baliza, sizeof(baliza));
+    }
+    vTaskDelay(pdMS_TO_TICKS(MUESTREO_OCUPACION_MS));
+  }
+}
+
+bool asegurarPeer(const uint8_t *mac)
+{
+  if (esp_now_is_peer_exist(mac))
+    return true;
+
+  memset(&peerInfo, 0, sizeof(peerInfo));
+  memcpy(peerInfo.peer_addr, mac, 6);
+  peerInfo.channel = 0;
+  peerInfo.encrypt = false;
+  return esp_now_add_peer(&peerInfo) == ESP_OK;
+}
+
+void memory_status_updater(void *parameter)
+{
+  for (;;)
+  {
+    vTaskDelay(pdMS_TO_TICKS(MEMORY_STATUS_INTERVAL));
+
+    size_t heapLibre = heap_caps_get_free_size(MALLOC_CAP_8BIT);            // Memoria libre total del heap
+    size_t bloqueMayor = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT); // Mayor bloque contiguo: indica la fragmentación
+    size_t heapMinimo = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);   // Mínimo de memoria libre desde el arranque
+
+    Serial.printf("Pools rx %u/%u (max %u, fallos %u) pub %u/%u (max %u, fallos %u) backlog %u/%u (max %u, fallos %u)\n",
+                  (unsigned)rxPool.inUse(), (unsigned)rxPool.capacity(), (unsigned)rxPool.highWater(), (unsigned)rxPool.failures(),
+                  (unsigned)pubPool.inUse(), (unsigned)pubPool.capacity(), (unsigned)pubPool.highWater(), (unsigned)pubPool.failures(),
+                  (unsigned)backlogPool.inUse(), (unsigned)backlogPool.capacity(), (unsigned)backlogPool.highWater(), (unsigned)backlogPool.failures());
+    Serial.printf("Heap libre %u, bloque mayor %u, minimo %u\n", (unsigned)heapLibre, (unsigned)bloqueMayor, (unsigned)heapMinimo);
+    Serial.printf("Secuencias: repetidas %u, huecos %u, backfills pedidos %u\n", (unsigned)procesador.tramasRepetidas,
+                  (unsigned)procesador.huecosDetectados, (unsigned)procesador.backfillsPedidos);
+
+    PendingPublish *publicacion = pubPool.allocate();
+    if (publicacion == NULL)
+    {
+      procesador.publicacionesDescartadas++;
+      continue;
+    }
+    snprintf(publicacion->topic, sizeof(publicacion->topic), "/%s/memory_status/%s", ID_RED_IOT_PRIVADA, idNodo);
+    publicacion->retener = false;
+    snprintf(publicacion->payload, sizeof(publicacion->payload),
+             "{\"rx\":[%u,%u,%u],\"pub\":[%u,%u,%u],\"backlog\":[%u,%u,%u],\"descartes\":[%u,%u],\"heap_libre\":%u,\"bloque_mayor\":%u,\"heap_minimo\":%u}",
+             (unsigned)rxPool.inUse(), (unsigned)rxPool.highWater(), (unsigned)rxPool.failures(),
+             (unsigned)pubPool.inUse(), (unsigned)pubPool.highWater(), (unsigned)pubPool.failures(),
+             (unsigned)backlogPool.inUse(), (unsigned)backlogPool.highWater(), (unsigned)backlogPool.failures(),
+             (unsigned)tramasDescartadas, (unsigned)procesador.publicacionesDescartadas,
+             (unsigned)heapLibre, (unsigned)bloqueMayor, (unsigned)heapMinimo);
+    procesador.encolarPublicacion(publicacion);
+  }
+}
+
 void internal_RTC_updater(void *parameter)
 {
   for (;;)
@@ -78,16 +430,17 @@ void internal_RTC_updater(void *parameter)
   }
 }
 
-// RCN ¿para que necesitas el mac_addr y data_len? No lo usas...
-// RCN no estas contestando por espnow en ningun sitio a la placa que te solicita la hora
 void handle_RTC_sync_request(const uint8_t *mac_addr, const uint8_t *data, int data_len)
 {
-  TimeRequest request;
-  memcpy(&request, data, sizeof(request)); // Copia de los datos recibidos en la estructura
+  if (data_len != sizeof(TimeRequest))
+    return;
+
+  TimeResponse respuesta;
+  respuesta.timestamp = time(nullptr); // Se responde con el RTC interno, que ya se sincroniza con NTP periódicamente
 
-  if (strcmp(request.request, "TIME") == 0)
+  if (asegurarPeer(mac_addr))
   {
-    configTimeAndSync();
+    esp_now_send(mac_addr, (uint8_t *)&respuesta, sizeof(respuesta));
   }
 }
 
@@ -102,28 +455,24 @@ void setupWiFi()
   Serial.println("Conectado a WiFi");
 }
 
-void connectToMQTTBroker()
+bool connectToMQTTBroker()
 {
-  while (!mqttClient.connected()) // Mientras no esté conectado al broker
+  Serial.print("Conectando al broker MQTT...");
+  if (!mqttClient.connect(idNodo, MQTT_USER, MQTT_PASSWORD)) // Intento de conexión al broker MQTT; con el mismo id los gateways se echarían unos a otros
   {
-    Serial.print("Conectando al broker MQTT...");
-    if (mqttClient.connect("ESP32Client", MQTT_USER, MQTT_PASSWORD)) // Intento de conexión al broker MQTT
-    {
-      Serial.println("Conectado");
-    }
-    else
-    {
-      Serial.print("fallo, estado ");
-      Serial.println(mqttClient.state());
-      delay(5000);
-    }
+    Serial.print("fallo, estado ");
+    Serial.print(mqttClient.state());
+    Serial.printf(", siguiente intento en %lu ms\n", esperaMqtt);
+    return false;
   }
+  Serial.println("Conectado");
+  mqttClient.subscribe("/" ID_RED_IOT_PRIVADA "/" TIPO_SECUENCIA "/+"); // Las retenidas llegan en cuanto se suscribe
+  return true;
 }
 
-void publishToMQTT(const char *topic, const char *payload)
+bool publishToMQTT(const char *topic, const char *payload, bool retener)
 {
-  // RCN no es coherente con los canales que usas en el dummy. Deberías publicar en función del tipo de mensaje
-  mqttClient.publish(topic, payload);
+  return mqttClient.publish(topic, payload, retener);
 }
 
 void configTimeAndSync()
@@ -150,16 +499,30 @@ void configTimeAndSync()
 
 void OnDataRecv(const uint8_t *mac_addr, const uint8_t *data, int data_len)
 {
-  // RCN lo correcto sería identificar el mensaje mediante una estrategia que no dependa del tamaño del payload. Lo común suele ser reservar algún byte del payload para indicar el tipo de mensaje.
-  if (data_len == sizeof(TimeRequest))
+  // Se ejecuta en la tarea de WiFi: solo se copia la trama a un bloque del pool y se pasa el puntero a frame_processor
+  if (data_len <= 0 || data_len > MAX_TRAMA_ESPNOW || data[0] == MSG_GATEWAY_BEACON) // Las balizas de otros gateways no se procesan
+    return;
+
+  uint64_t rxMicros = esp_timer_get_time();
+#ifdef TRAZA_ESPNOW
+  grabarTraza(mac_addr, data, data_len, rxMicros);
+#endif
+
+  RxFrame *trama = rxPool.allocate();
+  if (trama == NULL)
   {
-    handle_RTC_sync_request(mac_addr, data, data_len);
+    tramasDescartadas++;
+    return;
   }
-  else if (memcmp(mac_addr, sensorMAC, sizeof(sensorMAC)) == 0) // RCN ¿Solo contestas a esa mac? ¿Y si cambias la placa? No tiene sentido...
+
+  memcpy(trama->mac, mac_addr, sizeof(trama->mac));
+  trama->len = (uint8_t)data_len;
+  trama->rxMicros = rxMicros;
+  memcpy(trama->data, data, data_len);
+
+  if (xQueueSend(rxQueue, &trama, 0) != pdTRUE)
   {
-    char message[100];
-    snprintf(message, sizeof(message), "Se ha mandado al broker los datos: %s", (char *)data);
-    Serial.println(message); // Imprimir el mensaje antes de publicarlo
-    publishToMQTT("evento_salida", message); // RCN ¿Siempre lo publicas al mismo canal? ¿no deberías publicar en función del tipo de mensaje? De nuevo, sin mucho sentido...
+    rxPool.release(trama);
+    tramasDescartadas++;
   }
-}
\ No newline at end of file
+}
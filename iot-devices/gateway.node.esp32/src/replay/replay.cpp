@@ -0,0 +1,421 @@
+// Reproduce en el host una traza de tramas ESP-NOW grabada por el gateway (build con -DTRAZA_ESPNOW) pasándola
+// por el mismo camino que el firmware (procesador.h): pool de tramas -> cola -> frame_processor -> pool de
+// publicaciones -> pubQueue -> loop() -> broker o backlog. Un hilo hace de OnDataRecv, otro de frame_processor y otro
+// de loop(), con los mismos pools y tamaños que el firmware. Sirve como benchmark repetible del pipeline: informa del
+// throughput, la distribución de latencias, el uso de los pools y las diferencias de la salida respecto a una
+// ejecución de referencia.
+//
+//   pio run -e native
+//   .pio/build/native/program traza.bin [--velocidad N | --max] [--bucles N] [--caida desde,hasta] [--salida fichero]
+//                              [--esperado fichero]
+//
+// --caida deja el broker sin conexión entre esos segundos de la traza (en cada pasada): las publicaciones pasan al
+// backlog y, lleno este, se quedan en pubQueue y el procesador deja lecturas para backfill. A velocidad máxima
+// frame_processor espera a que pubQueue tenga sitio para un batch completo antes de tomar cada trama, como el
+// productor espera a rxPool, para medir el throughput sin descartes; sin broker no espera y descarta como el firmware.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "pool.h"
+#include "pipeline.h"
+#include "procesador.h"
+#include "trace.h"
+
+#define RED_REPLAY "gateway.node.esp32" // Identificador de red con el que se generan los topics, igual que en el firmware
+#define GATEWAY_REPLAY "gatewayreplay"  // Identificador del gateway en las publicaciones de secuencia
+#define ESPERA_LOOP_MS 100              // delay() al final de loop() en el firmware
+
+using Reloj = std::chrono::steady_clock;
+
+typedef struct // Opciones de la línea de comandos
+{
+  const char *traza = NULL;
+  double velocidad = 1.0; // 0 = lo más rápido posible
+  long bucles = 1;
+  double caidaDesde = -1, caidaHasta = -1; // Segundos de la traza sin broker
+  const char *salida = NULL;
+  const char *esperado = NULL;
+} Opciones;
+
+StaticPool<RxFrame, NUM_TRAMAS_RX> rxPool;
+StaticPool<PendingPublish, NUM_PUBLICACIONES> pubPool;
+StaticPool<BacklogRecord, NUM_REGISTROS_BACKLOG> backlogPool;
+
+// Cola acotada de punteros, equivalente a la QueueHandle_t de frame_processor
+class ColaTramas
+{
+public:
+  bool enviar(RxFrame *trama, bool esperar)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (esperar)
+      hayHueco.wait(lock, [this] { return cola.size() < NUM_TRAMAS_RX; });
+    else if (cola.size() >= NUM_TRAMAS_RX)
+      return false;
+    cola.push_back(trama);
+    hayTrama.notify_one();
+    return true;
+  }
+
+  RxFrame *recibir() // Devuelve NULL cuando se ha cerrado y está vacía
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    hayTrama.wait(lock, [this] { return !cola.empty() || cerrada; });
+    if (cola.empty())
+      return NULL;
+    RxFrame *trama = cola.front();
+    cola.pop_front();
+    hayHueco.notify_one();
+    return trama;
+  }
+
+  void cerrar()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    cerrada = true;
+    hayTrama.notify_all();
+  }
+
+private:
+  std::mutex mutex;
+  std::condition_variable hayTrama, hayHueco;
+  std::deque<RxFrame *> cola; // Como mucho NUM_TRAMAS_RX punteros
+  bool cerrada = false;
+};
+
+uint64_t microsDesde(Reloj::time_point inicio)
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(Reloj::now() - inicio).count();
+}
+
+// Lo que procesador.h necesita del entorno: pubQueue sin espera, el broker (una línea de salida por publicación) y
+// ninguna NVS, como un gateway recién instalado
+struct PlataformaReplay
+{
+  bool encolar(PendingPublish *publicacion)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (cola.size() >= NUM_PUBLICACIONES)
+      return false;
+    cola.push_back(publicacion);
+    inyeccion[publicacion] = inyeccionActual;
+    return true;
+  }
+
+  size_t huecosCola()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return NUM_PUBLICACIONES - cola.size();
+  }
+
+  bool sacar(PendingPublish *&publicacion)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (cola.empty())
+      return false;
+    publicacion = cola.front();
+    cola.pop_front();
+    return true;
+  }
+
+  bool publicar(const PendingPublish *publicacion) // Solo la llama loop() y solo con broker
+  {
+    uint64_t inyectada;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      inyectada = inyeccion[publicacion];
+    }
+    latencias.push_back((uint32_t)(microsDesde(inicio) - inyectada));
+    if (guardarSalida)
+      salida.push_back(std::string(publicacion->topic) + " " + publicacion->payload);
+    publicadas++;
+    return true;
+  }
+
+  bool conBroker() { return broker; }
+  bool alcanzable(const uint8_t *) { return true; }
+  void enviar(const uint8_t *, const uint8_t *, size_t) {} // No hay nodos que respondan al backfill
+  void atenderHora(const RxFrame *) { peticionesHora++; }
+  void bloquear() { mutexSecuencias.lock(); }
+  void desbloquear() { mutexSecuencias.unlock(); }
+  bool cargarSecuencia(const uint8_t *, uint32_t &, HuecoSecuencias *, uint8_t &) { return false; }
+  void guardarSecuencia(const uint8_t *, uint32_t, const HuecoSecuencias *, uint8_t) {}
+  uint32_t ahoraMs() { return (uint32_t)(microsDesde(inicio) / 1000); }
+
+  size_t enCola()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return cola.size();
+  }
+
+  Reloj::time_point inicio = Reloj::now();
+  std::atomic<bool> broker{true};
+  std::atomic<uint64_t> inyeccionActual{0}; // rxMicros de la trama que está procesando frame_processor
+  bool guardarSalida = false;
+  std::vector<uint32_t> latencias; // Microsegundos desde la inyección de la trama hasta la publicación (solo loop())
+  std::vector<std::string> salida; // Solo loop()
+  uint64_t publicadas = 0, peticionesHora = 0;
+
+private:
+  std::mutex mutex, mutexSecuencias;
+  std::deque<PendingPublish *> cola; // pubQueue: como mucho NUM_PUBLICACIONES punteros
+  std::unordered_map<const PendingPublish *, uint64_t> inyeccion;
+};
+
+bool esHex(char c) { return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'); }
+
+// Carga la traza en binario o, si es una captura del monitor serie, extrae el volcado hexadecimal entre las marcas
+bool cargarTraza(const char *ruta, std::vector<uint8_t> &bytes)
+{
+  std::ifstream fichero(ruta, std::ios::binary);
+  if (!fichero)
+    return false;
+  bytes.assign(std::istreambuf_iterator<char>(fichero), std::istreambuf_iterator<char>());
+
+  std::string texto(bytes.begin(), bytes.end());
+  size_t inicio = texto.find("--- TRAZA INICIO ---");
+  if (inicio == std::string::npos)
+    return true;
+  size_t fin = texto.find("--- TRAZA FIN ---", inicio);
+  if (fin == std::string::npos)
+    return false;
+
+  bytes.clear();
+  for (size_t i = texto.find('\n', inicio); i < fin; i++)
+  {
+    if (esHex(texto[i]) && i + 1 < fin && esHex(texto[i + 1]))
+    {
+      bytes.push_back((uint8_t)strtoul(texto.substr(i, 2).c_str(), NULL, 16));
+      i++;
+    }
+  }
+  return true;
+}
+
+bool leerOpciones(int argc, char **argv, Opciones &opciones)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--velocidad") == 0 && i + 1 < argc)
+      opciones.velocidad = atof(argv[++i]);
+    else if (strcmp(argv[i], "--max") == 0)
+      opciones.velocidad = 0;
+    else if (strcmp(argv[i], "--bucles") == 0 && i + 1 < argc)
+      opciones.bucles = atol(argv[++i]);
+    else if (strcmp(argv[i], "--caida") == 0 && i + 1 < argc)
+    {
+      if (sscanf(argv[++i], "%lf,%lf", &opciones.caidaDesde, &opciones.caidaHasta) != 2 || opciones.caidaDesde > opciones.caidaHasta)
+        return false;
+    }
+    else if (strcmp(argv[i], "--salida") == 0 && i + 1 < argc)
+      opciones.salida = argv[++i];
+    else if (strcmp(argv[i], "--esperado") == 0 && i + 1 < argc)
+      opciones.esperado = argv[++i];
+    else if (argv[i][0] != '-' && opciones.traza == NULL)
+      opciones.traza = argv[i];
+    else
+      return false;
+  }
+  return opciones.traza != NULL && opciones.velocidad >= 0 && opciones.bucles > 0;
+}
+
+uint64_t percentil(std::vector<uint32_t> &valores, double p)
+{
+  if (valores.empty())
+    return 0;
+  size_t i = std::min(valores.size() - 1, (size_t)(p * (valores.size() - 1)));
+  std::nth_element(valores.begin(), valores.begin() + i, valores.end());
+  return valores[i];
+}
+
+int main(int argc, char **argv)
+{
+  Opciones opciones;
+  if (!leerOpciones(argc, argv, opciones))
+  {
+    fprintf(stderr, "uso: %s traza.bin [--velocidad N | --max] [--bucles N] [--caida desde,hasta] [--salida fichero] [--esperado fichero]\n",
+            argv[0]);
+    return 2;
+  }
+
+  std::vector<uint8_t> traza;
+  uint32_t epoch;
+  if (!cargarTraza(opciones.traza, traza) || !leerCabeceraTraza(traza.data(), traza.size(), epoch))
+  {
+    fprintf(stderr, "No se puede leer la traza %s\n", opciones.traza);
+    return 1;
+  }
+
+  ColaTramas cola;
+  PlataformaReplay plataforma;
+  plataforma.guardarSalida = opciones.salida != NULL || opciones.esperado != NULL;
+  ProcesadorTramas<PlataformaReplay> procesador(plataforma, pubPool, backlogPool, RED_REPLAY, GATEWAY_REPLAY);
+  std::atomic<uint64_t> instanteTraza{0}; // rxMicros de la última trama inyectada, relativo al inicio de la traza
+  std::atomic<bool> procesadas{false};    // frame_processor ha terminado
+  uint64_t descartadas = 0, inyectadas = 0;
+  size_t maxPubQueue = 0;
+  uint64_t minCaida = (uint64_t)(opciones.caidaDesde * 1e6), maxCaida = (uint64_t)(opciones.caidaHasta * 1e6);
+
+  // frame_processor: cada trama por el procesador del firmware; la trama vuelve a su pool después
+  std::thread hiloProcesador([&]()
+                             {
+    RxFrame *trama;
+    while ((trama = cola.recibir()) != NULL)
+    {
+      if (trama->len == 0) // Marca de inicio de bucle: cada pasada se procesa como un gateway recién arrancado
+      {
+        procesador.reiniciarSecuencias();
+        rxPool.release(trama);
+        continue;
+      }
+      while (opciones.velocidad == 0 && plataforma.broker && plataforma.huecosCola() < PUBLICACIONES_POR_LECTURA * LECTURAS_POR_BATCH + 1)
+        std::this_thread::yield();
+      plataforma.inyeccionActual = trama->rxMicros;
+      procesador.procesarTrama(trama);
+      rxPool.release(trama);
+    }
+    procesadas = true; });
+
+  // loop(): saca de pubQueue hacia el broker o el backlog; sin tramas pendientes, vacía todo con el broker de vuelta
+  std::thread hiloLoop([&]()
+                       {
+    for (;;)
+    {
+      bool terminado = procesadas;
+      uint64_t instante = instanteTraza;
+      plataforma.broker = terminado || opciones.caidaDesde < 0 || instante < minCaida || instante >= maxCaida;
+      maxPubQueue = std::max(maxPubQueue, plataforma.enCola());
+      procesador.vaciarPublicaciones(plataforma.broker);
+      if (terminado && plataforma.enCola() == 0 && backlogPool.inUse() == 0)
+        return;
+      if (opciones.velocidad > 0)
+        std::this_thread::sleep_for(std::chrono::microseconds((uint64_t)(ESPERA_LOOP_MS * 1000 / opciones.velocidad)));
+      else
+        std::this_thread::yield();
+    } });
+
+  // Productor: hace de OnDataRecv, respetando los tiempos de la traza escalados por la velocidad
+  uint64_t desfase = 0; // Instante de replay en el que empieza cada bucle
+  for (long bucle = 0; bucle < opciones.bucles; bucle++)
+  {
+    if (bucle > 0) // Los números de secuencia se repiten en cada pasada
+    {
+      RxFrame *marca = rxPool.allocate();
+      while (marca == NULL)
+      {
+        std::this_thread::yield();
+        marca = rxPool.allocate();
+      }
+      marca->len = 0;
+      cola.enviar(marca, true);
+    }
+
+    DecodificadorTraza decodificador;
+    RxFrame leida;
+    size_t pos = TRAZA_CABECERA;
+    size_t n;
+    while ((n = decodificador.decodificar(traza.data() + pos, traza.size() - pos, &leida)) > 0)
+    {
+      pos += n;
+      instanteTraza = leida.rxMicros;
+
+      if (opciones.velocidad > 0)
+      {
+        uint64_t objetivo = desfase + (uint64_t)(leida.rxMicros / opciones.velocidad);
+        uint64_t ahora = microsDesde(plataforma.inicio);
+        if (objetivo > ahora)
+          std::this_thread::sleep_for(std::chrono::microseconds(objetivo - ahora));
+      }
+
+      // A velocidad real se descarta como en el firmware; a máxima velocidad se espera para medir el throughput
+      RxFrame *trama = rxPool.allocate();
+      while (trama == NULL && opciones.velocidad == 0)
+      {
+        std::this_thread::yield();
+        trama = rxPool.allocate();
+      }
+      if (trama == NULL)
+      {
+        descartadas++;
+        continue;
+      }
+
+      *trama = leida;
+      trama->rxMicros = microsDesde(plataforma.inicio);
+      if (!cola.enviar(trama, opciones.velocidad == 0))
+      {
+        rxPool.release(trama);
+        descartadas++;
+        continue;
+      }
+      inyectadas++;
+    }
+    if (pos != traza.size())
+      fprintf(stderr, "Traza truncada o dañada en el byte %zu\n", pos);
+    desfase = microsDesde(plataforma.inicio);
+  }
+  cola.cerrar();
+  hiloProcesador.join();
+  hiloLoop.join();
+
+  double segundos = microsDesde(plataforma.inicio) / 1e6;
+  printf("Traza: %s (inicio %u, %zu bytes)\n", opciones.traza, (unsigned)epoch, traza.size());
+  printf("Tramas: %llu procesadas, %llu descartadas en %.3f s -> %.0f tramas/s, %.0f publicaciones/s\n",
+         (unsigned long long)inyectadas, (unsigned long long)descartadas, segundos,
+         inyectadas / segundos, plataforma.publicadas / segundos);
+  printf("Publicaciones: %llu publicadas, %u descartadas, peticiones de hora: %llu\n", (unsigned long long)plataforma.publicadas,
+         (unsigned)procesador.publicacionesDescartadas, (unsigned long long)plataforma.peticionesHora);
+  printf("Secuencias: %u huecos, %u batches repetidos, %u backfills pedidos\n", (unsigned)procesador.huecosDetectados,
+         (unsigned)procesador.tramasRepetidas, (unsigned)procesador.backfillsPedidos);
+  printf("Latencia inyeccion -> publicacion (us): p50 %llu, p90 %llu, p99 %llu, max %llu\n",
+         (unsigned long long)percentil(plataforma.latencias, 0.50), (unsigned long long)percentil(plataforma.latencias, 0.90),
+         (unsigned long long)percentil(plataforma.latencias, 0.99), (unsigned long long)percentil(plataforma.latencias, 1.0));
+  printf("Pools: rx max %zu/%zu fallos %u, pub max %zu/%zu fallos %u, backlog max %zu/%zu; pubQueue max %zu/%d\n",
+         rxPool.highWater(), rxPool.capacity(), (unsigned)rxPool.failures(),
+         pubPool.highWater(), pubPool.capacity(), (unsigned)pubPool.failures(),
+         backlogPool.highWater(), backlogPool.capacity(), maxPubQueue, NUM_PUBLICACIONES);
+
+  if (opciones.salida != NULL)
+  {
+    std::ofstream fichero(opciones.salida);
+    for (const std::string &linea : plataforma.salida)
+      fichero << linea << '\n';
+  }
+
+  if (opciones.esperado != NULL)
+  {
+    std::ifstream fichero(opciones.esperado);
+    std::vector<std::string> esperado;
+    std::string linea;
+    while (std::getline(fichero, linea))
+      esperado.push_back(linea);
+
+    const std::vector<std::string> &salida = plataforma.salida;
+    size_t diferencias = 0;
+    size_t total = std::max(esperado.size(), salida.size());
+    for (size_t i = 0; i < total; i++)
+    {
+      const std::string &a = i < esperado.size() ? esperado[i] : "";
+      const std::string &b = i < salida.size() ? salida[i] : "";
+      if (a == b)
+        continue;
+      if (diferencias++ < 10)
+        printf("  linea %zu:\n  - %s\n  + %s\n", i + 1, a.c_str(), b.c_str());
+    }
+    printf("Diferencias con %s: %zu de %zu lineas\n", opciones.esperado, diferencias, total);
+    return diferencias == 0 ? 0 : 3;
+  }
+  return 0;
+}
@@ -0,0 +1,665 @@
+// Simulación en el host de una red con varios gateways. Los nodos eligen gateway con la misma TablaGateways que el
+// firmware de sensor.node.esp32 y los gateways deduplican con el mismo SeguimientoSecuencias, construyen las mismas
+// publicaciones en pools del mismo tamaño y comparten la secuencia de cada nodo con las publicaciones retenidas, que
+// llegan a los demás gateways con la latencia del broker. El reloj es simulado (pasos de 1 ms), así que los
+// resultados son reproducibles.
+//
+//   pio run -e native-sim
+//   .pio/build/native-sim/program [--nodos N] [--gateways 1,2,...] [--periodo ms] [--publicaciones N] [--segundos S]
+//                                 [--periodos-caida ms,...]
+//
+// Primero mide el throughput agregado con 1..N gateways, con los nodos fijos en el primer gateway (como con un único
+// gatewayAddress) y eligiendo gateway por las balizas. Después apaga un gateway a mitad de la pasada y mide cuánto
+// tardan sus nodos en cambiar de gateway y en volver a entregar, para varios periodos de envío.
+//
+// Los nodos se comportan como en el modo deep sleep: un batch sale de la cola del nodo solo cuando el gateway lo
+// confirma y, si no, se reintenta; si la cola se llena, lo más antiguo solo queda en el log de flash. Los gateways
+// tratan las tramas como procesarBatch: lo que no cabe en las colas vuelve a los huecos y los huecos se piden por
+// backfill al nodo, que los sirve del log a su ritmo. Lo que al final no se ha entregado se cuenta como tal y no se
+// da por recuperado: sobre todo huecos que abandona un gateway saturado, que no puede con el backfill además del
+// tráfico en vivo y solo guarda MAX_HUECOS_NODO por nodo; también tramas confirmadas que se pierden en un gateway sin
+// que el nodo envíe después otro batch que deje ver el hueco, y lo que sigue en la cola de los nodos al final.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+#include "pool.h"
+#include "pipeline.h"
+#include "../../../sensor.node.esp32/include/gateways.h"
+
+#define RED_SIM "gateway.node.esp32"
+#define MAX_PENDIENTES_NODO 6   // Batches sin confirmar que guarda un nodo (el anillo RTC del modo deep sleep)
+#define ESPERA_CONFIRMACION_MS 50 // Como en sensor.node.esp32: tiempo hasta dar un envío por no confirmado
+#define TIEMPO_ENVIO_MS 3       // Trama, confirmación y separación entre envíos de un mismo nodo
+#define TIEMPO_TRAMA_MS 1       // frame_processor: de la cola de tramas a las publicaciones
+#define LATENCIA_BROKER_MS 20   // De la publicación de un gateway a la entrega a los demás
+#define PERDIDA_TRAMA 0.01      // Probabilidad de que una trama no llegue
+#define PERDIDA_CONFIRMACION 0.01 // Probabilidad de que llegue la trama pero se pierda la confirmación
+#define PERDIDA_BALIZA 0.05     // Probabilidad de que un nodo no oiga una baliza
+#define MUESTREO_OCUPACION_MS 100 // Como en el firmware del gateway
+#define BACKFILL_INTERVALO_MS 200 // Como en sensor.node.esp32: un batch de backfill por intervalo
+#define BACKFILL_MAX_PETICIONES 4 // Como en sensor.node.esp32: peticiones de backfill pendientes en el nodo
+#define MUESTRAS_OCUPACION 8
+
+typedef struct // Opciones de la línea de comandos
+{
+  int nodos = 24;
+  std::vector<long> gateways = {1, 2, 3, 4};
+  long periodoMs = 500;           // Un batch de LECTURAS_POR_BATCH lecturas por nodo y periodo
+  double publicacionesPorSegundo = 400; // Lo que publica loop() de un gateway en el broker
+  long segundos = 300;
+  std::vector<long> periodosCaida = {2000, 20000, 200000};
+} Opciones;
+
+typedef struct // Publicación en la cola de loop() de un gateway
+{
+  PendingPublish *publicacion;
+  bool backfill; // Viene de un MSG_BACKFILL_DATA
+} EnCola;
+
+typedef struct // Petición de backfill en la cola de un nodo
+{
+  int gateway;
+  uint32_t desde, hasta;
+} PeticionBackfill;
+
+typedef struct // Publicación de un gateway camino de los demás por el broker
+{
+  int64_t entregaMs;
+  int origen;
+  PendingPublish publicacion;
+} EnBroker;
+
+struct Gateway
+{
+  uint8_t mac[6];
+  char id[16];
+  bool vivo = true;
+  std::deque<RxFrame> rx;                       // Cola de tramas (NUM_TRAMAS_RX)
+  StaticPool<PendingPublish, NUM_PUBLICACIONES> pubPool;
+  std::deque<EnCola> pubQueue;
+  SeguimientoSecuencias secuencias;
+  int64_t procesadorLibreMs = 0;
+  int64_t siguienteBalizaMs = 0;
+  int64_t siguienteMuestraMs = 0;
+  float profundidadMedia = 0;                   // Como en beacon_sender
+  double credito = 0;                           // Publicaciones que loop() puede hacer ya
+  uint64_t tramas = 0, repetidos = 0, descartesRx = 0, descartesPub = 0, lecturas = 0;
+};
+
+struct Nodo
+{
+  uint8_t mac[6];
+  TablaGateways tabla{};
+  bool fijo = false;                  // Envía siempre al gateway por defecto, sin mirar las balizas
+  std::deque<DataBatch> pendientes;
+  uint32_t siguienteSeq = 0;
+  int64_t siguienteBatchMs = 0;
+  int64_t siguienteEnvioMs = 0;
+  std::vector<int8_t> rssi;           // Por gateway
+  uint64_t descartados = 0;           // Lecturas que salen de la cola llena sin enviar (siguen en el log de flash)
+  std::deque<PeticionBackfill> peticiones; // backfillQueue
+  bool backfillEnCurso = false;
+  PeticionBackfill backfillActual{};
+  int64_t siguienteBackfillMs = 0;
+
+  // Caída de un gateway
+  bool afectado = false;
+  int64_t cambioMs = -1;              // Primer instante con otro gateway elegido
+  int64_t entregaMs = -1;             // Primera confirmación de otro gateway
+  MotivoCambio motivo = CAMBIO_NINGUNO;
+};
+
+typedef struct // Resultado de una pasada
+{
+  double lecturasPorSegundo = 0;
+  uint64_t ofrecidas = 0, entregadas = 0, porBackfill = 0, sinEntregar = 0, enNodo = 0, duplicadas = 0, repetidos = 0;
+  uint64_t cambiosCarga = 0, cambiosFallos = 0, cambiosCaducidad = 0;
+  std::vector<uint64_t> porGateway;
+  std::vector<int64_t> cambioMs, entregaMs; // Caída: tiempos de los nodos afectados
+  uint64_t porFallos = 0, porCaducidad = 0;
+} Resultado;
+
+class Simulacion
+{
+public:
+  Simulacion(const Opciones &opciones, int numGateways, bool fijo, long periodoMs, int64_t caidaMs)
+      : opciones(opciones), periodoMs(periodoMs), caidaMs(caidaMs), aleatorio(12345)
+  {
+    for (int g = 0; g < numGateways; g++)
+    {
+      gateways.emplace_back(new Gateway());
+      Gateway &gateway = *gateways.back();
+      uint8_t mac[6] = {0x10, 0x06, 0x1C, 0xBA, 0x1A, (uint8_t)g}; // El primero es el gatewayAddress del nodo
+      memcpy(gateway.mac, mac, 6);
+      snprintf(gateway.id, sizeof(gateway.id), "gateway%02x%02x%02x", mac[3], mac[4], mac[5]);
+      gateway.siguienteBalizaMs = (int64_t)(uniforme(aleatorio) * BALIZA_INTERVALO_MS);
+    }
+    std::uniform_int_distribution<int> rssi(-75, -45);
+    for (int n = 0; n < opciones.nodos; n++)
+    {
+      nodos.emplace_back(new Nodo());
+      Nodo &nodo = *nodos.back();
+      uint8_t mac[6] = {0x24, 0x0A, 0xC4, 0x00, (uint8_t)(n >> 8), (uint8_t)n};
+      memcpy(nodo.mac, mac, 6);
+      nodo.tabla.iniciar(mac);
+      nodo.fijo = fijo;
+      nodo.siguienteBatchMs = (int64_t)(uniforme(aleatorio) * periodoMs); // Los nodos no arrancan a la vez
+      for (int g = 0; g < numGateways; g++)
+        nodo.rssi.push_back((int8_t)rssi(aleatorio));
+    }
+  }
+
+  Resultado ejecutar()
+  {
+    int64_t finMs = opciones.segundos * 1000;
+    int64_t vaciadoMs = finMs + 30000; // Sin lecturas nuevas, hasta que se vacían las colas
+    for (ahoraMs = 0; ahoraMs < vaciadoMs; ahoraMs++)
+    {
+      if (ahoraMs == caidaMs)
+        apagar(0);
+      for (auto &gateway : gateways)
+        pasoGateway(*gateway);
+      for (auto &nodo : nodos)
+        pasoNodo(*nodo, ahoraMs < finMs);
+      entregarBroker();
+    }
+    return resultado(finMs);
+  }
+
+private:
+  void apagar(int g)
+  {
+    Gateway &gateway = *gateways[g];
+    gateway.vivo = false;
+    gateway.rx.clear();
+    for (EnCola &enCola : gateway.pubQueue) // Lo que no había publicado se pierde con él
+      gateway.pubPool.release(enCola.publicacion);
+    gateway.pubQueue.clear();
+    for (auto &nodo : nodos)
+    {
+      if (memcmp(nodo->tabla.destino(gateways[0]->mac), gateway.mac, 6) == 0)
+        nodo->afectado = true;
+    }
+  }
+
+  void pasoGateway(Gateway &gateway)
+  {
+    if (!gateway.vivo)
+      return;
+
+    if (ahoraMs >= gateway.siguienteMuestraMs) // beacon_sender
+    {
+      gateway.siguienteMuestraMs += MUESTREO_OCUPACION_MS;
+      gateway.profundidadMedia += ((float)(gateway.rx.size() + gateway.pubPool.inUse()) - gateway.profundidadMedia) / MUESTRAS_OCUPACION;
+    }
+    if (ahoraMs >= gateway.siguienteBalizaMs)
+    {
+      gateway.siguienteBalizaMs += BALIZA_INTERVALO_MS;
+      uint16_t profundidad = (uint16_t)(gateway.profundidadMedia + 0.5f);
+      uint16_t capacidad = NUM_TRAMAS_RX + NUM_PUBLICACIONES;
+      int g = indice(gateway);
+      for (auto &nodo : nodos)
+      {
+        if (!nodo->fijo && uniforme(aleatorio) >= PERDIDA_BALIZA)
+          nodo->tabla.registrarBaliza(gateway.mac, profundidad, capacidad, true, nodo->rssi[g], (uint32_t)ahoraMs);
+      }
+    }
+
+    if (!gateway.rx.empty() && ahoraMs >= gateway.procesadorLibreMs) // frame_processor
+    {
+      RxFrame trama = gateway.rx.front();
+      gateway.rx.pop_front();
+      gateway.procesadorLibreMs = ahoraMs + TIEMPO_TRAMA_MS;
+      procesarTrama(gateway, trama);
+    }
+
+    // loop(): publica a ritmo fijo; las publicaciones de secuencia llegan a los demás gateways por el broker
+    gateway.credito = std::min(gateway.credito + opciones.publicacionesPorSegundo / 1000.0, 10.0);
+    while (gateway.credito >= 1 && !gateway.pubQueue.empty())
+    {
+      gateway.credito -= 1;
+      EnCola enCola = gateway.pubQueue.front();
+      gateway.pubQueue.pop_front();
+      publicar(gateway, *enCola.publicacion, enCola.backfill);
+      gateway.pubPool.release(enCola.publicacion);
+    }
+    if (gateway.pubQueue.empty())
+      gateway.credito = std::min(gateway.credito, 1.0);
+  }
+
+  // procesarBatch del firmware
+  void procesarTrama(Gateway &gateway, const RxFrame &trama)
+  {
+    gateway.tramas++;
+    uint32_t primerSeq;
+    uint8_t numLecturas;
+    if (!leerCabeceraBatch(&trama, primerSeq, numLecturas) || numLecturas == 0)
+      return;
+
+    bool backfill = trama.data[0] == MSG_BACKFILL_DATA;
+    uint32_t primeraNueva = primerSeq, ultimaNueva = primerSeq + numLecturas - 1;
+    bool nuevas;
+    if (backfill)
+      nuevas = gateway.secuencias.registrarBackfill(trama.mac, primerSeq, numLecturas, primeraNueva, ultimaNueva);
+    else
+      nuevas = gateway.secuencias.registrar(trama.mac, primerSeq, numLecturas, primeraNueva) != SECUENCIA_REPETIDA;
+
+    PendingPublish *anuncio = NULL;
+    if (!nuevas)
+    {
+      gateway.repetidos++;
+    }
+    else
+    {
+      anuncio = reservar(gateway); // Antes que las lecturas, como en el firmware
+      uint32_t encoladas = publicarTrama(gateway, trama, primeraNueva, ultimaNueva, backfill, anuncio != NULL ? 1 : 0);
+      if (primeraNueva + encoladas <= ultimaNueva)
+        gateway.secuencias.aplazar(trama.mac, primeraNueva + encoladas, ultimaNueva);
+      if (backfill && encoladas == 0 && anuncio != NULL)
+      {
+        gateway.pubPool.release(anuncio);
+        anuncio = NULL;
+      }
+    }
+
+    pedirBackfill(gateway, trama.mac);
+    if (anuncio != NULL)
+    {
+      HuecoSecuencias huecos[MAX_HUECOS_NODO];
+      uint8_t numHuecos = gateway.secuencias.huecos(trama.mac, huecos);
+      construirPublicacionSecuencia(anuncio, RED_SIM, gateway.id, trama.mac, gateway.secuencias.siguienteSeq(trama.mac),
+                                    gateway.secuencias.recibidoDesde(trama.mac), huecos, numHuecos);
+      gateway.pubQueue.push_back(EnCola{anuncio, false});
+    }
+  }
+
+  PendingPublish *reservar(Gateway &gateway)
+  {
+    PendingPublish *publicacion = gateway.pubPool.allocate();
+    if (publicacion == NULL)
+      gateway.descartesPub++;
+    return publicacion;
+  }
+
+  // Como en el firmware, solo se encolan lecturas completas y en orden; devuelve cuántas
+  uint32_t publicarTrama(Gateway &gateway, const RxFrame &trama, uint32_t primeraNueva, uint32_t ultimaNueva, bool backfill, size_t reservadas)
+  {
+    std::vector<PendingPublish *> publicaciones;
+    construirPublicaciones(&trama, RED_SIM, [&]() { return reservar(gateway); },
+                           [&](PendingPublish *publicacion) { publicaciones.push_back(publicacion); }, primeraNueva, ultimaNueva);
+
+    size_t encolables = std::min(publicaciones.size(), NUM_PUBLICACIONES - gateway.pubQueue.size() - reservadas);
+    encolables -= encolables % PUBLICACIONES_POR_LECTURA;
+    for (size_t i = 0; i < publicaciones.size(); i++)
+    {
+      if (i < encolables)
+      {
+        gateway.pubQueue.push_back(EnCola{publicaciones[i], backfill});
+      }
+      else
+      {
+        gateway.pubPool.release(publicaciones[i]);
+        gateway.descartesPub++;
+      }
+    }
+    return encolables / PUBLICACIONES_POR_LECTURA;
+  }
+
+  // La petición viaja por ESP-NOW como una trama más; el nodo la descarta si ya tiene BACKFILL_MAX_PETICIONES
+  void pedirBackfill(Gateway &gateway, const uint8_t *mac)
+  {
+    Nodo &nodo = *nodos[(mac[4] << 8) | mac[5]];
+    PeticionBackfill peticion{indice(gateway), 0, 0};
+    while (gateway.secuencias.huecoSinPedir(mac, peticion.desde, peticion.hasta))
+    {
+      if (uniforme(aleatorio) >= PERDIDA_TRAMA && nodo.peticiones.size() < BACKFILL_MAX_PETICIONES)
+        nodo.peticiones.push_back(peticion);
+    }
+  }
+
+  void publicar(Gateway &gateway, const PendingPublish &publicacion, bool backfill)
+  {
+    if (publicacion.retener)
+    {
+      broker.push_back(EnBroker{ahoraMs + LATENCIA_BROKER_MS, indice(gateway), publicacion});
+      return;
+    }
+    // Topic /red/tipo/nodo y payload {"valor": ..., "timestamp": ..., "seq": N}
+    const char *seq = strstr(publicacion.payload, "\"seq\": ");
+    if (seq == NULL)
+      return;
+    std::string clave = std::string(publicacion.topic) + "#" + (seq + 7);
+    bool nueva = publicadas.insert(clave).second;
+    if (!nueva)
+      duplicadas++;
+    if (strstr(publicacion.topic, "/potentiometer/") != NULL) // Una lectura son tres publicaciones; la última la completa
+    {
+      gateway.lecturas++;
+      if (nueva)
+      {
+        unicas++;
+        if (backfill)
+          recuperadas++;
+      }
+    }
+  }
+
+  void entregarBroker()
+  {
+    while (!broker.empty() && broker.front().entregaMs <= ahoraMs)
+    {
+      const EnBroker &mensaje = broker.front();
+      for (auto &gateway : gateways) // OnMqttMessage de cada gateway suscrito
+      {
+        uint8_t mac[6];
+        uint32_t siguienteSeq, recibidoDesde;
+        HuecoSecuencias huecos[MAX_HUECOS_NODO];
+        uint8_t numHuecos;
+        const PendingPublish &p = mensaje.publicacion;
+        if (gateway->vivo && leerPublicacionSecuencia(p.topic, (const uint8_t *)p.payload, strlen(p.payload), gateway->id, mac, siguienteSeq,
+                                                      recibidoDesde, huecos, numHuecos))
+          gateway->secuencias.avanzar(mac, siguienteSeq, recibidoDesde, huecos, numHuecos);
+      }
+      broker.pop_front();
+    }
+  }
+
+  void pasoNodo(Nodo &nodo, bool generar)
+  {
+    if (generar && ahoraMs >= nodo.siguienteBatchMs)
+    {
+      nodo.siguienteBatchMs += periodoMs;
+      DataBatch batch;
+      batch.numLecturas = LECTURAS_POR_BATCH;
+      batch.primerSeq = nodo.siguienteSeq;
+      for (int i = 0; i < LECTURAS_POR_BATCH; i++)
+        batch.lecturas[i] = DataReading{20.0f, 50.0f, 10, (uint32_t)(1700000000 + ahoraMs / 1000)};
+      nodo.siguienteSeq += LECTURAS_POR_BATCH;
+      ofrecidas += LECTURAS_POR_BATCH;
+      nodo.pendientes.push_back(batch);
+      if (nodo.pendientes.size() > MAX_PENDIENTES_NODO)
+      {
+        nodo.pendientes.pop_front();
+        nodo.descartados += LECTURAS_POR_BATCH;
+      }
+    }
+
+    if (!nodo.fijo)
+      nodo.tabla.revisar((uint32_t)ahoraMs); // gatewayDestino()
+    const uint8_t *destino = nodo.tabla.destino(gateways[0]->mac);
+    if (nodo.afectado && nodo.cambioMs < 0 && memcmp(destino, gateways[0]->mac, 6) != 0)
+    {
+      nodo.cambioMs = ahoraMs;
+      nodo.motivo = nodo.tabla.ultimoMotivo;
+    }
+
+    if (ahoraMs >= nodo.siguienteBackfillMs)
+    {
+      nodo.siguienteBackfillMs = ahoraMs + BACKFILL_INTERVALO_MS;
+      enviarBackfill(nodo);
+    }
+
+    if (nodo.pendientes.empty() || ahoraMs < nodo.siguienteEnvioMs)
+      return;
+
+    Gateway &gateway = *gateways[indiceMac(destino)];
+    const DataBatch &batch = nodo.pendientes.front();
+    bool llega = gateway.vivo && uniforme(aleatorio) >= PERDIDA_TRAMA;
+    bool confirmado = llega && uniforme(aleatorio) >= PERDIDA_CONFIRMACION;
+    if (llega)
+      recibir(gateway, nodo, batch);
+
+    if (!nodo.fijo)
+      nodo.tabla.registrarEnvio(destino, confirmado, (uint32_t)ahoraMs); // OnDataSent
+    if (confirmado)
+    {
+      nodo.pendientes.pop_front();
+      nodo.siguienteEnvioMs = ahoraMs + TIEMPO_ENVIO_MS;
+      if (nodo.afectado && nodo.entregaMs < 0 && &gateway != gateways[0].get())
+        nodo.entregaMs = ahoraMs;
+    }
+    else
+    {
+      nodo.siguienteEnvioMs = ahoraMs + ESPERA_CONFIRMACION_MS;
+    }
+  }
+
+  // backfill_streamer de sensor.node.esp32: un batch por intervalo, sin confirmación, del log de flash del nodo
+  void enviarBackfill(Nodo &nodo)
+  {
+    if (!nodo.backfillEnCurso)
+    {
+      if (nodo.peticiones.empty())
+        return;
+      nodo.backfillActual = nodo.peticiones.front();
+      nodo.peticiones.pop_front();
+      nodo.backfillEnCurso = true;
+    }
+
+    PeticionBackfill &peticion = nodo.backfillActual;
+    uint32_t masAntigua = nodo.siguienteSeq > MAX_HUECO_BACKFILL ? nodo.siguienteSeq - MAX_HUECO_BACKFILL : 0;
+    if (peticion.desde < masAntigua)
+      peticion.desde = masAntigua;
+    if (peticion.desde > peticion.hasta || peticion.desde >= nodo.siguienteSeq) // Petición terminada
+    {
+      nodo.backfillEnCurso = false;
+      return;
+    }
+
+    DataBatch batch;
+    batch.msg_type = MSG_BACKFILL_DATA;
+    batch.primerSeq = peticion.desde;
+    batch.numLecturas = (uint8_t)std::min<uint32_t>({LECTURAS_POR_BATCH, peticion.hasta - peticion.desde + 1, nodo.siguienteSeq - peticion.desde});
+    for (int i = 0; i < batch.numLecturas; i++)
+      batch.lecturas[i] = DataReading{20.0f, 50.0f, 10, (uint32_t)(1700000000 + ahoraMs / 1000)};
+    peticion.desde += batch.numLecturas;
+
+    Gateway &gateway = *gateways[peticion.gateway];
+    if (gateway.vivo && uniforme(aleatorio) >= PERDIDA_TRAMA)
+      recibir(gateway, nodo, batch);
+  }
+
+  // OnDataRecv: con la cola llena la trama se descarta, aunque ya esté confirmada
+  void recibir(Gateway &gateway, const Nodo &nodo, const DataBatch &batch)
+  {
+    if (gateway.rx.size() >= NUM_TRAMAS_RX)
+    {
+      gateway.descartesRx++;
+      return;
+    }
+    RxFrame trama;
+    memcpy(trama.mac, nodo.mac, 6);
+    trama.len = offsetof(DataBatch, lecturas) + batch.numLecturas * sizeof(DataReading);
+    trama.rxMicros = ahoraMs * 1000;
+    memcpy(trama.data, &batch, trama.len);
+    gateway.rx.push_back(trama);
+  }
+
+  Resultado resultado(int64_t finMs)
+  {
+    Resultado r;
+    r.ofrecidas = ofrecidas;
+    r.duplicadas = duplicadas;
+    r.entregadas = unicas;
+    r.porBackfill = recuperadas;
+    r.sinEntregar = ofrecidas - unicas;
+    for (auto &gateway : gateways)
+    {
+      r.repetidos += gateway->repetidos;
+      r.porGateway.push_back(gateway->lecturas);
+    }
+    for (auto &nodo : nodos)
+    {
+      r.enNodo += nodo->pendientes.size() * LECTURAS_POR_BATCH;
+      r.cambiosCarga += nodo->tabla.cambiosCarga;
+      r.cambiosFallos += nodo->tabla.cambiosFallos;
+      r.cambiosCaducidad += nodo->tabla.cambiosCaducidad;
+      if (nodo->afectado)
+      {
+        r.cambioMs.push_back(nodo->cambioMs >= 0 ? nodo->cambioMs - caidaMs : -1);
+        r.entregaMs.push_back(nodo->entregaMs >= 0 ? nodo->entregaMs - caidaMs : -1);
+        if (nodo->motivo == CAMBIO_FALLOS)
+          r.porFallos++;
+        else if (nodo->motivo == CAMBIO_CADUCIDAD)
+          r.porCaducidad++;
+      }
+    }
+    r.lecturasPorSegundo = r.entregadas * 1000.0 / finMs;
+    return r;
+  }
+
+  int indice(const Gateway &gateway) const
+  {
+    for (size_t g = 0; g < gateways.size(); g++)
+    {
+      if (gateways[g].get() == &gateway)
+        return (int)g;
+    }
+    return 0;
+  }
+
+  int indiceMac(const uint8_t *mac) const
+  {
+    for (size_t g = 0; g < gateways.size(); g++)
+    {
+      if (memcmp(gateways[g]->mac, mac, 6) == 0)
+        return (int)g;
+    }
+    return 0;
+  }
+
+  const Opciones &opciones;
+  long periodoMs;
+  int64_t caidaMs;
+  int64_t ahoraMs = 0;
+  std::mt19937 aleatorio;
+  std::uniform_real_distribution<double> uniforme{0, 1};
+  std::vector<std::unique_ptr<Gateway>> gateways;
+  std::vector<std::unique_ptr<Nodo>> nodos;
+  std::deque<EnBroker> broker;
+  std::set<std::string> publicadas; // topic#seq de cada publicación de lectura
+  uint64_t ofrecidas = 0, duplicadas = 0, unicas = 0, recuperadas = 0;
+};
+
+static bool leerLista(char *texto, std::vector<long> &valores)
+{
+  valores.clear();
+  for (char *valor = strtok(texto, ","); valor != nullptr; valor = strtok(nullptr, ","))
+    valores.push_back(atol(valor));
+  return !valores.empty();
+}
+
+static bool leerOpciones(int argc, char **argv, Opciones &opciones)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--nodos") == 0 && i + 1 < argc)
+      opciones.nodos = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--gateways") == 0 && i + 1 < argc)
+    {
+      if (!leerLista(argv[++i], opciones.gateways))
+        return false;
+    }
+    else if (strcmp(argv[i], "--periodo") == 0 && i + 1 < argc)
+      opciones.periodoMs = atol(argv[++i]);
+    else if (strcmp(argv[i], "--publicaciones") == 0 && i + 1 < argc)
+      opciones.publicacionesPorSegundo = atof(argv[++i]);
+    else if (strcmp(argv[i], "--segundos") == 0 && i + 1 < argc)
+      opciones.segundos = atol(argv[++i]);
+    else if (strcmp(argv[i], "--periodos-caida") == 0 && i + 1 < argc)
+    {
+      if (!leerLista(argv[++i], opciones.periodosCaida))
+        return false;
+    }
+    else
+      return false;
+  }
+  for (long g : opciones.gateways)
+  {
+    if (g < 1 || g > MAX_GATEWAYS)
+      return false;
+  }
+  return opciones.nodos > 0 && opciones.nodos <= MAX_NODOS && opciones.periodoMs > 0 && opciones.publicacionesPorSegundo > 0 &&
+         opciones.segundos > 0;
+}
+
+static int64_t percentil(std::vector<int64_t> valores, double p)
+{
+  if (valores.empty())
+    return -1;
+  size_t i = std::min(valores.size() - 1, (size_t)(p * (valores.size() - 1)));
+  std::nth_element(valores.begin(), valores.begin() + i, valores.end());
+  return valores[i];
+}
+
+int main(int argc, char **argv)
+{
+  Opciones opciones;
+  if (!leerOpciones(argc, argv, opciones))
+  {
+    fprintf(stderr, "uso: %s [--nodos N] [--gateways 1,2,...] [--periodo ms] [--publicaciones N] [--segundos S] [--periodos-caida ms,...]\n"
+                    "     (hasta %d nodos y %d gateways)\n",
+            argv[0], MAX_NODOS, MAX_GATEWAYS);
+    return 2;
+  }
+
+  double ofrecidas = opciones.nodos * LECTURAS_POR_BATCH * 1000.0 / opciones.periodoMs;
+  printf("Throughput: %d nodos, un batch cada %ld ms (%.0f lecturas/s ofrecidas), %.0f publicaciones/s por gateway, %ld s\n\n",
+         opciones.nodos, opciones.periodoMs, ofrecidas, opciones.publicacionesPorSegundo, opciones.segundos);
+  printf("%8s %-9s %11s %9s %10s %10s %10s %10s %10s | %-24s | %s\n", "gateways", "eleccion", "lecturas/s", "entrega",
+         "backfill", "sin entr.", "en nodo", "repetidos", "duplicad.", "reparto por gateway (%)", "cambios carga/fallos");
+
+  int codigo = 0;
+  for (long numGateways : opciones.gateways)
+  {
+    for (int fijo = 1; fijo >= 0; fijo--)
+    {
+      Simulacion simulacion(opciones, numGateways, fijo, opciones.periodoMs, -1);
+      Resultado r = simulacion.ejecutar();
+
+      char reparto[64] = "";
+      for (size_t g = 0; g < r.porGateway.size(); g++)
+      {
+        size_t len = strlen(reparto);
+        snprintf(reparto + len, sizeof(reparto) - len, "%s%.0f", g > 0 ? "/" : "", r.entregadas > 0 ? 100.0 * r.porGateway[g] / r.entregadas : 0);
+      }
+      printf("%8ld %-9s %11.1f %8.1f%% %10llu %10llu %10llu %10llu %10llu | %-24s | %llu/%llu\n", numGateways, fijo ? "fija" : "balizas",
+             r.lecturasPorSegundo, 100.0 * r.entregadas / r.ofrecidas, (unsigned long long)r.porBackfill, (unsigned long long)r.sinEntregar,
+             (unsigned long long)r.enNodo, (unsigned long long)r.repetidos, (unsigned long long)r.duplicadas, reparto,
+             (unsigned long long)r.cambiosCarga, (unsigned long long)r.cambiosFallos);
+      if (r.duplicadas > 0)
+        codigo = 1;
+    }
+  }
+
+  long numGateways = opciones.gateways.back() >= 2 ? opciones.gateways.back() : 2;
+  int64_t caidaMs = opciones.segundos * 1000 / 2;
+  printf("\nCaida del primer gateway a los %lld s, con %ld gateways y %d nodos\n\n", (long long)(caidaMs / 1000), numGateways, opciones.nodos);
+  printf("%10s %9s | %-26s | %-26s | %12s %10s %10s %10s %10s\n", "periodo", "afectados", "cambio p50/p90/max (ms)",
+         "entrega p50/p90/max (ms)", "por fallos", "caducidad", "backfill", "sin entr.", "duplicad.");
+  for (long periodoMs : opciones.periodosCaida)
+  {
+    Opciones caida = opciones;
+    caida.segundos = std::max<long>(opciones.segundos, 3 * periodoMs / 1000); // Que haya envíos después de la caída
+    caidaMs = caida.segundos * 1000 / 2;
+    Simulacion simulacion(caida, numGateways, false, periodoMs, caidaMs);
+    Resultado r = simulacion.ejecutar();
+    printf("%8ld ms %9zu | %7lld %8lld %9lld | %7lld %8lld %9lld | %12llu %10llu %10llu %10llu %10llu\n", periodoMs, r.cambioMs.size(),
+           (long long)percentil(r.cambioMs, 0.5), (long long)percentil(r.cambioMs, 0.9), (long long)percentil(r.cambioMs, 1.0),
+           (long long)percentil(r.entregaMs, 0.5), (long long)percentil(r.entregaMs, 0.9), (long long)percentil(r.entregaMs, 1.0),
+           (unsigned long long)r.porFallos, (unsigned long long)r.porCaducidad,
+           (unsigned long long)r.porBackfill, (unsigned long long)r.sinEntregar, (unsigned long long)r.duplicadas);
+    if (r.duplicadas > 0)
+      codigo = 1;
+  }
+  return codigo;
+}
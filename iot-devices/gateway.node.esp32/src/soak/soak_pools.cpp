@@ -0,0 +1,391 @@
+// Prueba de resistencia en el host del camino de mensajes del gateway: pool de tramas -> cola -> frame_processor ->
+// pool de publicaciones -> pubQueue -> loop() -> publicación o backlog. El procesamiento es el del firmware
+// (procesador.h); tres hilos hacen de OnDataRecv, frame_processor y loop() con los mismos pools y tamaños que el
+// firmware, y se alternan fases que agotan los pools a propósito:
+//
+//   normal    el broker publica más deprisa de lo que llegan las tramas
+//   caida     el broker no está: las publicaciones pasan al backlog hasta llenarlo y después se quedan en pubQueue
+//   atasco    loop() deja de vaciar pubQueue: se agotan pubPool y después rxPool
+//   ráfaga    llegan tramas sin pausa, más deprisa de lo que se procesan
+//
+// Al final se comprueba que los pools se recuperan (sin bloques perdidos ni entregados dos veces), que todas las
+// publicaciones están contadas como publicadas o descartadas y que el heap no crece de un ciclo a otro: se mide el heap
+// y la memoria residente al principio y al final de cada ciclo. Devuelve 1 si falla alguna comprobación.
+//
+//   pio run -e native-soak
+//   .pio/build/native-soak/program [--ciclos N] [--fase ms]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <malloc.h>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unistd.h>
+#include "pool.h"
+#include "pipeline.h"
+#include "procesador.h"
+
+#define RED_SOAK "gateway.node.esp32" // Identificador de red con el que se generan los topics, igual que en el firmware
+#define GATEWAY_SOAK "gatewaysoak"     // Identificador del gateway en las publicaciones de secuencia
+#define NODOS_SOAK 8                    // Nodos sensores simulados
+#define CRECIMIENTO_HEAP_MAX 65536      // Bytes que puede crecer el heap entre el final del primer ciclo y el del último
+
+typedef struct // Opciones de la línea de comandos
+{
+  long ciclos = 10;
+  long faseMs = 250;
+} Opciones;
+
+typedef enum
+{
+  FASE_NORMAL = 0,
+  FASE_CAIDA,
+  FASE_ATASCO,
+  FASE_RAFAGA,
+  NUM_FASES,
+} Fase;
+
+static const char *nombresFase[] = {"normal", "caida", "atasco", "rafaga"};
+
+// Cola acotada de punteros sin espera, como xQueueSend/xQueueReceive con timeout 0
+template <typename T, size_t N>
+class Cola
+{
+public:
+  bool enviar(T *elemento)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (cola.size() >= N)
+      return false;
+    cola.push_back(elemento);
+    return true;
+  }
+
+  T *recibir()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (cola.empty())
+      return NULL;
+    T *elemento = cola.front();
+    cola.pop_front();
+    return elemento;
+  }
+
+  size_t size()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return cola.size();
+  }
+
+  size_t libres() // uxQueueSpacesAvailable
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return N - cola.size();
+  }
+
+private:
+  std::mutex mutex;
+  std::deque<T *> cola;
+};
+
+// Registro de los bloques entregados por un pool: detecta un bloque entregado dos veces o liberado sin estar en uso
+template <typename T>
+class Propiedad
+{
+public:
+  void tomar(const T *bloque)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!vivos.insert(bloque).second)
+      errores++;
+  }
+
+  void soltar(const T *bloque)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (vivos.erase(bloque) != 1)
+      errores++;
+  }
+
+  size_t vivosAhora()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return vivos.size();
+  }
+
+  std::atomic<uint32_t> errores{0};
+
+private:
+  std::mutex mutex;
+  std::set<const T *> vivos;
+};
+
+// StaticPool que apunta en un Propiedad cada bloque que entrega y que recibe de vuelta; el procesador lo usa igual
+template <typename T, size_t N>
+class PoolVigilado
+{
+public:
+  T *allocate()
+  {
+    T *bloque = pool.allocate();
+    if (bloque != NULL)
+      propiedad.tomar(bloque);
+    return bloque;
+  }
+
+  void release(T *bloque)
+  {
+    propiedad.soltar(bloque);
+    pool.release(bloque);
+  }
+
+  size_t inUse() const { return pool.inUse(); }
+  size_t capacity() const { return pool.capacity(); }
+  size_t highWater() const { return pool.highWater(); }
+  uint32_t failures() const { return pool.failures(); }
+  uint32_t allocations() const { return pool.allocations(); }
+
+  Propiedad<T> propiedad;
+
+private:
+  StaticPool<T, N> pool;
+};
+
+PoolVigilado<RxFrame, NUM_TRAMAS_RX> rxPool;
+PoolVigilado<PendingPublish, NUM_PUBLICACIONES> pubPool;
+PoolVigilado<BacklogRecord, NUM_REGISTROS_BACKLOG> backlogPool;
+Cola<RxFrame, NUM_TRAMAS_RX> rxQueue;
+Cola<PendingPublish, NUM_PUBLICACIONES> pubQueue;
+
+std::atomic<int> fase{FASE_NORMAL};
+std::atomic<bool> parar{false};
+std::atomic<uint64_t> tramasGeneradas{0}, tramasDescartadas{0}, tramasProcesadas{0}, publicadas{0};
+
+// Lo que procesador.h necesita del entorno. En la fase de caída no hay broker; los nodos no existen, así que las
+// peticiones de backfill solo se cuentan.
+struct PlataformaSoak
+{
+  bool encolar(PendingPublish *publicacion) { return pubQueue.enviar(publicacion); }
+  size_t huecosCola() { return pubQueue.libres(); }
+  bool sacar(PendingPublish *&publicacion) { return (publicacion = pubQueue.recibir()) != NULL; }
+
+  bool publicar(const PendingPublish *)
+  {
+    if (!conBroker())
+      return false;
+    publicadas++;
+    return true;
+  }
+
+  bool conBroker() { return fase != FASE_CAIDA; }
+  bool alcanzable(const uint8_t *) { return true; }
+  void enviar(const uint8_t *, const uint8_t *, size_t) {}
+  void atenderHora(const RxFrame *) {}
+  void bloquear() { mutex.lock(); }
+  void desbloquear() { mutex.unlock(); }
+  bool cargarSecuencia(const uint8_t *, uint32_t &, HuecoSecuencias *, uint8_t &) { return false; }
+  void guardarSecuencia(const uint8_t *, uint32_t, const HuecoSecuencias *, uint8_t) {}
+
+  uint32_t ahoraMs()
+  {
+    auto ahora = std::chrono::steady_clock::now().time_since_epoch();
+    return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(ahora).count();
+  }
+
+private:
+  std::mutex mutex;
+};
+
+PlataformaSoak plataforma;
+ProcesadorTramas<PlataformaSoak, PoolVigilado<PendingPublish, NUM_PUBLICACIONES>,
+                 PoolVigilado<BacklogRecord, NUM_REGISTROS_BACKLOG>>
+    procesadorTramas(plataforma, pubPool, backlogPool, RED_SOAK, GATEWAY_SOAK);
+
+// OnDataRecv: copia la trama a un bloque del pool y la encola; con el pool o la cola llenos se descarta
+static void receptor()
+{
+  uint32_t seq[NODOS_SOAK] = {};
+  for (uint32_t n = 0; !parar; n++)
+  {
+    int nodo = n % NODOS_SOAK;
+    DataBatch batch;
+    batch.numLecturas = 1 + n % LECTURAS_POR_BATCH;
+    batch.primerSeq = seq[nodo];
+    for (int i = 0; i < batch.numLecturas; i++)
+      batch.lecturas[i] = DataReading{20.0f + i, 50.0f, (uint8_t)i, 1700000000u + n};
+    seq[nodo] += batch.numLecturas;
+    tramasGeneradas++;
+
+    RxFrame *trama = rxPool.allocate();
+    if (trama == NULL)
+    {
+      tramasDescartadas++;
+    }
+    else
+    {
+      uint8_t mac[6] = {0x24, 0x0A, 0xC4, 0x00, 0x00, (uint8_t)nodo};
+      memcpy(trama->mac, mac, sizeof(mac));
+      trama->len = offsetof(DataBatch, lecturas) + batch.numLecturas * sizeof(DataReading);
+      memcpy(trama->data, &batch, trama->len);
+      if (!rxQueue.enviar(trama))
+      {
+        rxPool.release(trama);
+        tramasDescartadas++;
+      }
+    }
+
+    if (fase == FASE_RAFAGA)
+      std::this_thread::yield();
+    else
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+  }
+}
+
+// frame_processor: cada trama por el procesador del firmware; la trama vuelve a su pool después
+static void procesador()
+{
+  while (!parar || rxQueue.size() > 0)
+  {
+    RxFrame *trama = rxQueue.recibir();
+    if (trama == NULL)
+    {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+      continue;
+    }
+    procesadorTramas.procesarTrama(trama);
+    tramasProcesadas++;
+    rxPool.release(trama);
+  }
+}
+
+// loop(): vaciarPublicaciones() del firmware, salvo en la fase de atasco, en la que loop() no llega a vaciar pubQueue
+static void publicador()
+{
+  for (;;)
+  {
+    int ahora = fase;
+    if (ahora != FASE_ATASCO)
+      procesadorTramas.vaciarPublicaciones(plataforma.conBroker());
+
+    if (parar && backlogPool.inUse() == 0 && pubQueue.size() == 0 && rxQueue.size() == 0 && rxPool.inUse() == 0)
+      return;
+    std::this_thread::sleep_for(std::chrono::microseconds(ahora == FASE_CAIDA ? 1000 : 100));
+  }
+}
+
+// Bytes reservados con malloc/new que siguen en uso y memoria residente del proceso
+static void medirMemoria(size_t &heap, size_t &rss)
+{
+  heap = mallinfo2().uordblks;
+  rss = 0;
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (statm == NULL)
+    return;
+  unsigned long paginas, residentes;
+  if (fscanf(statm, "%lu %lu", &paginas, &residentes) == 2)
+    rss = residentes * (size_t)sysconf(_SC_PAGESIZE);
+  fclose(statm);
+}
+
+static bool leerOpciones(int argc, char **argv, Opciones &opciones)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--ciclos") == 0 && i + 1 < argc)
+      opciones.ciclos = atol(argv[++i]);
+    else if (strcmp(argv[i], "--fase") == 0 && i + 1 < argc)
+      opciones.faseMs = atol(argv[++i]);
+    else
+      return false;
+  }
+  return opciones.ciclos > 0 && opciones.faseMs > 0;
+}
+
+int main(int argc, char **argv)
+{
+  Opciones opciones;
+  if (!leerOpciones(argc, argv, opciones))
+  {
+    fprintf(stderr, "uso: %s [--ciclos N] [--fase ms]\n", argv[0]);
+    return 2;
+  }
+
+  std::thread hiloReceptor(receptor), hiloProcesador(procesador), hiloPublicador(publicador);
+  printf("%6s %-8s | %-16s | %-16s | %-16s | %10s %10s\n", "ciclo", "fase", "rx uso/max/fall.", "pub uso/max/fall.",
+         "backlog uso/max", "tramas", "descartes");
+
+  size_t heapInicial = 0, heapFinalPrimero = 0, heapFinal = 0, rssInicial = 0, rssFinal = 0;
+  for (long ciclo = 0; ciclo < opciones.ciclos; ciclo++)
+  {
+    size_t heapCiclo, rssCiclo;
+    medirMemoria(heapCiclo, rssCiclo);
+    if (ciclo == 0)
+    {
+      heapInicial = heapCiclo;
+      rssInicial = rssCiclo;
+    }
+
+    for (int f = 0; f < NUM_FASES; f++)
+    {
+      fase = f;
+      std::this_thread::sleep_for(std::chrono::milliseconds(opciones.faseMs));
+      if (ciclo == 0 || ciclo == opciones.ciclos - 1)
+        printf("%6ld %-8s | %5zu %4zu %6u | %5zu %4zu %6u | %5zu %10zu | %10llu %10llu\n", ciclo, nombresFase[f],
+               rxPool.inUse(), rxPool.highWater(), (unsigned)rxPool.failures(),
+               pubPool.inUse(), pubPool.highWater(), (unsigned)pubPool.failures(),
+               backlogPool.inUse(), backlogPool.highWater(),
+               (unsigned long long)tramasGeneradas,
+               (unsigned long long)(tramasDescartadas + procesadorTramas.publicacionesDescartadas));
+    }
+
+    medirMemoria(heapFinal, rssFinal);
+    if (ciclo == 0)
+      heapFinalPrimero = heapFinal;
+    printf("%6ld %-8s | heap %zu -> %zu bytes, RSS %zu -> %zu KiB\n", ciclo, "memoria", heapCiclo, heapFinal,
+           rssCiclo / 1024, rssFinal / 1024);
+  }
+
+  fase = FASE_NORMAL; // Recuperación: con el broker de vuelta todo lo pendiente tiene que salir
+  parar = true;
+  hiloReceptor.join();
+  hiloProcesador.join();
+  hiloPublicador.join();
+
+  bool agotados = rxPool.failures() > 0 && pubPool.failures() > 0 && backlogPool.highWater() == backlogPool.capacity();
+  bool recuperados = rxPool.inUse() == 0 && pubPool.inUse() == 0 && backlogPool.inUse() == 0 &&
+                     rxPool.propiedad.vivosAhora() == 0 && pubPool.propiedad.vivosAhora() == 0 &&
+                     backlogPool.propiedad.vivosAhora() == 0;
+  bool tramasCuadran = tramasGeneradas == tramasProcesadas + tramasDescartadas;
+  // Cada reserva de pubPool, con bloque o sin él, acaba publicada o descartada. Vale porque aquí no llegan backfills:
+  // el anuncio de un backfill que no cabe se libera sin contarse como descarte
+  bool publicacionesCuadran =
+      pubPool.allocations() + pubPool.failures() == publicadas + procesadorTramas.publicacionesDescartadas;
+  bool memoriaEstable = heapFinal <= heapFinalPrimero + CRECIMIENTO_HEAP_MAX;
+  uint32_t errores = rxPool.propiedad.errores + pubPool.propiedad.errores + backlogPool.propiedad.errores;
+
+  printf("\nTramas: %llu generadas, %llu procesadas, %llu descartadas\n", (unsigned long long)tramasGeneradas,
+         (unsigned long long)tramasProcesadas, (unsigned long long)tramasDescartadas);
+  printf("Publicaciones: %u creadas, %llu publicadas, %u descartadas (%u por pool agotado)\n",
+         (unsigned)pubPool.allocations(), (unsigned long long)publicadas,
+         (unsigned)procesadorTramas.publicacionesDescartadas,
+         (unsigned)pubPool.failures());
+  printf("Secuencias: %u huecos, %u batches repetidos, %u backfills pedidos\n", (unsigned)procesadorTramas.huecosDetectados,
+         (unsigned)procesadorTramas.tramasRepetidas, (unsigned)procesadorTramas.backfillsPedidos);
+  printf("Memoria: heap %zu -> %zu bytes (%+lld desde el primer ciclo), RSS %zu -> %zu KiB\n", heapInicial, heapFinal,
+         (long long)heapFinal - (long long)heapFinalPrimero, rssInicial / 1024, rssFinal / 1024);
+  printf("Pools agotados en alguna fase: %s\n", agotados ? "si" : "NO");
+  printf("Pools recuperados al final (sin bloques en uso): %s\n", recuperados ? "si" : "NO");
+  printf("Cuentas de tramas y publicaciones: %s\n", tramasCuadran && publicacionesCuadran ? "cuadran" : "NO CUADRAN");
+  printf("Heap estable entre ciclos: %s\n", memoriaEstable ? "si" : "NO");
+  printf("Bloques entregados dos veces o liberados sin estar en uso: %u\n", (unsigned)errores);
+
+  if (!agotados || !recuperados || !tramasCuadran || !publicacionesCuadran || !memoriaEstable || errores > 0)
+    return 1;
+  return 0;
+}
@@ -1,26 +1,82 @@
-uint8_t gatewayAddress[] = {0x10, 0x06, 0x1C, 0xBA, 0x1A, 0x00};
+#pragma once
 
-typedef struct // Estructura para el almacenamiento de una lectura con su timestamp
+static const uint8_t gatewayAddress[] = {0x10, 0x06, 0x1C, 0xBA, 0x1A, 0x00}; // Gateway por defecto, hasta recibir la primera baliza
+
+#define LECTURAS_POR_BATCH 10 // Número de lecturas que se envían en cada batch
+
+// __attribute__((packed)) evita el relleno en las estructuras para que ocupen lo mismo en el emisor y en el receptor.
+// El primer byte de cada mensaje indica su tipo, así el receptor no depende del tamaño del payload para identificarlo.
+typedef enum __attribute__((packed))
+{
+  MSG_TIME_REQUEST = (uint8_t)0x00,
+  MSG_TIME_RESPONSE,
+  MSG_DATA_BATCH,
+  MSG_PRESENCE,
+  MSG_NODE_STATUS,
+  MSG_BACKFILL_REQUEST,
+  MSG_BACKFILL_DATA,
+  MSG_GATEWAY_BEACON,
+} MessageType;
+
+typedef enum __attribute__((packed)) // Forma de indicar el rango pedido en un MSG_BACKFILL_REQUEST
+{
+  BACKFILL_POR_SECUENCIA = (uint8_t)0x00,
+  BACKFILL_POR_TIEMPO,
+} BackfillMode;
+
+typedef struct __attribute__((packed)) // Estructura para el almacenamiento de una lectura con su timestamp
 {
   float temperatura;
   float humedad;
-  int porcentaje;
-  time_t timestamp;
+  int32_t porcentaje;
+  uint32_t timestamp; // Segundos UTC; 32 bits para que el formato no dependa del tamaño de time_t
 } DataReading;
 
-typedef struct // Estructura para el almacenamiento de la notificación de la presencia
+typedef struct __attribute__((packed)) // Lote de lecturas consecutivas; la lectura i tiene el número de secuencia primerSeq + i
+{
+  MessageType msg_type = MSG_DATA_BATCH; // MSG_DATA_BATCH o MSG_BACKFILL_DATA
+  uint8_t numLecturas = 0;
+  uint32_t primerSeq = 0;
+  DataReading lecturas[LECTURAS_POR_BATCH];
+} DataBatch;
+
+typedef struct __attribute__((packed)) // Estructura para el almacenamiento de la notificación de la presencia
 {
+  MessageType msg_type = MSG_PRESENCE;
   bool presencia;
-  time_t timestamp;
+  uint32_t timestamp;
 } PresenceNotification;
 
-typedef struct // Estructura para solicitar el tiempo al nodo gateway
+typedef struct __attribute__((packed)) // Estructura para solicitar el tiempo al nodo gateway
 {
-  char request[5] = "TIME";
+  MessageType msg_type = MSG_TIME_REQUEST;
 } TimeRequest;
 
-typedef struct // Estructura para almacenar el estado del nodo
+typedef struct __attribute__((packed)) // Estructura con la que el gateway responde a una TimeRequest
+{
+  MessageType msg_type = MSG_TIME_RESPONSE;
+  uint32_t timestamp;
+} TimeResponse;
+
+typedef struct __attribute__((packed)) // Estructura para almacenar el estado del nodo
 {
-  int rebootCount;
-  unsigned long uptime;
+  MessageType msg_type = MSG_NODE_STATUS;
+  int32_t rebootCount;
+  uint32_t uptime;
 } NodeStatus;
+
+typedef struct __attribute__((packed)) // Petición del gateway para reenviar las lecturas de un rango que no le llegaron
+{
+  MessageType msg_type = MSG_BACKFILL_REQUEST;
+  BackfillMode modo;
+  uint32_t desde; // Primer número de secuencia o timestamp del rango (incluido)
+  uint32_t hasta; // Último número de secuencia o timestamp del rango (incluido)
+} BackfillRequest;
+
+typedef struct __attribute__((packed)) // Baliza que cada gateway difunde periódicamente para que los nodos elijan gateway
+{
+  MessageType msg_type = MSG_GATEWAY_BEACON;
+  uint16_t profundidadCola; // Tramas y publicaciones pendientes en el gateway (incluido el backlog)
+  uint16_t capacidadCola;   // Profundidad con la que el gateway empieza a descartar
+  bool conBroker;           // false si el gateway no tiene conexión con el broker MQTT y está acumulando backlog
+} GatewayBeacon;
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "data.h"
+
+// Estado del modo de ciclos con deep sleep (build con -DMODO_DEEP_SLEEP). Todo lo que tiene que sobrevivir entre
+// despertares vive en la memoria RTC (RTC_DATA_ATTR), que se conserva en deep sleep y se inicializa en cada arranque
+// normal. Por eso estas estructuras son agregados sin constructores: un constructor se ejecutaría en cada despertar y
+// borraría el estado.
+
+#define RTC_MAX_LECTURAS 64          // Lecturas pendientes de enviar que caben en memoria RTC (1 KB)
+#define CICLOS_MAX_ESPERA_S 600      // Antigüedad máxima de la lectura pendiente más antigua antes de encender la radio
+#define CICLOS_RESINCRONIZAR_S 3600  // Cada cuánto se pide la hora al gateway (el RTC deriva poco en una hora)
+#define CICLOS_ESTADO_S 900          // Cada cuánto se envía el estado del nodo
+#define CICLOS_MAX_ESPERA_FALLOS 32  // Ciclos máximos sin intentar enviar tras fallos seguidos (espera exponencial)
+#define HORA_VALIDA 1600000000       // Un time() menor indica que el nodo aún no tiene la hora del gateway
+
+typedef struct // Anillo de lecturas pendientes de enviar; sus números de secuencia son consecutivos
+{
+  uint32_t primerSeq; // Secuencia de lecturas[inicio]
+  uint8_t inicio;
+  uint8_t num;
+  DataReading lecturas[RTC_MAX_LECTURAS];
+
+  // Si el anillo está lleno se descarta la más antigua: sigue en el log de flash y el gateway la pedirá por backfill
+  void agregar(const DataReading &lectura, uint32_t seq)
+  {
+    if (num == 0)
+      primerSeq = seq;
+    if (num == RTC_MAX_LECTURAS)
+    {
+      inicio = (inicio + 1) % RTC_MAX_LECTURAS;
+      primerSeq++;
+      num--;
+    }
+    lecturas[(inicio + num) % RTC_MAX_LECTURAS] = lectura;
+    num++;
+  }
+
+  // Copia en el batch las lecturas más antiguas (sin quitarlas) y devuelve cuántas son
+  uint8_t prepararBatch(DataBatch &batch) const
+  {
+    batch.numLecturas = num < LECTURAS_POR_BATCH ? num : LECTURAS_POR_BATCH;
+    batch.primerSeq = primerSeq;
+    for (uint8_t i = 0; i < batch.numLecturas; i++)
+      batch.lecturas[i] = lecturas[(inicio + i) % RTC_MAX_LECTURAS];
+    return batch.numLecturas;
+  }
+
+  // Quita las n lecturas más antiguas, una vez confirmado su envío
+  void descartar(uint8_t n)
+  {
+    if (n > num)
+      n = num;
+    inicio = (inicio + n) % RTC_MAX_LECTURAS;
+    primerSeq += n;
+    num -= n;
+  }
+
+  uint32_t timestampMasAntiguo() const { return num > 0 ? lecturas[inicio].timestamp : 0; }
+} AnilloRtc;
+
+typedef enum // Motivo por el que un ciclo enciende la radio
+{
+  RADIO_NO = 0,
+  RADIO_PRESENCIA,     // El PIR ha despertado al nodo: la notificación no espera
+  RADIO_BACKFILL,      // Quedó un backfill a medias en el ciclo anterior
+  RADIO_SINCRONIZAR,   // Sin hora o con la última sincronización demasiado antigua
+  RADIO_BATCH,         // Hay un batch completo
+  RADIO_CAMBIO,        // Cambio brusco en una lectura (factorCambioBrusco veces el delta)
+  RADIO_ANTIGUEDAD,    // La lectura pendiente más antigua ha esperado CICLOS_MAX_ESPERA_S
+  RADIO_ESTADO,        // Toca enviar el estado del nodo
+} MotivoRadio;
+
+typedef struct // Estado de los ciclos que se conserva en memoria RTC
+{
+  uint32_t ciclos;                 // Despertares desde el último arranque normal
+  uint32_t ultimaSincronizacion;   // time() de la última respuesta de hora del gateway (0 = nunca)
+  uint32_t ultimoEstado;           // time() del último NodeStatus enviado
+  uint32_t fallosSeguidos;         // Ciclos seguidos en los que la radio no consiguió entregar nada
+  uint32_t siguienteIntento;       // Ciclo a partir del cual se vuelve a intentar tras un fallo
+  int64_t horaAlDormirUs;          // Hora del sistema (epoch en us) justo antes de dormir
+  uint64_t rtcAlDormirUs;          // Contador RTC en ese mismo instante
+  uint64_t rtcDespertarPrevistoUs; // Contador RTC al que está programado el despertar por timer
+  uint64_t rtcSiguienteMuestreoUs; // Plazo de la siguiente lectura de sensores, en el contador RTC
+  uint64_t radioTotalUs;           // Tiempo total con la radio encendida
+  uint64_t despiertoTotalUs;       // Tiempo total despierto (desde que arranca la aplicación hasta dormir)
+  uint32_t ciclosConRadio;
+  uint32_t despertaresSinRadio;    // Despertares sin radio desde el último ciclo con radio, que es el que los informa
+  uint64_t despiertoSinRadioUs;    // Tiempo despierto en esos despertares
+} EstadoCiclos;
+
+// Política adaptativa de vaciado: decide si este ciclo enciende la radio. La radio es lo que más gasta, así que por
+// defecto se acumulan lecturas en RTC hasta completar un batch; se adelanta el envío si hay algo urgente y se espacian
+// los intentos cuando el gateway no responde, sin retrasar por ello las notificaciones de presencia.
+inline MotivoRadio decidirRadio(const AnilloRtc &anillo, const EstadoCiclos &estado, uint32_t ahora, bool presencia,
+                                bool backfillPendiente, bool cambioBrusco)
+{
+  if (presencia)
+    return RADIO_PRESENCIA;
+  if (estado.fallosSeguidos > 0 && estado.ciclos < estado.siguienteIntento)
+    return RADIO_NO;
+  if (backfillPendiente)
+    return RADIO_BACKFILL;
+  if (ahora < HORA_VALIDA || estado.ultimaSincronizacion == 0 || ahora - estado.ultimaSincronizacion >= CICLOS_RESINCRONIZAR_S)
+    return RADIO_SINCRONIZAR;
+  if (anillo.num >= LECTURAS_POR_BATCH)
+    return RADIO_BATCH;
+  if (anillo.num > 0 && cambioBrusco)
+    return RADIO_CAMBIO;
+  if (anillo.num > 0 && ahora - anillo.timestampMasAntiguo() >= CICLOS_MAX_ESPERA_S)
+    return RADIO_ANTIGUEDAD;
+  if (ahora - estado.ultimoEstado >= CICLOS_ESTADO_S)
+    return RADIO_ESTADO;
+  return RADIO_NO;
+}
+
+// Actualiza la espera exponencial tras un ciclo con radio
+inline void registrarResultadoRadio(EstadoCiclos &estado, bool entregado)
+{
+  if (entregado)
+  {
+    estado.fallosSeguidos = 0;
+    return;
+  }
+  estado.fallosSeguidos++;
+  uint32_t espera = 1; // 1, 2, 4... ciclos, hasta CICLOS_MAX_ESPERA_FALLOS
+  for (uint32_t i = 1; i < estado.fallosSeguidos && espera < CICLOS_MAX_ESPERA_FALLOS; i++)
+    espera *= 2;
+  estado.siguienteIntento = estado.ciclos + espera;
+}
+
+inline const char *nombreMotivo(MotivoRadio motivo)
+{
+  static const char *nombres[] = {"no", "presencia", "backfill", "sincronizar", "batch", "cambio", "antiguedad", "estado"};
+  return nombres[motivo];
+}
@@ -0,0 +1,310 @@
+#pragma once
+
+#include <Arduino.h>
+#include <esp_partition.h>
+#include "data.h"
+
+#define FLASH_LOG_PARTITION "lecturas"      // Nombre de la partición de datos definida en partitions.csv
+#define FLASH_LOG_SUBTYPE 0x40              // Subtipo propio de la partición (rango 0x40-0xFE reservado para usuario)
+#define FLASH_LOG_MAGIC 0x4C4F4731          // "LOG1": marca de sector inicializado
+#define FLASH_LOG_SECTOR_SIZE 4096          // Tamaño del sector de borrado de la flash
+#define FLASH_LOG_MAX_SECTORES 64           // Sectores máximos que se indexan en RAM
+#define FLASH_LOG_SEQ_VACIA 0xFFFFFFFF      // Valor de la flash borrada
+
+typedef struct // Cabecera al inicio de cada sector
+{
+  uint32_t magic;
+  uint32_t generacion; // Número de veces que se ha abierto un sector en todo el anillo (crece siempre)
+  uint32_t reservado[2];
+} CabeceraSector;
+
+typedef struct // Registro de una lectura en flash
+{
+  uint32_t seq;
+  DataReading lectura;
+  uint32_t crc;
+} RegistroFlash;
+
+#define FLASH_LOG_REGISTROS_POR_SECTOR ((FLASH_LOG_SECTOR_SIZE - sizeof(CabeceraSector)) / sizeof(RegistroFlash))
+
+// Anillo de lecturas en flash, solo de escritura al final. Los sectores se van abriendo en orden y, al dar la vuelta,
+// se borra el más antiguo, por lo que todos los sectores se borran el mismo número de veces (nivelado de desgaste).
+// En RAM solo se guarda la primera secuencia y el primer timestamp de cada sector, suficiente para localizar un rango.
+// Si no se encuentra la partición el log queda cerrado: append() sigue numerando las lecturas, pero no se guardan y
+// los backfills no encuentran nada que enviar.
+class FlashLog
+{
+public:
+  // informar muestra el estado del log por el puerto serie; en el modo deep sleep se abre en cada despertar y no se usa
+  bool begin(bool informar = true)
+  {
+    if (mutex == NULL)
+      mutex = xSemaphoreCreateMutex();
+    particion = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)FLASH_LOG_SUBTYPE, FLASH_LOG_PARTITION);
+    if (particion == NULL)
+    {
+      Serial.println("No se ha encontrado la particion de lecturas");
+      return false;
+    }
+
+    numSectores = particion->size / FLASH_LOG_SECTOR_SIZE;
+    if (numSectores > FLASH_LOG_MAX_SECTORES)
+      numSectores = FLASH_LOG_MAX_SECTORES;
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    recuperar();
+    if (informar)
+      Serial.printf("Log de lecturas: %d sectores, secuencias %u-%u, %u borrados\n", numSectores,
+                    (unsigned)oldestSeqLocked(), (unsigned)siguienteSeq, (unsigned)generacion);
+    xSemaphoreGive(mutex);
+    return true;
+  }
+
+  // Añade una lectura al final del anillo y devuelve su número de secuencia
+  uint32_t append(const DataReading &lectura)
+  {
+    if (!abierto())
+      return siguienteSeq++;
+    xSemaphoreTake(mutex, portMAX_DELAY);
+
+    if (registrosActivo >= FLASH_LOG_REGISTROS_POR_SECTOR)
+      abrirSector((sectorActivo + 1) % numSectores);
+
+    RegistroFlash registro;
+    registro.seq = siguienteSeq;
+    registro.lectura = lectura;
+    registro.crc = crc(registro);
+
+    size_t offset = offsetRegistro(sectorActivo, registrosActivo);
+    esp_partition_write(particion, offset, &registro, sizeof(registro));
+
+    if (registrosActivo == 0)
+    {
+      primerSeq[sectorActivo] = registro.seq;
+      primerTimestamp[sectorActivo] = lectura.timestamp;
+    }
+    registrosActivo++;
+    uint32_t seq = siguienteSeq++;
+
+    xSemaphoreGive(mutex);
+    return seq;
+  }
+
+  // Copia hasta max lecturas consecutivas empezando en la primera secuencia disponible >= desdeSeq.
+  // Devuelve el número de lecturas copiadas y en primerSeqLeida la secuencia de la primera.
+  size_t read(uint32_t desdeSeq, DataReading *lecturas, size_t max, uint32_t &primerSeqLeida)
+  {
+    size_t leidas = 0;
+    if (!abierto())
+      return 0;
+    xSemaphoreTake(mutex, portMAX_DELAY);
+
+    if (desdeSeq < oldestSeqLocked())
+      desdeSeq = oldestSeqLocked();
+
+    while (leidas < max && desdeSeq < siguienteSeq)
+    {
+      int sector = sectorDeSeq(desdeSeq);
+      if (sector < 0)
+        break;
+
+      RegistroFlash registro;
+      esp_partition_read(particion, offsetRegistro(sector, desdeSeq - primerSeq[sector]), &registro, sizeof(registro));
+      if (registro.seq != desdeSeq || registro.crc != crc(registro))
+        break; // Registro dañado (por ejemplo, un corte de alimentación durante la escritura)
+
+      if (leidas == 0)
+        primerSeqLeida = desdeSeq;
+      lecturas[leidas++] = registro.lectura;
+      desdeSeq++;
+    }
+
+    xSemaphoreGive(mutex);
+    return leidas;
+  }
+
+  // Primera secuencia cuya lectura tiene un timestamp >= timestamp, o nextSeq() si no hay ninguna
+  uint32_t seqForTimestamp(uint32_t timestamp)
+  {
+    if (!abierto())
+      return siguienteSeq;
+    xSemaphoreTake(mutex, portMAX_DELAY);
+
+    // Búsqueda del sector en orden de antigüedad: el último sector que empieza antes del timestamp
+    int sector = -1;
+    for (int i = 0; i < numSectores; i++)
+    {
+      int s = (sectorActivo + 1 + i) % numSectores;
+      if (primerSeq[s] == FLASH_LOG_SEQ_VACIA)
+        continue;
+      if (primerTimestamp[s] > timestamp)
+        break;
+      sector = s;
+    }
+
+    uint32_t seq = sector < 0 ? oldestSeqLocked() : primerSeq[sector];
+    for (; seq < siguienteSeq; seq++)
+    {
+      int s = sectorDeSeq(seq);
+      if (s < 0)
+        break;
+      RegistroFlash registro;
+      esp_partition_read(particion, offsetRegistro(s, seq - primerSeq[s]), &registro, sizeof(registro));
+      if (registro.lectura.timestamp >= timestamp)
+        break;
+    }
+
+    xSemaphoreGive(mutex);
+    return seq;
+  }
+
+  uint32_t nextSeq() { return siguienteSeq; }
+  uint32_t oldestSeq()
+  {
+    if (!abierto())
+      return siguienteSeq;
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    uint32_t seq = oldestSeqLocked();
+    xSemaphoreGive(mutex);
+    return seq;
+  }
+  uint32_t erases() { return generacion; }
+  bool abierto() const { return particion != NULL; }
+
+private:
+  // Reconstruye el índice en RAM leyendo la cabecera y el primer registro de cada sector
+  void recuperar()
+  {
+    int sectorMasNuevo = -1;
+    generacion = 0;
+
+    for (int s = 0; s < numSectores; s++)
+    {
+      CabeceraSector cabecera;
+      esp_partition_read(particion, (size_t)s * FLASH_LOG_SECTOR_SIZE, &cabecera, sizeof(cabecera));
+      primerSeq[s] = FLASH_LOG_SEQ_VACIA;
+      primerTimestamp[s] = 0;
+      if (cabecera.magic != FLASH_LOG_MAGIC)
+        continue;
+
+      RegistroFlash registro;
+      esp_partition_read(particion, offsetRegistro(s, 0), &registro, sizeof(registro));
+      if (registro.seq != FLASH_LOG_SEQ_VACIA && registro.crc == crc(registro))
+      {
+        primerSeq[s] = registro.seq;
+        primerTimestamp[s] = registro.lectura.timestamp;
+      }
+      if (sectorMasNuevo < 0 || cabecera.generacion > generacion)
+      {
+        sectorMasNuevo = s;
+        generacion = cabecera.generacion;
+      }
+    }
+
+    if (sectorMasNuevo < 0) // Partición sin formatear: se empieza por el sector 0
+    {
+      siguienteSeq = 0;
+      abrirSector(0);
+      return;
+    }
+
+    // Se continúa detrás del último registro válido del sector activo
+    sectorActivo = sectorMasNuevo;
+    registrosActivo = contarRegistros(sectorActivo);
+    if (registrosActivo > 0)
+    {
+      siguienteSeq = primerSeq[sectorActivo] + registrosActivo;
+    }
+    else // Sector recién abierto: la secuencia sigue a la del sector anterior
+    {
+      int anterior = (sectorActivo + numSectores - 1) % numSectores;
+      siguienteSeq = primerSeq[anterior] == FLASH_LOG_SEQ_VACIA ? 0 : primerSeq[anterior] + contarRegistros(anterior);
+    }
+
+    if (registrosActivo < FLASH_LOG_REGISTROS_POR_SECTOR)
+    {
+      // Un registro a medio escribir deja basura detrás del último válido; se abre un sector nuevo para no reutilizarla
+      RegistroFlash registro;
+      esp_partition_read(particion, offsetRegistro(sectorActivo, registrosActivo), &registro, sizeof(registro));
+      if (registro.seq != FLASH_LOG_SEQ_VACIA)
+        abrirSector((sectorActivo + 1) % numSectores);
+    }
+  }
+
+  size_t contarRegistros(int sector)
+  {
+    size_t registros = 0;
+    for (; registros < FLASH_LOG_REGISTROS_POR_SECTOR; registros++)
+    {
+      RegistroFlash registro;
+      esp_partition_read(particion, offsetRegistro(sector, registros), &registro, sizeof(registro));
+      if (registro.seq != primerSeq[sector] + registros || registro.crc != crc(registro))
+        break;
+    }
+    return registros;
+  }
+
+  void abrirSector(int sector)
+  {
+    esp_partition_erase_range(particion, (size_t)sector * FLASH_LOG_SECTOR_SIZE, FLASH_LOG_SECTOR_SIZE);
+
+    CabeceraSector cabecera = {FLASH_LOG_MAGIC, ++generacion, {0, 0}};
+    esp_partition_write(particion, (size_t)sector * FLASH_LOG_SECTOR_SIZE, &cabecera, sizeof(cabecera));
+
+    sectorActivo = sector;
+    registrosActivo = 0;
+    primerSeq[sector] = FLASH_LOG_SEQ_VACIA;
+    primerTimestamp[sector] = 0;
+  }
+
+  uint32_t oldestSeqLocked()
+  {
+    for (int i = 1; i <= numSectores; i++)
+    {
+      int s = (sectorActivo + i) % numSectores;
+      if (primerSeq[s] != FLASH_LOG_SEQ_VACIA)
+        return primerSeq[s];
+    }
+    return siguienteSeq;
+  }
+
+  int sectorDeSeq(uint32_t seq)
+  {
+    for (int s = 0; s < numSectores; s++)
+    {
+      if (primerSeq[s] == FLASH_LOG_SEQ_VACIA || seq < primerSeq[s])
+        continue;
+      size_t registros = s == sectorActivo ? registrosActivo : FLASH_LOG_REGISTROS_POR_SECTOR;
+      if (seq - primerSeq[s] < registros)
+        return s;
+    }
+    return -1;
+  }
+
+  size_t offsetRegistro(int sector, size_t indice)
+  {
+    return (size_t)sector * FLASH_LOG_SECTOR_SIZE + sizeof(CabeceraSector) + indice * sizeof(RegistroFlash);
+  }
+
+  static uint32_t crc(const RegistroFlash &registro) // FNV-1a sobre la secuencia y la lectura
+  {
+    const uint8_t *bytes = (const uint8_t *)&registro;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < offsetof(RegistroFlash, crc); i++)
+    {
+      h ^= bytes[i];
+      h *= 16777619u;
+    }
+    return h;
+  }
+
+  const esp_partition_t *particion = NULL;
+  SemaphoreHandle_t mutex = NULL;
+  int numSectores = 0;
+  int sectorActivo = 0;                                // Sector en el que se está escribiendo
+  size_t registrosActivo = 0;                          // Registros escritos en el sector activo
+  uint32_t siguienteSeq = 0;                           // Secuencia que recibirá la próxima lectura
+  uint32_t generacion = 0;                             // Generación del último sector abierto (total de borrados)
+  uint32_t primerSeq[FLASH_LOG_MAX_SECTORES];          // Primera secuencia de cada sector (FLASH_LOG_SEQ_VACIA si no tiene)
+  uint32_t primerTimestamp[FLASH_LOG_MAX_SECTORES];    // Timestamp de la primera lectura de cada sector
+};
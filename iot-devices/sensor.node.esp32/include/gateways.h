@@ -0,0 +1,234 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// Elección de gateway entre los que se anuncian con balizas (MSG_GATEWAY_BEACON). No incluye data.h ni depende del
+// hardware para poder usarse también en la simulación del host (gateway.node.esp32/src/sim). Es un agregado sin
+// constructores, como el estado de deep_sleep.h, para que pueda vivir en memoria RTC; un objeto a ceros es una tabla
+// vacía. Los tiempos son milisegundos de un reloj que no se reinicia entre usos de la tabla (millis() o el contador RTC).
+
+#define MAX_GATEWAYS 4               // Gateways que se recuerdan; con la tabla llena se sustituye el de baliza más antigua
+#define BALIZA_INTERVALO_MS 2000     // Periodo de las balizas de los gateways
+#define BALIZA_CADUCIDAD_MS 7000     // Sin balizas en este tiempo el gateway deja de preferirse (tres balizas perdidas)
+#define BUSQUEDA_GATEWAYS_MS 3600000 // Modo deep sleep: sin ninguna baliza en este tiempo se escucha una ronda completa
+#define FALLOS_CAMBIO_GATEWAY 3      // Envíos seguidos sin confirmar tras los que se abandona el gateway elegido
+#define VETO_GATEWAY_MS 60000        // Tiempo que un gateway abandonado por fallos queda fuera de la elección
+#define MARGEN_CAMBIO_GATEWAY 15     // Mejora mínima de coste para dejar un gateway que funciona (evita oscilaciones)
+#define PERMANENCIA_CARGA_MS 20000   // Tiempo mínimo en un gateway antes de dejarlo por carga, más un tanto igual por nodo
+#define RSSI_BUENO -60               // Por encima de este RSSI la calidad del enlace no penaliza
+#define RSSI_DESCONOCIDO -75         // RSSI que se supone si no se ha podido medir el de la baliza
+#define REPARTO_GATEWAYS 8           // Rango del desempate por nodo, para repartir los nodos entre gateways iguales
+
+typedef enum // Motivo del último cambio de gateway
+{
+  CAMBIO_NINGUNO = 0,
+  CAMBIO_INICIAL,    // Primera baliza recibida
+  CAMBIO_FALLOS,     // FALLOS_CAMBIO_GATEWAY envíos seguidos sin confirmar
+  CAMBIO_CADUCIDAD,  // El gateway elegido dejó de enviar balizas
+  CAMBIO_CARGA,      // Otro gateway anuncia una cola más vacía o tiene mejor enlace
+} MotivoCambio;
+
+typedef struct // Gateway conocido por sus balizas
+{
+  uint8_t mac[6];
+  uint8_t ocupacion;       // Porcentaje de la cola anunciado en la última baliza
+  bool conBroker;
+  int8_t rssi;             // RSSI de la última baliza
+  uint8_t fallosSeguidos;  // Envíos seguidos sin confirmar
+  uint32_t ultimaBalizaMs;
+  uint32_t vetadoHastaMs;  // Instante hasta el que no se elige (0 = no vetado)
+} EntradaGateway;
+
+typedef struct
+{
+  EntradaGateway gateways[MAX_GATEWAYS];
+  uint8_t num;
+  uint8_t elegido;         // Índice + 1 del gateway elegido; 0 = ninguno, se usa el gateway por defecto
+  uint32_t semilla;        // Derivada de la MAC del nodo
+  uint32_t ultimoCambioMs;
+  MotivoCambio ultimoMotivo;
+  uint32_t cambiosFallos, cambiosCaducidad, cambiosCarga;
+
+  void iniciar(const uint8_t *macNodo)
+  {
+    semilla = 2166136261u;
+    for (int i = 0; i < 6; i++)
+      semilla = (semilla ^ macNodo[i]) * 16777619u;
+  }
+
+  void registrarBaliza(const uint8_t *mac, uint16_t profundidad, uint16_t capacidad, bool conBroker, int8_t rssi, uint32_t ahoraMs)
+  {
+    EntradaGateway *gateway = buscar(mac);
+    if (gateway == NULL)
+    {
+      int indice = num;
+      if (num == MAX_GATEWAYS) // Se sustituye el de baliza más antigua que no sea el elegido
+      {
+        indice = -1;
+        for (int i = 0; i < num; i++)
+        {
+          if (i + 1 != elegido && (indice < 0 || ahoraMs - gateways[i].ultimaBalizaMs > ahoraMs - gateways[indice].ultimaBalizaMs))
+            indice = i;
+        }
+      }
+      else
+      {
+        num++;
+      }
+      gateway = &gateways[indice];
+      memset(gateway, 0, sizeof(*gateway));
+      memcpy(gateway->mac, mac, sizeof(gateway->mac));
+    }
+
+    uint32_t ocupacion = capacidad > 0 ? (uint32_t)profundidad * 100 / capacidad : 100;
+    gateway->ocupacion = ocupacion > 100 ? 100 : ocupacion;
+    gateway->conBroker = conBroker;
+    gateway->rssi = rssi;
+    gateway->ultimaBalizaMs = ahoraMs;
+    revisar(ahoraMs);
+  }
+
+  // Resultado de un envío (callback de ESP-NOW). Devuelve true si ha provocado un cambio de gateway.
+  bool registrarEnvio(const uint8_t *mac, bool confirmado, uint32_t ahoraMs)
+  {
+    EntradaGateway *gateway = buscar(mac);
+    if (gateway == NULL)
+      return false;
+    if (confirmado)
+    {
+      gateway->fallosSeguidos = 0;
+      return false;
+    }
+    if (gateway->fallosSeguidos < UINT8_MAX)
+      gateway->fallosSeguidos++;
+    if (gateway != actual() || gateway->fallosSeguidos < FALLOS_CAMBIO_GATEWAY)
+      return false;
+
+    gateway->fallosSeguidos = 0;
+    gateway->vetadoHastaMs = (ahoraMs + VETO_GATEWAY_MS) | 1; // Nunca 0, que significa no vetado
+    uint8_t anterior = elegido;
+    revisar(ahoraMs);
+    return elegido != anterior;
+  }
+
+  // Vuelve a elegir gateway: se prefieren los que tienen balizas recientes y, entre ellos, el de menor coste. El elegido
+  // solo se deja si falla, caduca o hay otro mejor por más de MARGEN_CAMBIO_GATEWAY. Los cambios por carga esperan una
+  // permanencia mínima distinta en cada nodo, para que no se muevan todos a la vez tras la misma baliza, y nunca se
+  // hacen con un envío sin confirmar: podría haber llegado, y su reintento al otro gateway sería un duplicado.
+  void revisar(uint32_t ahoraMs)
+  {
+    for (int i = 0; i < num; i++)
+    {
+      if (gateways[i].vetadoHastaMs != 0 && (int32_t)(ahoraMs - gateways[i].vetadoHastaMs) >= 0)
+        gateways[i].vetadoHastaMs = 0;
+    }
+
+    int mejor = buscarMejor(ahoraMs);
+    if (mejor < 0 && num > 0) // Todos han fallado: se levantan los vetos y se vuelve a probar
+    {
+      for (int i = 0; i < num; i++)
+        gateways[i].vetadoHastaMs = 0;
+      mejor = buscarMejor(ahoraMs);
+    }
+    if (mejor < 0 || mejor + 1 == elegido)
+      return;
+
+    MotivoCambio motivo = CAMBIO_INICIAL;
+    const EntradaGateway *anterior = actual();
+    bool descubriendo = ultimoMotivo == CAMBIO_INICIAL && ahoraMs - ultimoCambioMs < BALIZA_CADUCIDAD_MS; // Aún llegan las primeras balizas
+    if (anterior != NULL)
+    {
+      if (anterior->vetadoHastaMs != 0)
+        motivo = CAMBIO_FALLOS;
+      else if (!reciente(*anterior, ahoraMs) && reciente(gateways[mejor], ahoraMs))
+        motivo = CAMBIO_CADUCIDAD;
+      else if (reciente(*anterior, ahoraMs) == reciente(gateways[mejor], ahoraMs) && anterior->fallosSeguidos == 0 &&
+               (descubriendo || ahoraMs - ultimoCambioMs >= PERMANENCIA_CARGA_MS + semilla % PERMANENCIA_CARGA_MS) &&
+               coste(gateways[mejor]) + (descubriendo ? 0 : MARGEN_CAMBIO_GATEWAY) < coste(*anterior))
+        motivo = descubriendo ? CAMBIO_INICIAL : CAMBIO_CARGA;
+      else
+        return; // El elegido sigue siendo válido
+    }
+
+    elegido = mejor + 1;
+    ultimoCambioMs = ahoraMs;
+    ultimoMotivo = motivo;
+    if (motivo == CAMBIO_FALLOS)
+      cambiosFallos++;
+    else if (motivo == CAMBIO_CADUCIDAD)
+      cambiosCaducidad++;
+    else if (motivo == CAMBIO_CARGA)
+      cambiosCarga++;
+  }
+
+  // MAC del gateway al que enviar: el elegido o, si aún no se ha recibido ninguna baliza, el gateway por defecto
+  const uint8_t *destino(const uint8_t *porDefecto) const
+  {
+    const EntradaGateway *gateway = actual();
+    return gateway != NULL ? gateway->mac : porDefecto;
+  }
+
+  const EntradaGateway *actual() const { return elegido > 0 && elegido <= num ? &gateways[elegido - 1] : NULL; }
+
+  bool necesitaBusqueda(uint32_t ahoraMs) const
+  {
+    for (int i = 0; i < num; i++)
+    {
+      if (ahoraMs - gateways[i].ultimaBalizaMs < BUSQUEDA_GATEWAYS_MS)
+        return false;
+    }
+    return true;
+  }
+
+  // Coste de enviar a un gateway (menor es mejor): ocupación de su cola, sin broker, enlace débil y un desempate fijo
+  // por pareja nodo-gateway para que, con cargas parecidas, los nodos no se amontonen todos en el mismo gateway
+  int coste(const EntradaGateway &gateway) const
+  {
+    int total = gateway.ocupacion;
+    if (!gateway.conBroker)
+      total += 100;
+    if (gateway.rssi < RSSI_BUENO)
+      total += 2 * (RSSI_BUENO - gateway.rssi);
+    uint32_t h = semilla;
+    for (int i = 0; i < 6; i++)
+      h = (h ^ gateway.mac[i]) * 16777619u;
+    h ^= h >> 16; // Mezcla final: las MAC de los gateways suelen diferir solo en el último byte
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return total + (int)(h % REPARTO_GATEWAYS);
+  }
+
+  static bool reciente(const EntradaGateway &gateway, uint32_t ahoraMs) { return ahoraMs - gateway.ultimaBalizaMs < BALIZA_CADUCIDAD_MS; }
+
+private:
+  EntradaGateway *buscar(const uint8_t *mac)
+  {
+    for (int i = 0; i < num; i++)
+    {
+      if (memcmp(gateways[i].mac, mac, sizeof(gateways[i].mac)) == 0)
+        return &gateways[i];
+    }
+    return NULL;
+  }
+
+  int buscarMejor(uint32_t ahoraMs) const
+  {
+    int mejor = -1;
+    for (int i = 0; i < num; i++)
+    {
+      if (gateways[i].vetadoHastaMs != 0)
+        continue;
+      if (mejor < 0 || reciente(gateways[i], ahoraMs) > reciente(gateways[mejor], ahoraMs) ||
+          (reciente(gateways[i], ahoraMs) == reciente(gateways[mejor], ahoraMs) && coste(gateways[i]) < coste(gateways[mejor])))
+        mejor = i;
+    }
+    return mejor;
+  }
+} TablaGateways;
+
+inline const char *nombreCambio(MotivoCambio motivo)
+{
+  static const char *nombres[] = {"ninguno", "inicial", "fallos", "caducidad", "carga"};
+  return nombres[motivo];
+}
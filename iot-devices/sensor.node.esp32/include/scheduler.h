@@ -0,0 +1,200 @@
+#pragma once
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#include <esp_timer.h>
+#endif
+
+#define PLANIFICADOR_MAX_TRABAJOS 8 // Trabajos que caben en la tabla del planificador
+
+typedef void (*FuncionTrabajo)();
+
+typedef struct // Entrada de la tabla de trabajos, con sus estadísticas de ejecución
+{
+  const char *nombre;
+  FuncionTrabajo funcion;
+  uint32_t periodoMs;       // 0 = solo se ejecuta cuando llega uno de sus eventos
+  uint32_t toleranciaMs;    // Adelanto permitido respecto al plazo para aprovechar el despertar de otro trabajo
+  uint32_t eventos;         // Bits de notificación que lo ejecutan inmediatamente
+  bool activo;              // Si está inactivo no se planifica por periodo, solo por eventos
+  int64_t plazoUs;          // Instante (esp_timer) de la siguiente ejecución periódica
+  uint32_t ejecuciones;
+  uint32_t perdidos;        // Periodos saltados porque el planificador iba más de un periodo tarde
+  uint64_t totalUs;         // Tiempo de ejecución acumulado
+  uint32_t maxUs;           // Ejecución más larga
+  int32_t desviacionMaxUs;  // Mayor diferencia (en valor absoluto) entre el inicio real y el plazo
+} Trabajo;
+
+// Planificador por plazos que ejecuta todos los trabajos del nodo desde una única tarea. La tarea duerme hasta el plazo
+// más próximo y, al despertar, ejecuta también los trabajos cuyo plazo cae dentro de su tolerancia, de modo que los
+// trabajos con periodos compatibles comparten despertar. Los plazos avanzan un periodo exacto cada vez, por lo que el
+// retraso de una ejecución no se acumula. Los eventos (interrupciones, mensajes recibidos) llegan como bits de
+// notificación de la tarea y despiertan al planificador sin esperar al siguiente plazo.
+class Planificador
+{
+public:
+  // Devuelve el identificador del trabajo o -1 si la tabla está llena. Solo antes de arrancar() o desde un trabajo.
+  int agregar(const char *nombre, FuncionTrabajo funcion, uint32_t periodoMs, uint32_t toleranciaMs, uint32_t eventos = 0, bool activo = true)
+  {
+    if (numTrabajos >= PLANIFICADOR_MAX_TRABAJOS)
+      return -1;
+    Trabajo &trabajo = trabajos[numTrabajos];
+    memset(&trabajo, 0, sizeof(trabajo));
+    trabajo.nombre = nombre;
+    trabajo.funcion = funcion;
+    trabajo.periodoMs = periodoMs;
+    trabajo.toleranciaMs = toleranciaMs;
+    trabajo.eventos = eventos;
+    trabajo.activo = activo && periodoMs > 0;
+    trabajo.plazoUs = esp_timer_get_time();
+    return numTrabajos++;
+  }
+
+  // Activar y desactivar solo desde los propios trabajos (se ejecutan en la tarea del planificador)
+  void activar(int id, uint32_t retrasoMs = 0)
+  {
+    if (id < 0 || id >= numTrabajos || trabajos[id].periodoMs == 0)
+      return;
+    trabajos[id].activo = true;
+    trabajos[id].plazoUs = esp_timer_get_time() + (int64_t)retrasoMs * 1000;
+  }
+
+  void desactivar(int id)
+  {
+    if (id >= 0 && id < numTrabajos)
+      trabajos[id].activo = false;
+  }
+
+  // Despierta al planificador para ejecutar los trabajos asociados a los eventos. Seguro desde cualquier tarea.
+  void notificar(uint32_t eventos)
+  {
+    if (tarea != NULL)
+      xTaskNotify(tarea, eventos, eSetBits);
+  }
+
+  void IRAM_ATTR notificarDesdeISR(uint32_t eventos)
+  {
+    BaseType_t cambiarTarea = pdFALSE;
+    if (tarea != NULL)
+      xTaskNotifyFromISR(tarea, eventos, eSetBits, &cambiarTarea);
+    if (cambiarTarea)
+      portYIELD_FROM_ISR();
+  }
+
+  bool arrancar(const char *nombre, uint32_t pila, UBaseType_t prioridad)
+  {
+    tamanoPila = pila;
+    inicioUs = esp_timer_get_time();
+    return xTaskCreate(tareaPlanificador, nombre, pila, this, prioridad, &tarea) == pdPASS;
+  }
+
+  // Estadísticas por trabajo, despertares y memoria, por el puerto serie
+  void informe()
+  {
+    uint64_t segundos = (esp_timer_get_time() - inicioUs) / 1000000;
+    Serial.printf("Planificador: %u despertares en %llu s (%.1f/h), pila libre %u de %u bytes, heap libre %u (minimo %u)\n",
+                  (unsigned)numDespertares, (unsigned long long)segundos, segundos > 0 ? numDespertares * 3600.0 / segundos : 0.0,
+                  (unsigned)uxTaskGetStackHighWaterMark(tarea), (unsigned)tamanoPila,
+                  (unsigned)ESP.getFreeHeap(), (unsigned)ESP.getMinFreeHeap());
+    for (int i = 0; i < numTrabajos; i++)
+    {
+      const Trabajo &t = trabajos[i];
+      Serial.printf("  %-12s %6u ejecuciones, %u perdidas, media %u us, max %u us, desviacion max %d us\n",
+                    t.nombre, (unsigned)t.ejecuciones, (unsigned)t.perdidos,
+                    t.ejecuciones > 0 ? (unsigned)(t.totalUs / t.ejecuciones) : 0u, (unsigned)t.maxUs, (int)t.desviacionMaxUs);
+    }
+  }
+
+  uint32_t despertares() const { return numDespertares; }
+
+private:
+  static void tareaPlanificador(void *parametro)
+  {
+    ((Planificador *)parametro)->bucle();
+  }
+
+  void bucle()
+  {
+    for (;;)
+    {
+      uint32_t eventos = 0;
+      xTaskNotifyWait(0, UINT32_MAX, &eventos, ticksHastaPlazo());
+      numDespertares++;
+
+      // Primero los eventos, que son los que tienen prisa
+      for (int i = 0; i < numTrabajos && eventos != 0; i++)
+      {
+        Trabajo &trabajo = trabajos[i];
+        if ((trabajo.eventos & eventos) == 0)
+          continue;
+        int64_t ahora = esp_timer_get_time();
+        if (trabajo.periodoMs > 0) // Un evento arranca también la parte periódica del trabajo
+        {
+          trabajo.activo = true;
+          trabajo.plazoUs = ahora + (int64_t)trabajo.periodoMs * 1000;
+        }
+        medir(trabajo, ahora);
+      }
+
+      for (int i = 0; i < numTrabajos; i++)
+      {
+        Trabajo &trabajo = trabajos[i];
+        int64_t ahora = esp_timer_get_time();
+        if (!trabajo.activo || ahora < trabajo.plazoUs - (int64_t)trabajo.toleranciaMs * 1000)
+          continue;
+
+        int64_t plazo = trabajo.plazoUs;
+        int64_t periodoUs = (int64_t)trabajo.periodoMs * 1000;
+        trabajo.plazoUs += periodoUs;
+        if (trabajo.plazoUs <= ahora) // Se ha quedado atrás más de un periodo: se salta al siguiente plazo futuro
+        {
+          int64_t saltados = (ahora - trabajo.plazoUs) / periodoUs + 1;
+          trabajo.perdidos += saltados;
+          trabajo.plazoUs += saltados * periodoUs;
+        }
+        medir(trabajo, plazo);
+      }
+    }
+  }
+
+  void medir(Trabajo &trabajo, int64_t plazo)
+  {
+    int64_t inicio = esp_timer_get_time();
+    trabajo.funcion();
+    uint32_t duracion = (uint32_t)(esp_timer_get_time() - inicio);
+
+    int32_t desviacion = (int32_t)(inicio - plazo);
+    if (abs(desviacion) > abs(trabajo.desviacionMaxUs))
+      trabajo.desviacionMaxUs = desviacion;
+    trabajo.ejecuciones++;
+    trabajo.totalUs += duracion;
+    if (duracion > trabajo.maxUs)
+      trabajo.maxUs = duracion;
+  }
+
+  // Espera hasta el plazo más próximo de los trabajos activos, redondeando hacia arriba para no despertar antes de tiempo
+  TickType_t ticksHastaPlazo()
+  {
+    int64_t proximo = INT64_MAX;
+    for (int i = 0; i < numTrabajos; i++)
+    {
+      if (trabajos[i].activo && trabajos[i].plazoUs < proximo)
+        proximo = trabajos[i].plazoUs;
+    }
+    if (proximo == INT64_MAX)
+      return portMAX_DELAY;
+
+    int64_t espera = proximo - esp_timer_get_time();
+    if (espera <= 0)
+      return 0;
+    int64_t usPorTick = (int64_t)portTICK_PERIOD_MS * 1000;
+    return (TickType_t)((espera + usPorTick - 1) / usPorTick);
+  }
+
+  Trabajo trabajos[PLANIFICADOR_MAX_TRABAJOS];
+  int numTrabajos = 0;
+  TaskHandle_t tarea = NULL;
+  uint32_t tamanoPila = 0;
+  uint32_t numDespertares = 0;
+  int64_t inicioUs = 0;
+};
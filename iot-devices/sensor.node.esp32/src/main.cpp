@@ -2,48 +2,131 @@
 #include <Arduino.h>
 #include <WiFi.h>
 #include <esp_now.h>
+#include <esp_wifi.h>
 #include <time.h>
 #include "data.h"
+#include "flash_log.h"
+#include "gateways.h"
+#include "scheduler.h"
+
+#ifdef MODO_DEEP_SLEEP
+#include <esp_sleep.h>
+#include <esp32/rtc.h>
+#include "deep_sleep.h"
+#define ESTADO_CICLO RTC_DATA_ATTR // En el modo deep sleep estas variables tienen que sobrevivir entre despertares
+#else
+#define ESTADO_CICLO
+#endif
+
+#ifdef DEPURACION_CICLOS
+#define INFORME_CICLOS true // Log de cada despertar por el puerto serie; a 9600 baudios alarga mucho cada ciclo
+#else
+#define INFORME_CICLOS false
+#endif
 
 #define DHTPIN 4      // Pin al que está conectado el sensor DHT11
 #define DHTTYPE DHT11 // Tipo de sensor DHT que estás utilizando
 #define PIR_PIN 13    // Pin al que está conectado el sensor PIR
 #define POT_PIN 14    // Pin analógico al que está conectado el potenciómetro
 
-DHT dht(DHTPIN, DHTTYPE);
+#define BACKFILL_INTERVAL_MS 200 // Tiempo entre dos batches de backfill, para no saturar el canal ni al gateway
+#define BACKFILL_MAX_PETICIONES 4 // Peticiones de backfill pendientes como máximo
+
+#define PERIODO_MUESTREO_MS 20000  // Lectura de los sensores y comprobación del delta
+#define PERIODO_ESTADO_MS 60000    // Envío del estado del nodo
+#define PERIODO_RTC_MS 60000       // Petición de hora al gateway
+#define PERIODO_INFORME_MS 300000  // Estadísticas del planificador por el puerto serie
+#define PILA_PLANIFICADOR 4096     // Pila de la única tarea del nodo (el mayor consumidor es el batch de backfill)
+
+#define EVENTO_PRESENCIA (1 << 0) // Bits de notificación del planificador
+#define EVENTO_BACKFILL (1 << 1)
 
-volatile int movimiento_bool = LOW; // Variable global de deteccion de movimiento
+#define ESPERA_CONFIRMACION_MS 50    // Modo deep sleep: espera al callback de envío de cada mensaje
+#define ESPERA_HORA_MS 200           // Modo deep sleep: espera a la respuesta de hora del gateway
+#define ESCUCHA_BACKFILL_MS 30       // Modo deep sleep: escucha tras enviar batches, por si el gateway pide un backfill
+#define BACKFILL_BATCHES_POR_CICLO 5 // Modo deep sleep: batches de backfill por ciclo; el resto queda para el siguiente
+#define BACKFILL_INTERVAL_CICLO_MS 20 // Modo deep sleep: separación entre batches de backfill con la radio encendida
+#define PIR_REARME_MS 5000           // Modo deep sleep: con la salida del PIR en alto se vuelve a mirar pasado este tiempo
+#define ESCUCHA_BALIZAS_MS 2200      // Modo deep sleep: escucha algo más que BALIZA_INTERVALO_MS para oír a todos los gateways
+#define MAX_FALLOS_BATCH_CICLO 6     // Modo deep sleep: batches sin confirmar por ciclo (FALLOS_CAMBIO_GATEWAY en dos gateways)
+
+DHT dht(DHTPIN, DHTTYPE);
 
 float temperatura, humedad;      // Variable para almacenar las lecturas de humedad y temperatura
 int porcentaje;                  // Variable para almacenar el porcentaje del valor del potenciómetro
-float lastTemperatura = -1000.0; // Variable para almacenar la temperatura anterior
-float lastHumedad = -1000.0;     // Variable para almacenar la humedad anterior
-int lastPorcentaje = -1000;      // Variable para alamcenar el porcentaje anterior
+ESTADO_CICLO float lastTemperatura = -1000.0; // Variable para almacenar la temperatura anterior
+ESTADO_CICLO float lastHumedad = -1000.0;     // Variable para almacenar la humedad anterior
+ESTADO_CICLO int lastPorcentaje = -1000;      // Variable para alamcenar el porcentaje anterior
 
 const float deltaTemperatura = 0.5; // Umbral delta para la temperatura
 const float deltaHumedad = 2.0;     // Umbral delta para la humedad
 const int deltaPorcentaje = 5;      // Umbral delta para el porcentaje
+const int factorCambioBrusco = 4;   // Un cambio de este múltiplo del delta se considera brusco
 
-DataReading dataBuffer[10]; // Buffer para almacenar las lecturas en batch
-int dataIndex = 0;          // Indice del buffer
+DataReading dataBuffer[LECTURAS_POR_BATCH]; // Buffer para almacenar las lecturas en batch
+int dataIndex = 0;                          // Indice del buffer
+uint32_t primerSeqBuffer = 0;               // Número de secuencia de dataBuffer[0]
+
+FlashLog flashLog; // Anillo de lecturas en flash, del que se sirven los backfills
+
+// Petición de backfill recibida, junto con el nodo que la ha pedido. No incluye BackfillRequest, que tiene constructor
+// por el inicializador de msg_type: sin constructores puede vivir en memoria RTC, como el estado de deep_sleep.h
+typedef struct
+{
+  uint8_t mac[6];
+  BackfillMode modo;
+  uint32_t desde;
+  uint32_t hasta;
+} PeticionBackfill;
+
+QueueHandle_t backfillQueue;                        // Cola de peticiones de backfill: OnDataRecv -> backfill_streamer
+ESTADO_CICLO PeticionBackfill backfillActual;       // Petición que se está sirviendo
+ESTADO_CICLO uint32_t backfillDesde, backfillHasta; // Rango de secuencias que queda por enviar de backfillActual
+ESTADO_CICLO bool backfillEnCurso = false;
+volatile bool horaRecibida = false;                 // OnDataRecv ha aplicado una respuesta de hora
+esp_now_peer_info_t peerInfo; // Información del gateway como peer de ESPNOW
+
+// Gateways anunciados por sus balizas; gatewayAddress solo se usa hasta recibir la primera. Las balizas y los
+// resultados de los envíos llegan en la tarea de WiFi y la elección se consulta desde la del planificador.
+ESTADO_CICLO TablaGateways tablaGateways;
+portMUX_TYPE muxGateways = portMUX_INITIALIZER_UNLOCKED;
+uint8_t gatewayElegido[6];             // Copia del destino actual, solo para la tarea que envía
+uint8_t macUltimaTrama[6];             // Origen y RSSI de la última trama de gestión recibida (las de ESP-NOW lo son),
+volatile int8_t rssiUltimaTrama = 0;   // capturados en modo promiscuo para conocer el RSSI de cada baliza
 
 // RCN esta variable no se conserva entre reinicios, solo cuando el microcontrolador entra en modo reposo profundo
 RTC_DATA_ATTR int rebootCount = 0; // Contador de reinicio
 unsigned long lastWakeTime;        // Contador del tiempo activo
 
-SemaphoreHandle_t rtcSemaphore; // Semaforo para la sincronizacion del RTC
+Planificador planificador; // Ejecuta todos los trabajos del nodo desde una única tarea
+int idBackfill = -1;       // Trabajo de backfill, que solo está activo mientras hay peticiones
+
+#ifdef MODO_DEEP_SLEEP
+RTC_DATA_ATTR AnilloRtc anilloRtc;       // Lecturas pendientes de enviar
+RTC_DATA_ATTR EstadoCiclos estadoCiclos; // Política de envío, hora al dormir y métricas de los ciclos
+volatile uint32_t enviosConfirmados = 0; // Callbacks de envío recibidos (solo los escribe OnDataSent)
+volatile uint32_t enviosFallidos = 0;
+
+void ejecutarCiclo(); // Un ciclo completo del modo deep sleep; acaba durmiendo y no vuelve
+#endif
 
-void movimiento_detectado();                                                 // Metodo para cambiar la variable movimiento_bool a HIGH
-void verificarYenviarDatos(void *parameter);                                 // Metodo para enviar los datos al gateway.node.esp32 aplicando el algoritmo send on delta
+void movimiento_detectado();                                                 // ISR del PIR: despierta al planificador con EVENTO_PRESENCIA
+void verificarYenviarDatos();                                                // Trabajo que envía los datos al gateway.node.esp32 aplicando el algoritmo send on delta
+bool registrarSiHayCambio(DataReading &reading, uint32_t &seq, bool &brusco); // Metodo que aplica el send on delta y guarda en flash la lectura que hay que enviar
 void enviarDatosBatch();                                                     // Metodo para enviar datos al gateway mediante el protocolo ESPNOW en batería o en batch
 time_t obtenerTiempoUTC();                                                   // Metodo para obtener el tiempo en formato UTC
-void configTimeAndSync();                                                    // Metodo que pide la hora al nodo gateway usando ESPNOW
-void temperature_humidity_updater(void *parameter);                          // Tarea FreeRRTOS encargada de realizar las lecturas de temperatura y humedad y enviarlas al gateway.node.esp32 mediante ESPNOW
-void analog_potentiometer_updater(void *parameter);                          // Tarea FreeRTOS encargada de realizar las lecturas del potenciómetro y enviarlas al gateway.node.esp32 mediante ESPNOW
-void internal_RTC_updater(void *parameter);                                  // Tarea FreeRTOS encargada de gestionar la deriva del RTC interno del microcontrolador
-void presence_updater(void *parameter);                                      // Tarea FreeRTOS encargada de notificar cuando el PIR detecta presencia al nodo gateway.node.esp32 mediante el protocolo ESPNOW
-void board_status_updater(void *parameter);                                  // Tarea FreeRTOS  encargada de enviar información cada minuto sobre el estado del nodo al nodo gateway.node.esp32 mediante el protocolo ESPNOW
+void configTimeAndSync();                                                    // Trabajo que pide la hora al nodo gateway usando ESPNOW, para corregir la deriva del RTC interno
+void sensores_updater();                                                     // Trabajo que lee la temperatura, la humedad y el potenciómetro
+void presence_updater();                                                     // Trabajo que notifica al nodo gateway.node.esp32 que el PIR ha detectado presencia
+void board_status_updater();                                                 // Trabajo que envía el estado del nodo al nodo gateway.node.esp32
 void OnDataRecv(const uint8_t *mac_addr, const uint8_t *data, int data_len); // Callback para recibir datos de gateway.node.esp32
+void backfill_streamer();                                                    // Trabajo que reenvía desde flash, un batch por periodo, las lecturas que pide el gateway
+bool asegurarPeer(const uint8_t *mac);                                       // Metodo para registrar un nodo como peer de ESPNOW si aun no lo esta
+void OnDataSent(const uint8_t *mac_addr, esp_now_send_status_t status);      // Callback de confirmación de los envíos ESPNOW
+const uint8_t *gatewayDestino();                                             // Metodo que devuelve el gateway al que enviar, ya registrado como peer
+void iniciarGateways();                                                      // Metodo que prepara la tabla de gateways y la captura del RSSI de las balizas
+uint32_t relojGateways();                                                    // Metodo que devuelve el reloj en milisegundos de la tabla de gateways
+void informeGateways();                                                      // Metodo que muestra por el puerto serie el gateway elegido y los cambios de gateway
 
 void setup()
 {
@@ -52,7 +135,9 @@ void setup()
   dht.begin();
   pinMode(PIR_PIN, INPUT); // Configurar el pin del sensor PIR como entrada
 
-  attachInterrupt(digitalPinToInterrupt(13), movimiento_detectado, RISING); // Detecta cambio de LOW a HIGH en el sensor PIR
+#ifdef MODO_DEEP_SLEEP
+  ejecutarCiclo(); // Lee, envía si la política lo pide y vuelve a dormir
+#endif
 
   // RCN esta nodo no debe conectarse a la red Wifi. SOLO se comunica por ESPNOW
   WiFi.mode(WIFI_STA); // Inicializacion del WiFi
@@ -64,178 +149,583 @@ void setup()
   }
 
   esp_now_register_recv_cb(OnDataRecv); // Registrar el callback para recibir datos
+  esp_now_register_send_cb(OnDataSent); // Los envíos sin confirmar hacen cambiar de gateway
+  iniciarGateways();
+
+  if (!asegurarPeer(gatewayAddress)) // Sin el gateway registrado como peer, esp_now_send falla
+  {
+    Serial.println("Error al registrar el gateway como peer");
+  }
+
+  flashLog.begin();                                                           // Recuperar el anillo de lecturas de la flash
+  backfillQueue = xQueueCreate(BACKFILL_MAX_PETICIONES, sizeof(PeticionBackfill)); // Cola de peticiones de backfill
 
   rebootCount++;           // Incrementar el contador de reinicio
   lastWakeTime = millis(); // Actualizar la última vez que se desperto
 
-  rtcSemaphore = xSemaphoreCreateMutex(); // Creacion del semaforo
+  // Todos los trabajos se ejecutan en la tarea del planificador, así que no compiten por las variables globales.
+  // Los trabajos con el mismo periodo se ejecutan en el orden en que se agregan, en el mismo despertar: primero se
+  // leen los sensores y a continuación se comprueba el delta sobre esas lecturas.
+  planificador.agregar("Sensores", sensores_updater, PERIODO_MUESTREO_MS, 1000);
+  planificador.agregar("Delta", verificarYenviarDatos, PERIODO_MUESTREO_MS, 1000);
+  planificador.agregar("RTC", configTimeAndSync, PERIODO_RTC_MS, 5000);
+  planificador.agregar("Estado", board_status_updater, PERIODO_ESTADO_MS, 5000);
+  planificador.agregar("Presencia", presence_updater, 0, 0, EVENTO_PRESENCIA);
+  idBackfill = planificador.agregar("Backfill", backfill_streamer, BACKFILL_INTERVAL_MS, 0, EVENTO_BACKFILL, false);
+  planificador.agregar("Informe", []() { planificador.informe(); informeGateways(); }, PERIODO_INFORME_MS, 30000);
+
+  uint32_t heapAntes = ESP.getFreeHeap();
+  if (!planificador.arrancar("Planificador", PILA_PLANIFICADOR, 1))
+  {
+    Serial.println("Error al crear la tarea del planificador");
+  }
+  Serial.printf("Planificador arrancado: %u bytes de heap para la tarea, %u libres\n",
+                (unsigned)(heapAntes - ESP.getFreeHeap()), (unsigned)ESP.getFreeHeap());
 
-  // RCN Sería mejor no indicar el core en el que se ejecuta la tarea. Deja que FreeRTOS lo decida.
-  xTaskCreatePinnedToCore(temperature_humidity_updater, "Leer Temperatura y Humedad", 2048, NULL, 1, NULL, 1);
-  xTaskCreatePinnedToCore(analog_potentiometer_updater, "Leer Potenciómetro", 2048, NULL, 1, NULL, 1);
-  xTaskCreatePinnedToCore(verificarYenviarDatos, "Verificar y Enviar Datos Batch", 4096, NULL, 1, NULL, 1);
-  xTaskCreatePinnedToCore(internal_RTC_updater, "Actualizar RTC", 2048, NULL, 1, NULL, 1);
-  xTaskCreatePinnedToCore(presence_updater, "Notificar Presencia", 2048, NULL, 1, NULL, 1);
-  xTaskCreatePinnedToCore(board_status_updater, "Actualizar Estado Nodo", 2048, NULL, 1, NULL, 1);
+  attachInterrupt(digitalPinToInterrupt(PIR_PIN), movimiento_detectado, RISING); // Detecta cambio de LOW a HIGH en el sensor PIR
 }
 
 void loop()
 {
-  // El loop esta vacio debido a que todas las tareas se manejan en FreeRTOS
+  // Todo el trabajo lo hace el planificador; se elimina la tarea de loop para liberar su pila
+  vTaskDelete(NULL);
 }
 
-void temperature_humidity_updater(void *parameter)
+void sensores_updater()
 {
-  for (;;)
-  {
-    temperatura = dht.readTemperature(); // Leer temperatura en grados Celsius
-    humedad = dht.readHumidity();        // Leer humedad relativa en porcentaje
-    vTaskDelay(pdMS_TO_TICKS(20000));    // Esperar 20 segundos antes de realizar otra lectura
-  }
+  temperatura = dht.readTemperature();      // Leer temperatura en grados Celsius
+  humedad = dht.readHumidity();             // Leer humedad relativa en porcentaje
+  int valor = analogRead(POT_PIN);          // Leer valor del potenciómetro
+  porcentaje = map(valor, 0, 4095, 0, 100); // Convertirlo a porcentaje
 }
 
-void analog_potentiometer_updater(void *parameter)
+void presence_updater()
 {
-  for (;;)
-  {
-    int valor = analogRead(POT_PIN);          // Leer valor del potenciómetro
-    porcentaje = map(valor, 0, 4095, 0, 100); // Convertirlo a porcentaje
-    vTaskDelay(pdMS_TO_TICKS(20000));         // Esperar 20 segundos antes de realizar otra lectura
-  }
+  // Enviar notificación de presencia usando ESPNOW
+  PresenceNotification notificacion;
+  notificacion.presencia = true;
+  notificacion.timestamp = obtenerTiempoUTC();
+
+  esp_now_send(gatewayDestino(), (uint8_t *)&notificacion, sizeof(notificacion));
 }
 
-// RCN solución parcialmente correcta. Usas interrupciones, pero compruebas cada 1 segundo, por lo que la marca de tiempo puede tener un error de hasta 1 segundo.
-void presence_updater(void *parameter)
+void IRAM_ATTR movimiento_detectado()
 {
-  for (;;)
-  {
-    if (movimiento_bool == HIGH)
-    {
-      // Enviar notificación de presencia usando ESPNOW
-      PresenceNotification notificacion;
-      notificacion.presencia = true;
-      notificacion.timestamp = obtenerTiempoUTC();
+  planificador.notificarDesdeISR(EVENTO_PRESENCIA);
+}
+
+void board_status_updater()
+{
+  unsigned long currentTime = millis();                       // Obtencion del tiempo actual
+  unsigned long uptime = (currentTime - lastWakeTime) / 1000; // Conversion a segundos
 
-      esp_err_t result = esp_now_send(gatewayAddress, (uint8_t *)&notificacion, sizeof(notificacion));
+  // RCN ¿Y la marca de tiempo?
+  NodeStatus status;
+  status.rebootCount = rebootCount;
+  status.uptime = uptime;
 
-      movimiento_bool = LOW; // Resetear el indicador de movimiento
-    }
-    vTaskDelay(pdMS_TO_TICKS(1000)); // Verificar cada segundo
-  }
+  esp_now_send(gatewayDestino(), (uint8_t *)&status, sizeof(status)); // Enviar estado del nodo usando ESPNOW
 }
 
-void movimiento_detectado()
+void configTimeAndSync()
 {
-  movimiento_bool = HIGH;
+  TimeRequest request;
+
+  esp_err_t result = esp_now_send(gatewayDestino(), (uint8_t *)&request, sizeof(request)); // Enviar solicitud de tiempo
 }
 
-void board_status_updater(void *parameter)
+void OnDataRecv(const uint8_t *mac_addr, const uint8_t *data, int data_len)
 {
-  for (;;)
+  if (data_len < 1)
+    return;
+
+  switch ((MessageType)data[0]) // El primer byte indica el tipo de mensaje
   {
-    unsigned long currentTime = millis();                       // Obtencion del tiempo actual
-    unsigned long uptime = (currentTime - lastWakeTime) / 1000; // Conversion a segundos
+  case MSG_TIME_RESPONSE:
+    if (data_len == sizeof(TimeResponse))
+    {
+      TimeResponse respuesta;
+      memcpy(&respuesta, data, sizeof(respuesta));
 
-    // RCN ¿Y la marca de tiempo?
-    NodeStatus status;
-    status.rebootCount = rebootCount;
-    status.uptime = uptime;
+      // Establecer el tiempo local con la respuesta recibida
+      struct timeval tv;
+      tv.tv_sec = respuesta.timestamp;
+      tv.tv_usec = 0;
+      settimeofday(&tv, NULL);
+      horaRecibida = true;
 
-    esp_now_send(gatewayAddress, (uint8_t *)&status, sizeof(status)); // Enviar estado del nodo usando ESPNOW
+      Serial.println("Tiempo sincronizado con éxito");
+    }
+    break;
+  case MSG_GATEWAY_BEACON:
+    if (data_len == sizeof(GatewayBeacon))
+    {
+      GatewayBeacon baliza;
+      memcpy(&baliza, data, sizeof(baliza));
+      int8_t rssi = memcmp(macUltimaTrama, mac_addr, sizeof(macUltimaTrama)) == 0 ? rssiUltimaTrama : RSSI_DESCONOCIDO;
 
-    vTaskDelay(pdMS_TO_TICKS(60000)); // Enviar cada minuto
+      taskENTER_CRITICAL(&muxGateways);
+      tablaGateways.registrarBaliza(mac_addr, baliza.profundidadCola, baliza.capacidadCola, baliza.conBroker, rssi, relojGateways());
+      taskEXIT_CRITICAL(&muxGateways);
+    }
+    break;
+  case MSG_BACKFILL_REQUEST:
+    if (data_len == sizeof(BackfillRequest))
+    {
+      // Se ejecuta en la tarea de WiFi: la lectura de flash y el envío se hacen en backfill_streamer
+      BackfillRequest recibida;
+      memcpy(&recibida, data, sizeof(recibida));
+      PeticionBackfill peticion;
+      memcpy(peticion.mac, mac_addr, sizeof(peticion.mac));
+      peticion.modo = recibida.modo;
+      peticion.desde = recibida.desde;
+      peticion.hasta = recibida.hasta;
+      if (xQueueSend(backfillQueue, &peticion, 0) == pdTRUE)
+        planificador.notificar(EVENTO_BACKFILL);
+    }
+    break;
+  default:
+    break;
   }
 }
 
-void internal_RTC_updater(void *parameter)
+// Envía un batch por ejecución; el periodo del trabajo (BACKFILL_INTERVAL_MS) marca el ritmo. Cuando no quedan
+// peticiones el trabajo se desactiva y el planificador deja de despertarse por él.
+void backfill_streamer()
 {
-  for (;;)
+  if (!backfillEnCurso)
   {
-    // RCN ¿Para qué un semáforo? 
-    if (xSemaphoreTake(rtcSemaphore, portMAX_DELAY))
+    if (xQueueReceive(backfillQueue, &backfillActual, 0) != pdTRUE)
+    {
+      planificador.desactivar(idBackfill);
+      return;
+    }
+
+    backfillDesde = backfillActual.desde;
+    backfillHasta = backfillActual.hasta;
+    if (backfillActual.modo == BACKFILL_POR_TIEMPO) // Se traduce el rango de tiempo a secuencias con el índice del log
     {
-      configTimeAndSync();
-      xSemaphoreGive(rtcSemaphore);
+      uint32_t fin = backfillActual.hasta == UINT32_MAX ? flashLog.nextSeq() : flashLog.seqForTimestamp(backfillActual.hasta + 1);
+      backfillDesde = flashLog.seqForTimestamp(backfillActual.desde);
+      if (fin == 0)
+        return; // No hay lecturas en ese rango
+      backfillHasta = fin - 1;
     }
-    vTaskDelay(pdMS_TO_TICKS(60000)); // Esperar 1 minuto antes de la próxima actualización
+
+    Serial.printf("Backfill de las secuencias %u-%u (disponibles desde %u)\n", (unsigned)backfillDesde, (unsigned)backfillHasta, (unsigned)flashLog.oldestSeq());
+    asegurarPeer(backfillActual.mac);
+    backfillEnCurso = true;
+  }
+
+  DataBatch batch;
+  batch.msg_type = MSG_BACKFILL_DATA;
+  batch.numLecturas = 0;
+  if (backfillDesde <= backfillHasta && backfillDesde < flashLog.nextSeq())
+  {
+    size_t maximo = backfillHasta - backfillDesde + 1 < LECTURAS_POR_BATCH ? backfillHasta - backfillDesde + 1 : LECTURAS_POR_BATCH;
+    uint32_t primerSeq; // DataBatch es packed: su campo no se puede pasar por referencia
+    batch.numLecturas = flashLog.read(backfillDesde, batch.lecturas, maximo, primerSeq);
+    batch.primerSeq = primerSeq;
   }
+  if (batch.numLecturas == 0) // Petición terminada o el rango ya no está en flash
+  {
+    backfillEnCurso = false;
+    return;
+  }
+
+  esp_now_send(backfillActual.mac, (uint8_t *)&batch, offsetof(DataBatch, lecturas) + batch.numLecturas * sizeof(DataReading));
+  backfillDesde = batch.primerSeq + batch.numLecturas;
 }
 
-void configTimeAndSync()
+bool asegurarPeer(const uint8_t *mac)
 {
-  TimeRequest request;
-
-  esp_err_t result = esp_now_send(gatewayAddress, (uint8_t *)&request, sizeof(request)); // Enviar solicitud de tiempo
+  if (esp_now_is_peer_exist(mac))
+    return true;
+
+  memset(&peerInfo, 0, sizeof(peerInfo));
+  memcpy(peerInfo.peer_addr, mac, 6);
+  peerInfo.channel = 0;
+  peerInfo.encrypt = false;
+  return esp_now_add_peer(&peerInfo) == ESP_OK;
 }
 
-void OnDataRecv(const uint8_t *mac_addr, const uint8_t *data, int data_len)
+// Se ejecuta justo después de sensores_updater: las lecturas solo cambian cada PERIODO_MUESTREO_MS
+void verificarYenviarDatos()
 {
-  if (data_len == sizeof(time_t)) // Verificar si los datos recibidos corresponden a una respuesta de tiempo
-  {
-    time_t receivedTime;
-    memcpy(&receivedTime, data, sizeof(time_t));
+  DataReading reading;
+  uint32_t seq;
+  bool brusco;
+  if (!registrarSiHayCambio(reading, seq, brusco))
+    return;
 
-    // Establecer el tiempo local con la respuesta recibida
-    struct timeval tv;
-    tv.tv_sec = receivedTime;
-    tv.tv_usec = 0;
-    settimeofday(&tv, NULL);
+  if (dataIndex == 0)
+    primerSeqBuffer = seq;
+  dataBuffer[dataIndex++] = reading; // Guardar la lectura actual en el buffer
 
-    Serial.println("Tiempo sincronizado con éxito");
+  if (dataIndex >= LECTURAS_POR_BATCH) // Si el buffer esta lleno
+  {
+    enviarDatosBatch(); // Enviar datos al batch
+    dataIndex = 0;      // Reiniciar el indice del buffer
   }
 }
 
-// RCN Segun el enunciado, cada tipo de datos debe enviarse desde diferentes tareas.
-void verificarYenviarDatos(void *parameter)
+bool registrarSiHayCambio(DataReading &reading, uint32_t &seq, bool &brusco)
 {
-  for (;;)
-  {
-    bool sendTemperatura = abs(temperatura - lastTemperatura) >= deltaTemperatura; // Variable que compara si la diferencia absoluta entre temperatura y lastTemperatura es mayor o igual que deltaTemperatura
-    bool sendHumedad = abs(humedad - lastHumedad) >= deltaHumedad;                 // Variable que compara si la diferencia absoluta entre humedad y lastHumedad es mayor o igual que deltaHumedad
-    bool sendPorcentaje = abs(porcentaje - lastPorcentaje) >= deltaPorcentaje;     // Variable que compara si la diferencia absoluta entre porcentaje y lastPorcentaje es mayor o igual que deltaPorcentaje
-
-    if (sendTemperatura || sendHumedad || sendPorcentaje) // Si ha habido alguna variacion
-    {
-      DataReading reading;
-      reading.temperatura = temperatura;      // Almacenar la lectura actual de la temperatura en el buffer
-      reading.humedad = humedad;              // Almacenar la lectura actual de la humedad en el buffer
-      reading.porcentaje = porcentaje;        // Almacenar la lectura actual del porcentaje en el buffer
-      reading.timestamp = obtenerTiempoUTC(); // Almacenar el timestamp en el buffer
-
-      dataBuffer[dataIndex++] = reading; // Guardar la lectura actual en el buffer
-
-      // Actualizar las lecturas anteriores solo si se enviaron
-      if (sendTemperatura)
-        lastTemperatura = temperatura;
-      if (sendHumedad)
-        lastHumedad = humedad;
-      if (sendPorcentaje)
-        lastPorcentaje = porcentaje;
-
-      if (dataIndex >= 10) // Si el buffer esta lleno
-      {
-        enviarDatosBatch(); // Enviar datos al batch
-        dataIndex = 0;      // Reiniciar el indice del buffer
-      }
-    }
-    vTaskDelay(pdMS_TO_TICKS(1000)); // Verificar cada segundo
-  }
+  bool sendTemperatura = abs(temperatura - lastTemperatura) >= deltaTemperatura; // Variable que compara si la diferencia absoluta entre temperatura y lastTemperatura es mayor o igual que deltaTemperatura
+  bool sendHumedad = abs(humedad - lastHumedad) >= deltaHumedad;                 // Variable que compara si la diferencia absoluta entre humedad y lastHumedad es mayor o igual que deltaHumedad
+  bool sendPorcentaje = abs(porcentaje - lastPorcentaje) >= deltaPorcentaje;     // Variable que compara si la diferencia absoluta entre porcentaje y lastPorcentaje es mayor o igual que deltaPorcentaje
+
+  if (!sendTemperatura && !sendHumedad && !sendPorcentaje) // Si no ha habido ninguna variacion
+    return false;
+
+  // Cambio brusco respecto a una lectura anterior real (no al valor inicial -1000)
+  brusco = lastPorcentaje != -1000 && (abs(temperatura - lastTemperatura) >= factorCambioBrusco * deltaTemperatura ||
+                                       abs(humedad - lastHumedad) >= factorCambioBrusco * deltaHumedad ||
+                                       abs(porcentaje - lastPorcentaje) >= factorCambioBrusco * deltaPorcentaje);
+
+  reading.temperatura = temperatura;      // Almacenar la lectura actual de la temperatura en el buffer
+  reading.humedad = humedad;              // Almacenar la lectura actual de la humedad en el buffer
+  reading.porcentaje = porcentaje;        // Almacenar la lectura actual del porcentaje en el buffer
+  reading.timestamp = obtenerTiempoUTC(); // Almacenar el timestamp en el buffer
+
+  seq = flashLog.append(reading); // Guardar la lectura en flash antes de enviarla, por si no llega al gateway
+
+  // Actualizar las lecturas anteriores solo si se enviaron
+  if (sendTemperatura)
+    lastTemperatura = temperatura;
+  if (sendHumedad)
+    lastHumedad = humedad;
+  if (sendPorcentaje)
+    lastPorcentaje = porcentaje;
+  return true;
 }
 
 time_t obtenerTiempoUTC()
 {
   time_t now;
   struct tm timeinfo;
-  if (!getLocalTime(&timeinfo))
-  {
-    Serial.println("Ocurrio un error al obtener el tiempo");
+  if (!getLocalTime(&timeinfo, 0)) // Sin esperar ni log: sin hora sincronizada (lo normal al despertar) se devuelve 0
     return 0;
-  }
   time(&now);
   return now;
 }
 
 void enviarDatosBatch()
 {
-  esp_now_send(gatewayAddress, (uint8_t *)dataBuffer, sizeof(dataBuffer));
+  DataBatch batch;
+  batch.numLecturas = dataIndex;
+  batch.primerSeq = primerSeqBuffer;
+  memcpy(batch.lecturas, dataBuffer, dataIndex * sizeof(DataReading));
+
+  // Si el envío falla no se reintenta aquí: el gateway detecta el hueco en las secuencias y pide un backfill (también
+  // el siguiente gateway si el fallo hace cambiar de gateway, porque los gateways comparten las secuencias por MQTT)
+  esp_now_send(gatewayDestino(), (uint8_t *)&batch, offsetof(DataBatch, lecturas) + dataIndex * sizeof(DataReading));
+}
+
+// Reloj de la tabla de gateways: en deep sleep millis() vuelve a empezar en cada despertar, el contador RTC no
+uint32_t relojGateways()
+{
+#ifdef MODO_DEEP_SLEEP
+  return (uint32_t)(esp_rtc_get_time_us() / 1000);
+#else
+  return millis();
+#endif
+}
+
+void capturarRssi(void *buf, wifi_promiscuous_pkt_type_t tipo)
+{
+  const wifi_promiscuous_pkt_t *paquete = (const wifi_promiscuous_pkt_t *)buf;
+  memcpy(macUltimaTrama, paquete->payload + 10, sizeof(macUltimaTrama)); // Dirección de origen en la cabecera 802.11
+  rssiUltimaTrama = paquete->rx_ctrl.rssi;
+}
+
+// El modo promiscuo solo con tramas de gestión: se ejecuta antes que OnDataRecv para cada trama ESP-NOW recibida
+void iniciarGateways()
+{
+  uint8_t mac[6];
+  WiFi.macAddress(mac);
+  tablaGateways.iniciar(mac);
+
+  wifi_promiscuous_filter_t filtro = {.filter_mask = WIFI_PROMIS_FILTER_MASK_MGMT};
+  esp_wifi_set_promiscuous_filter(&filtro);
+  esp_wifi_set_promiscuous_rx_cb(capturarRssi);
+  esp_wifi_set_promiscuous(true);
+}
+
+const uint8_t *gatewayDestino()
+{
+  taskENTER_CRITICAL(&muxGateways);
+  tablaGateways.revisar(relojGateways()); // Para dejar el gateway elegido si ha dejado de enviar balizas
+  memcpy(gatewayElegido, tablaGateways.destino(gatewayAddress), sizeof(gatewayElegido));
+  taskEXIT_CRITICAL(&muxGateways);
+
+  asegurarPeer(gatewayElegido);
+  return gatewayElegido;
+}
+
+void informeGateways()
+{
+  taskENTER_CRITICAL(&muxGateways);
+  TablaGateways copia = tablaGateways;
+  taskEXIT_CRITICAL(&muxGateways);
+
+  const uint8_t *mac = copia.destino(gatewayAddress);
+  Serial.printf("Gateway %02x:%02x:%02x:%02x:%02x:%02x de %u conocidos (ultimo cambio: %s); cambios por fallos %u, por caducidad %u, por carga %u\n",
+                mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], (unsigned)copia.num, nombreCambio(copia.ultimoMotivo),
+                (unsigned)copia.cambiosFallos, (unsigned)copia.cambiosCaducidad, (unsigned)copia.cambiosCarga);
+}
+
+void OnDataSent(const uint8_t *mac_addr, esp_now_send_status_t status)
+{
+  taskENTER_CRITICAL(&muxGateways);
+  bool cambio = tablaGateways.registrarEnvio(mac_addr, status == ESP_NOW_SEND_SUCCESS, relojGateways());
+  taskEXIT_CRITICAL(&muxGateways);
+  if (cambio)
+    Serial.println("Envios sin confirmar: se cambia de gateway");
+
+#ifdef MODO_DEEP_SLEEP
+  if (status != ESP_NOW_SEND_SUCCESS)
+    enviosFallidos++;
+  enviosConfirmados++;
+#endif
+}
+
+#ifdef MODO_DEEP_SLEEP
+// Envía un mensaje y espera a que la capa MAC confirme que el destinatario lo ha recibido
+bool enviarYConfirmar(const uint8_t *mac, const void *datos, size_t len)
+{
+  uint32_t confirmadosAntes = enviosConfirmados;
+  uint32_t fallidosAntes = enviosFallidos;
+  if (esp_now_send(mac, (const uint8_t *)datos, len) != ESP_OK)
+    return false;
+
+  unsigned long inicio = millis();
+  while (enviosConfirmados == confirmadosAntes && millis() - inicio < ESPERA_CONFIRMACION_MS)
+    delay(1);
+  return enviosConfirmados != confirmadosAntes && enviosFallidos == fallidosAntes;
+}
+
+// La hora del sistema se conserva en deep sleep, pero se comprueba contra la guardada al dormir más el tiempo que ha
+// contado el RTC, por si el arranque la ha perdido; así no hace falta encender la radio para recuperar la hora.
+void restaurarHora()
+{
+  if (estadoCiclos.horaAlDormirUs < (int64_t)HORA_VALIDA * 1000000)
+    return; // Aún no se había sincronizado nunca
+
+  int64_t esperada = estadoCiclos.horaAlDormirUs + (int64_t)(esp_rtc_get_time_us() - estadoCiclos.rtcAlDormirUs);
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  int64_t actual = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+  if (llabs(actual - esperada) > 1000000)
+  {
+    tv.tv_sec = esperada / 1000000;
+    tv.tv_usec = esperada % 1000000;
+    settimeofday(&tv, NULL);
+    Serial.println("Hora restaurada desde la memoria RTC");
+  }
+}
+
+// Enciende la radio, entrega todo lo pendiente y la apaga. Devuelve false si algún envío no se confirmó.
+bool cicloRadio(bool presencia, uint32_t &enviados, uint32_t &fallidos)
+{
+  WiFi.mode(WIFI_STA);
+  if (esp_now_init() != ESP_OK)
+  {
+    WiFi.mode(WIFI_OFF);
+    return false;
+  }
+  esp_now_register_send_cb(OnDataSent);
+  esp_now_register_recv_cb(OnDataRecv);
+  iniciarGateways();
+
+  // Las balizas solo se oyen con la radio encendida: se escucha una ronda si hace mucho que no se oye ninguna o si el
+  // ciclo anterior no consiguió entregar nada, por si los gateways han cambiado
+  if (estadoCiclos.fallosSeguidos > 0 || tablaGateways.necesitaBusqueda(relojGateways()))
+    delay(ESCUCHA_BALIZAS_MS);
+
+  bool entregado = true;
+  if (presencia)
+  {
+    PresenceNotification notificacion;
+    notificacion.presencia = true;
+    notificacion.timestamp = obtenerTiempoUTC();
+    entregado &= enviarYConfirmar(gatewayDestino(), &notificacion, sizeof(notificacion));
+  }
+
+  // Con la radio ya encendida se aprovecha para resincronizar si ha pasado la mitad del periodo
+  uint32_t ahora = time(nullptr);
+  if (ahora < HORA_VALIDA || estadoCiclos.ultimaSincronizacion == 0 || ahora - estadoCiclos.ultimaSincronizacion >= CICLOS_RESINCRONIZAR_S / 2)
+  {
+    TimeRequest request;
+    horaRecibida = false;
+    if (enviarYConfirmar(gatewayDestino(), &request, sizeof(request)))
+    {
+      unsigned long inicio = millis();
+      while (!horaRecibida && millis() - inicio < ESPERA_HORA_MS)
+        delay(1);
+    }
+    if (horaRecibida)
+      estadoCiclos.ultimaSincronizacion = time(nullptr);
+    else
+      entregado = false;
+  }
+
+  // Las lecturas solo salen del anillo RTC cuando el gateway confirma el batch. Un batch sin confirmar se reintenta:
+  // tras FALLOS_CAMBIO_GATEWAY fallos la tabla pasa al siguiente gateway, que descarta lo que ya le llegó al anterior
+  bool batchesEnviados = false;
+  int fallosBatch = 0;
+  while (anilloRtc.num > 0)
+  {
+    DataBatch batch;
+    uint8_t num = anilloRtc.prepararBatch(batch);
+    if (!enviarYConfirmar(gatewayDestino(), &batch, offsetof(DataBatch, lecturas) + num * sizeof(DataReading)))
+    {
+      if (++fallosBatch < MAX_FALLOS_BATCH_CICLO)
+        continue;
+      entregado = false;
+      break;
+    }
+    anilloRtc.descartar(num);
+    batchesEnviados = true;
+  }
+
+  ahora = time(nullptr);
+  if (ahora - estadoCiclos.ultimoEstado >= CICLOS_ESTADO_S / 2)
+  {
+    NodeStatus status;
+    status.rebootCount = rebootCount;
+    status.uptime = esp_rtc_get_time_us() / 1000000; // El contador RTC sigue contando durante el deep sleep
+    if (enviarYConfirmar(gatewayDestino(), &status, sizeof(status)))
+      estadoCiclos.ultimoEstado = ahora;
+  }
+
+  // Si el gateway ha visto un hueco responde con un backfill; se sirve una parte por ciclo
+  if (batchesEnviados || backfillEnCurso)
+  {
+    delay(ESCUCHA_BACKFILL_MS);
+    for (int i = 0; i < BACKFILL_BATCHES_POR_CICLO && (backfillEnCurso || uxQueueMessagesWaiting(backfillQueue) > 0); i++)
+    {
+      backfill_streamer();
+      delay(BACKFILL_INTERVAL_CICLO_MS);
+    }
+  }
+
+  enviados = enviosConfirmados - enviosFallidos;
+  fallidos = enviosFallidos;
+  esp_now_deinit();
+  WiFi.mode(WIFI_OFF);
+  return entregado;
+}
+
+void ejecutarCiclo()
+{
+  esp_sleep_wakeup_cause_t causa = esp_sleep_get_wakeup_cause();
+  uint64_t rtcDespertar = esp_rtc_get_time_us();
+  bool presencia = causa == ESP_SLEEP_WAKEUP_EXT0;
+
+#ifdef DEPURACION_CICLOS
+  // Desde el despertar del hardware hasta que arranca la aplicación; solo se conoce en los despertares por timer
+  int64_t arranqueUs = causa == ESP_SLEEP_WAKEUP_TIMER ? (int64_t)(rtcDespertar - estadoCiclos.rtcDespertarPrevistoUs) - esp_timer_get_time() : -1;
+#endif
+
+  if (causa != ESP_SLEEP_WAKEUP_TIMER && !presencia) // Arranque normal: la memoria RTC está recién inicializada
+  {
+    rebootCount++;
+    estadoCiclos.rtcSiguienteMuestreoUs = rtcDespertar;
+  }
+  else
+  {
+    restaurarHora();
+  }
+  estadoCiclos.ciclos++;
+
+  backfillQueue = xQueueCreate(BACKFILL_MAX_PETICIONES, sizeof(PeticionBackfill));
+  bool logAbierto = false;
+
+  // Los despertares por el PIR o para rearmarlo no leen los sensores si aún no toca
+  bool muestreo = rtcDespertar + 500000 >= estadoCiclos.rtcSiguienteMuestreoUs;
+  bool brusco = false;
+  if (muestreo)
+  {
+    logAbierto = flashLog.begin(INFORME_CICLOS);
+    sensores_updater();
+
+    DataReading reading;
+    uint32_t seq;
+    if (registrarSiHayCambio(reading, seq, brusco))
+      anilloRtc.agregar(reading, seq);
+
+    while (estadoCiclos.rtcSiguienteMuestreoUs <= rtcDespertar + 500000)
+      estadoCiclos.rtcSiguienteMuestreoUs += (uint64_t)PERIODO_MUESTREO_MS * 1000;
+  }
+
+  MotivoRadio motivo = decidirRadio(anilloRtc, estadoCiclos, time(nullptr), presencia, backfillEnCurso, brusco);
+  int64_t radioUs = 0;
+  uint32_t enviados = 0, fallidos = 0;
+  if (motivo != RADIO_NO)
+  {
+    if (!logAbierto) // El gateway puede pedir un backfill en este mismo ciclo
+      flashLog.begin(INFORME_CICLOS);
+    int64_t inicioRadio = esp_timer_get_time();
+    bool entregado = cicloRadio(presencia, enviados, fallidos);
+    radioUs = esp_timer_get_time() - inicioRadio;
+
+    registrarResultadoRadio(estadoCiclos, entregado);
+    estadoCiclos.ciclosConRadio++;
+    estadoCiclos.radioTotalUs += radioUs;
+  }
+
+  // Siguiente despertar: el plazo de muestreo o, si el PIR sigue en alto (despertaría en el acto), su rearme
+  uint64_t rtcAhora = esp_rtc_get_time_us();
+  uint64_t esperaUs = estadoCiclos.rtcSiguienteMuestreoUs > rtcAhora ? estadoCiclos.rtcSiguienteMuestreoUs - rtcAhora : 1000;
+  if (digitalRead(PIR_PIN) == HIGH)
+  {
+    if (esperaUs > (uint64_t)PIR_REARME_MS * 1000)
+      esperaUs = (uint64_t)PIR_REARME_MS * 1000;
+  }
+  else
+  {
+    esp_sleep_enable_ext0_wakeup((gpio_num_t)PIR_PIN, 1);
+  }
+  esp_sleep_enable_timer_wakeup(esperaUs);
+
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  estadoCiclos.horaAlDormirUs = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+  estadoCiclos.rtcAlDormirUs = esp_rtc_get_time_us();
+  estadoCiclos.rtcDespertarPrevistoUs = estadoCiclos.rtcAlDormirUs + esperaUs;
+
+  // Despierto: desde que arranca la aplicación hasta aquí (sin contar el propio log)
+  int64_t despiertoUs = esp_timer_get_time();
+  estadoCiclos.despiertoTotalUs += despiertoUs;
+  if (motivo == RADIO_NO)
+  {
+    estadoCiclos.despertaresSinRadio++;
+    estadoCiclos.despiertoSinRadioUs += despiertoUs;
+  }
+  else
+  {
+    // Una línea solo en los ciclos con radio, que ya son largos: a 9600 baudios cuesta unos 80 ms despierto. Los
+    // despertares sin radio se acumulan en RTC y se informan aquí.
+    Serial.printf("Ciclo %u: radio %s %lld ms, despierto %lld ms; antes %u despertares sin radio, %llu ms despierto\n",
+                  (unsigned)estadoCiclos.ciclos, nombreMotivo(motivo), radioUs / 1000, despiertoUs / 1000,
+                  (unsigned)estadoCiclos.despertaresSinRadio, (unsigned long long)(estadoCiclos.despiertoSinRadioUs / 1000));
+    estadoCiclos.despertaresSinRadio = 0;
+    estadoCiclos.despiertoSinRadioUs = 0;
+  }
+#ifdef DEPURACION_CICLOS
+  Serial.printf("Ciclo %u (%s, arranque %lld ms): %s, %u pendientes en RTC, radio %s %lld ms (%u enviados, %u fallidos), "
+                "despierto %lld ms, duerme %llu ms; medias: radio %llu ms en %u ciclos con radio, despierto %llu ms\n",
+                (unsigned)estadoCiclos.ciclos, presencia ? "PIR" : (causa == ESP_SLEEP_WAKEUP_TIMER ? "timer" : "arranque"),
+                arranqueUs / 1000, muestreo ? "muestreo" : "sin muestreo", (unsigned)anilloRtc.num,
+                nombreMotivo(motivo), radioUs / 1000, (unsigned)enviados, (unsigned)fallidos,
+                despiertoUs / 1000, (unsigned long long)(esperaUs / 1000),
+                (unsigned long long)(estadoCiclos.ciclosConRadio > 0 ? estadoCiclos.radioTotalUs / estadoCiclos.ciclosConRadio / 1000 : 0),
+                (unsigned)estadoCiclos.ciclosConRadio, (unsigned long long)(estadoCiclos.despiertoTotalUs / estadoCiclos.ciclos / 1000));
+  if (motivo != RADIO_NO)
+    informeGateways();
+#endif
+  Serial.flush();
+  esp_deep_sleep_start();
 }
+#endif
@@ -0,0 +1,263 @@
+// Simulación en el host de los despertares del nodo sensor con el planificador (include/scheduler.h) frente a las
+// siete tareas con vTaskDelay a las que sustituyó. El planificador es el del firmware, con la misma tabla de trabajos
+// que setup(); el reloj de esp_timer y las llamadas de FreeRTOS que usa son simuladas, así que los resultados son
+// reproducibles. Cada vuelta de xTaskNotifyWait cuenta como un despertar, igual que en el informe del firmware.
+//
+//   pio run -e native-planificador
+//   .pio/build/native-planificador/program [--horas N] [--presencias N] [--backfills N] [--batches N]
+//
+// --presencias y --backfills son eventos por hora repartidos de forma uniforme: disparos del PIR y peticiones de
+// backfill del gateway de --batches batches cada una. Con las tareas de antes el PIR solo levantaba una bandera que
+// miraba la tarea de presencia cada segundo y el backfill despertaba una vez por petición y otra por cada batch.
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// Lo que scheduler.h usa de Arduino y FreeRTOS, sobre el reloj simulado
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+typedef enum
+{
+  eSetBits,
+} eNotifyAction;
+
+#define IRAM_ATTR
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS 1
+#define portMAX_DELAY UINT32_MAX
+#define portTICK_PERIOD_MS 1 // CONFIG_FREERTOS_HZ = 1000 en arduino-esp32
+#define portYIELD_FROM_ISR() do {} while (0)
+
+struct FinSimulacion // Se lanza desde xTaskNotifyWait al llegar al final del tiempo simulado
+{
+};
+
+typedef struct // Evento externo programado: disparo del PIR o petición de backfill del gateway
+{
+  int64_t instanteUs;
+  bool presencia;
+} EventoExterno;
+
+int64_t relojUs = 0;        // esp_timer_get_time() simulado
+int64_t finUs = 0;
+uint32_t notificacionesPendientes = 0;
+std::vector<EventoExterno> eventosExternos; // Ordenados por instante
+size_t siguienteEvento = 0;
+TaskFunction_t funcionTarea = NULL;
+void *parametroTarea = NULL;
+void atenderEvento(const EventoExterno &evento);
+
+int64_t esp_timer_get_time() { return relojUs; }
+
+BaseType_t xTaskCreate(TaskFunction_t funcion, const char *, uint32_t, void *parametro, UBaseType_t, TaskHandle_t *tarea)
+{
+  funcionTarea = funcion;
+  parametroTarea = parametro;
+  *tarea = &funcionTarea;
+  return pdPASS;
+}
+
+BaseType_t xTaskNotify(TaskHandle_t, uint32_t eventos, eNotifyAction)
+{
+  notificacionesPendientes |= eventos;
+  return pdPASS;
+}
+
+BaseType_t xTaskNotifyFromISR(TaskHandle_t tarea, uint32_t eventos, eNotifyAction accion, BaseType_t *)
+{
+  return xTaskNotify(tarea, eventos, accion);
+}
+
+// Avanza el reloj hasta el timeout o hasta el siguiente evento externo, lo que llegue antes
+BaseType_t xTaskNotifyWait(uint32_t, uint32_t, uint32_t *eventos, TickType_t ticks)
+{
+  while (notificacionesPendientes == 0)
+  {
+    int64_t limite = ticks == portMAX_DELAY ? INT64_MAX : relojUs + (int64_t)ticks * portTICK_PERIOD_MS * 1000;
+    int64_t proximoEvento = siguienteEvento < eventosExternos.size() ? eventosExternos[siguienteEvento].instanteUs : INT64_MAX;
+    if (finUs <= limite && finUs <= proximoEvento)
+    {
+      relojUs = finUs;
+      throw FinSimulacion();
+    }
+    if (limite <= proximoEvento)
+    {
+      relojUs = limite;
+      *eventos = 0;
+      return pdFALSE;
+    }
+    ticks = (TickType_t)((limite - proximoEvento) / (portTICK_PERIOD_MS * 1000));
+    relojUs = proximoEvento;
+    atenderEvento(eventosExternos[siguienteEvento++]);
+  }
+  *eventos = notificacionesPendientes;
+  notificacionesPendientes = 0;
+  return pdTRUE;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t) { return 0; }
+
+struct
+{
+  void printf(const char *formato, ...)
+  {
+    va_list argumentos;
+    va_start(argumentos, formato);
+    vprintf(formato, argumentos);
+    va_end(argumentos);
+  }
+} Serial;
+
+struct // En el host no hay heap del ESP32 que medir
+{
+  uint32_t getFreeHeap() { return 0; }
+  uint32_t getMinFreeHeap() { return 0; }
+} ESP;
+
+#include "scheduler.h"
+
+// Como en src/main.cpp
+#define BACKFILL_INTERVAL_MS 200
+#define PERIODO_MUESTREO_MS 20000
+#define PERIODO_ESTADO_MS 60000
+#define PERIODO_RTC_MS 60000
+#define PERIODO_INFORME_MS 300000
+#define EVENTO_PRESENCIA (1 << 0)
+#define EVENTO_BACKFILL (1 << 1)
+
+typedef struct // Opciones de la línea de comandos
+{
+  double horas = 1;
+  long presencias = 0; // Por hora
+  long backfills = 0;  // Por hora
+  long batches = 5;    // Batches de cada backfill
+} Opciones;
+
+Opciones opciones;
+Planificador planificador;
+int idBackfill = -1;
+long batchesPendientes = 0; // Batches de backfill por enviar, de todas las peticiones recibidas
+
+void atenderEvento(const EventoExterno &evento)
+{
+  if (evento.presencia)
+  {
+    planificador.notificarDesdeISR(EVENTO_PRESENCIA);
+    return;
+  }
+  batchesPendientes += opciones.batches;
+  planificador.notificar(EVENTO_BACKFILL);
+}
+
+// Un batch por ejecución; sin nada pendiente se desactiva, como backfill_streamer()
+void backfillSimulado()
+{
+  if (batchesPendientes == 0)
+  {
+    planificador.desactivar(idBackfill);
+    return;
+  }
+  batchesPendientes--;
+}
+
+void sinTrabajo() {}
+
+void programarEventos(long porHora, bool presencia)
+{
+  if (porHora <= 0)
+    return;
+  int64_t intervaloUs = 3600000000LL / porHora;
+  for (int64_t t = intervaloUs / 2; t < finUs; t += intervaloUs)
+    eventosExternos.push_back(EventoExterno{t, presencia});
+}
+
+// Las siete tareas de antes: cada vTaskDelay es un despertar, y la de backfill despierta además al recibir cada petición
+uint64_t despertaresAntes()
+{
+  static const uint32_t periodosMs[] = {
+      20000, // temperature_humidity_updater
+      20000, // analog_potentiometer_updater
+      1000,  // verificarYenviarDatos
+      60000, // internal_RTC_updater
+      1000,  // presence_updater
+      60000, // board_status_updater
+  };
+  uint64_t despertares = 0;
+  for (uint32_t periodoMs : periodosMs)
+    despertares += finUs / ((int64_t)periodoMs * 1000);
+  for (const EventoExterno &evento : eventosExternos)
+  {
+    if (!evento.presencia)
+      despertares += 1 + opciones.batches;
+  }
+  return despertares;
+}
+
+bool leerOpciones(int argc, char **argv)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--horas") == 0 && i + 1 < argc)
+      opciones.horas = atof(argv[++i]);
+    else if (strcmp(argv[i], "--presencias") == 0 && i + 1 < argc)
+      opciones.presencias = atol(argv[++i]);
+    else if (strcmp(argv[i], "--backfills") == 0 && i + 1 < argc)
+      opciones.backfills = atol(argv[++i]);
+    else if (strcmp(argv[i], "--batches") == 0 && i + 1 < argc)
+      opciones.batches = atol(argv[++i]);
+    else
+      return false;
+  }
+  return opciones.horas > 0 && opciones.presencias >= 0 && opciones.backfills >= 0 && opciones.batches > 0;
+}
+
+int main(int argc, char **argv)
+{
+  if (!leerOpciones(argc, argv))
+  {
+    fprintf(stderr, "uso: %s [--horas N] [--presencias N] [--backfills N] [--batches N]\n", argv[0]);
+    return 2;
+  }
+
+  finUs = (int64_t)(opciones.horas * 3600e6);
+  programarEventos(opciones.presencias, true);
+  programarEventos(opciones.backfills, false);
+  std::sort(eventosExternos.begin(), eventosExternos.end(),
+            [](const EventoExterno &a, const EventoExterno &b) { return a.instanteUs < b.instanteUs; });
+
+  // La misma tabla que setup()
+  planificador.agregar("Sensores", sinTrabajo, PERIODO_MUESTREO_MS, 1000);
+  planificador.agregar("Delta", sinTrabajo, PERIODO_MUESTREO_MS, 1000);
+  planificador.agregar("RTC", sinTrabajo, PERIODO_RTC_MS, 5000);
+  planificador.agregar("Estado", sinTrabajo, PERIODO_ESTADO_MS, 5000);
+  planificador.agregar("Presencia", sinTrabajo, 0, 0, EVENTO_PRESENCIA);
+  idBackfill = planificador.agregar("Backfill", backfillSimulado, BACKFILL_INTERVAL_MS, 0, EVENTO_BACKFILL, false);
+  planificador.agregar("Informe", sinTrabajo, PERIODO_INFORME_MS, 30000);
+  planificador.arrancar("Planificador", 4096, 1);
+
+  try
+  {
+    funcionTarea(parametroTarea);
+  }
+  catch (const FinSimulacion &)
+  {
+  }
+
+  uint64_t antes = despertaresAntes();
+  printf("Simulados %.2f h, %ld presencias/h, %ld backfills/h de %ld batches\n", opciones.horas, opciones.presencias,
+         opciones.backfills, opciones.batches);
+  printf("Antes (7 tareas con vTaskDelay): %llu despertares (%.0f/h)\n", (unsigned long long)antes, antes / opciones.horas);
+  printf("Planificador: %u despertares (%.0f/h)\n\n", (unsigned)planificador.despertares(),
+         planificador.despertares() / opciones.horas);
+  planificador.informe();
+  return 0;
+}
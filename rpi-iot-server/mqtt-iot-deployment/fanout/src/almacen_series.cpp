@@ -0,0 +1,36 @@
+#include "almacen_series.h"
+
+bool AlmacenSeries::guardar(const MensajePtr &mensaje)
+{
+  auto it = series.find(mensaje->serie);
+  if (it == series.end())
+  {
+    if (series.size() >= maxSeries)
+    {
+      rechazadas++;
+      return false;
+    }
+    it = series.emplace(mensaje->serie, Anillo()).first;
+    it->second.puntos.resize(puntosPorSerie);
+  }
+
+  Anillo &anillo = it->second;
+  anillo.puntos[anillo.siguiente] = mensaje;
+  anillo.siguiente = (anillo.siguiente + 1) % puntosPorSerie;
+  if (anillo.total < puntosPorSerie)
+    anillo.total++;
+  return true;
+}
+
+void AlmacenSeries::recorrer(const std::function<bool(const std::string &)> &seleccionar, const std::function<void(const MensajePtr &)> &visitar) const
+{
+  for (const auto &serie : series)
+  {
+    if (!seleccionar(serie.first))
+      continue;
+    const Anillo &anillo = serie.second;
+    size_t primero = (anillo.siguiente + puntosPorSerie - anillo.total) % puntosPorSerie;
+    for (size_t i = 0; i < anillo.total; i++)
+      visitar(anillo.puntos[(primero + i) % puntosPorSerie]);
+  }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "mensaje.h"
+
+// Últimos puntos de cada serie, para que un dashboard que se conecta tenga historia reciente sin ir al broker.
+// La memoria está acotada: como mucho maxSeries series de puntosPorSerie mensajes cada una.
+class AlmacenSeries
+{
+public:
+  AlmacenSeries(size_t puntosPorSerie, size_t maxSeries) : puntosPorSerie(puntosPorSerie), maxSeries(maxSeries) {}
+
+  // Guarda el mensaje en el anillo de su serie. Devuelve false si es una serie nueva y ya no caben más.
+  bool guardar(const MensajePtr &mensaje);
+
+  // Recorre, en orden de llegada, los puntos de las series cuyo nombre cumple el predicado
+  void recorrer(const std::function<bool(const std::string &)> &seleccionar, const std::function<void(const MensajePtr &)> &visitar) const;
+
+  size_t numSeries() const { return series.size(); }
+  size_t seriesRechazadas() const { return rechazadas; }
+
+private:
+  struct Anillo
+  {
+    std::vector<MensajePtr> puntos; // Reservado una vez con puntosPorSerie huecos
+    size_t siguiente = 0;           // Posición en la que se escribirá el próximo punto
+    size_t total = 0;               // Puntos guardados (hasta puntosPorSerie)
+  };
+
+  size_t puntosPorSerie;
+  size_t maxSeries;
+  size_t rechazadas = 0;
+  std::unordered_map<std::string, Anillo> series;
+};
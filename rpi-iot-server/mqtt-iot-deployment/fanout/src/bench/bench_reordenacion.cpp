@@ -0,0 +1,251 @@
+// Benchmark de la etapa de reordenación con un tráfico sintético parecido al del gateway: cada nodo toma una lectura
+// cada 20 s y la envía en batches de 10, que el gateway publica como 3 series (temperatura, humedad, potenciómetro).
+// Una parte de los batches llega tarde por los reintentos del backlog del gateway y otra mucho más tarde por backfill.
+// El reloj es simulado, así que los resultados de retención y tardíos son reproducibles; el throughput se mide con el
+// reloj real sobre los mensajes ya codificados. La retención es lo que tarda un punto en entrar en el histórico: el
+// directo no pasa por la reordenación, y de él solo se mide qué parte sale como "tarde" (por detrás de su serie).
+//
+//   cmake --build build --target bench_reordenacion
+//   build/bench_reordenacion [--nodos N] [--horas H] [--puntos N] [--ventanas ms,...] [--inactividades ms,...]
+//
+// Se ejecuta una pasada por cada combinación de ventana e inactividad: la ventana corrige el desorden entre batches
+// que llegan seguidos y la inactividad decide cuándo la marca de agua de una serie parada empieza a seguir al reloj.
+// Al final se repite la pasada con la configuración por defecto del servicio: devuelve 1 si no reordena nada (la
+// ventana no cubre el desorden del tráfico) o si algún mensaje sale desordenado.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "../mensaje.h"
+#include "../reordenacion.h"
+
+#define PERIODO_LECTURA_MS 20000 // Como PERIODO_MUESTREO_MS en sensor.node.esp32
+#define LECTURAS_BATCH 10        // Como LECTURAS_POR_BATCH
+#define INICIO_MS 1700000000000LL
+
+typedef struct // Opciones de la línea de comandos
+{
+  int nodos = 20;
+  double horas = 6;
+  size_t puntos = 64;
+  std::vector<int64_t> ventanas = {0, 60000, 120000, 300000, 600000};
+  std::vector<int64_t> inactividades = {2000, 60000, 600000};
+} Opciones;
+
+typedef struct // Mensaje del tráfico sintético, ya codificado, con su instante de llegada al servidor
+{
+  int64_t llegadaMs;
+  MensajePtr mensaje;
+} Llegada;
+
+typedef struct // Resultado de una pasada con una ventana y una inactividad
+{
+  EstadisticasReordenacion contadores;
+  std::vector<int64_t> retencionMs; // Llegada -> emisión de los mensajes emitidos en orden
+  std::vector<int64_t> extremoMs;   // Tiempo de evento -> emisión (extremo a extremo desde la lectura)
+  size_t maxRetenidos = 0;
+  size_t tardeDirecto = 0;          // Mensajes repartidos en directo como "tarde", como en ServidorFanout::repartirEntrantes
+  size_t desordenados = 0;          // Mensajes emitidos con tiempo de evento menor que el anterior de su serie (debe ser 0)
+  double segundos = 0;              // Tiempo real de la pasada
+} Resultado;
+
+static bool leerLista(char *texto, std::vector<int64_t> &valores)
+{
+  valores.clear();
+  for (char *valor = strtok(texto, ","); valor != nullptr; valor = strtok(nullptr, ","))
+    valores.push_back(atol(valor));
+  return !valores.empty();
+}
+
+static bool leerOpciones(int argc, char **argv, Opciones &opciones)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--nodos") == 0 && i + 1 < argc)
+      opciones.nodos = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--horas") == 0 && i + 1 < argc)
+      opciones.horas = atof(argv[++i]);
+    else if (strcmp(argv[i], "--puntos") == 0 && i + 1 < argc)
+      opciones.puntos = atol(argv[++i]);
+    else if (strcmp(argv[i], "--ventanas") == 0 && i + 1 < argc)
+    {
+      if (!leerLista(argv[++i], opciones.ventanas))
+        return false;
+    }
+    else if (strcmp(argv[i], "--inactividades") == 0 && i + 1 < argc)
+    {
+      if (!leerLista(argv[++i], opciones.inactividades))
+        return false;
+    }
+    else
+      return false;
+  }
+  return opciones.nodos > 0 && opciones.horas > 0 && opciones.puntos > 0;
+}
+
+static std::vector<Llegada> generarTrafico(const Opciones &opciones)
+{
+  static const char *tipos[] = {"temperature", "humidity", "potentiometer"};
+  std::mt19937 aleatorio(12345);
+  std::uniform_real_distribution<double> uniforme(0, 1);
+  std::vector<Llegada> trafico;
+
+  int64_t duracionMs = (int64_t)(opciones.horas * 3600 * 1000);
+  for (int nodo = 0; nodo < opciones.nodos; nodo++)
+  {
+    char mac[16];
+    snprintf(mac, sizeof(mac), "24a160%06x", nodo);
+    int64_t desfase = (int64_t)(uniforme(aleatorio) * PERIODO_LECTURA_MS); // Los nodos no arrancan a la vez
+    uint32_t seq = 0;
+
+    for (int64_t inicioBatch = desfase; inicioBatch < duracionMs; inicioBatch += PERIODO_LECTURA_MS * LECTURAS_BATCH)
+    {
+      int64_t envio = inicioBatch + (LECTURAS_BATCH - 1) * PERIODO_LECTURA_MS;
+      double azar = uniforme(aleatorio);
+      int64_t llegada = envio + (int64_t)(uniforme(aleatorio) * 500);        // Radio, colas del gateway y broker
+      if (azar < 0.01)
+        llegada += 300000 + (int64_t)(uniforme(aleatorio) * 1500000);       // Perdido y recuperado por backfill
+      else if (azar < 0.06)
+        llegada += 5000 + (int64_t)(uniforme(aleatorio) * 295000);          // Reintentado desde el backlog del gateway
+
+      for (int i = 0; i < LECTURAS_BATCH; i++, seq++)
+      {
+        int64_t eventoMs = INICIO_MS + inicioBatch + i * PERIODO_LECTURA_MS;
+        for (int t = 0; t < 3; t++)
+        {
+          char topic[96], payload[96];
+          snprintf(topic, sizeof(topic), "/gateway.node.esp32/%s/%s", tipos[t], mac);
+          snprintf(payload, sizeof(payload), "{\"valor\": %.2f, \"timestamp\": %lld, \"seq\": %u}",
+                   20 + 5 * uniforme(aleatorio), (long long)(eventoMs / 1000), (unsigned)seq);
+          int64_t recibido = INICIO_MS + llegada + i; // El gateway publica el batch de seguido
+          trafico.push_back(Llegada{recibido, codificarMensaje(topic, payload, recibido)});
+        }
+      }
+    }
+  }
+
+  std::stable_sort(trafico.begin(), trafico.end(), [](const Llegada &a, const Llegada &b) { return a.llegadaMs < b.llegadaMs; });
+  return trafico;
+}
+
+static Resultado ejecutar(const std::vector<Llegada> &trafico, const Opciones &opciones, int64_t ventanaMs, int64_t inactividadMs)
+{
+  Resultado resultado;
+  int64_t ahora = 0; // Reloj simulado: instante en que se está emitiendo
+  std::unordered_map<std::string, int64_t> ultimoEmitido;
+
+  ConfigReordenacion config;
+  config.ventanaMs = ventanaMs;
+  config.inactividadMs = inactividadMs;
+  config.puntosPorSerie = opciones.puntos;
+  config.maxSeries = opciones.nodos * 3;
+
+  Reordenador reordenador(
+      config,
+      [&](const std::vector<MensajePtr> &tramo)
+      {
+        int64_t &ultimo = ultimoEmitido.emplace(tramo.front()->serie, INT64_MIN).first->second;
+        for (const MensajePtr &mensaje : tramo)
+        {
+          if (mensaje->eventoMs < ultimo)
+            resultado.desordenados++;
+          ultimo = mensaje->eventoMs;
+          resultado.retencionMs.push_back(ahora - mensaje->recibidoMs);
+          resultado.extremoMs.push_back(ahora - mensaje->eventoMs);
+        }
+      },
+      [](const std::vector<MensajePtr> &) {});
+
+  // El servidor llama a avanzar() en cada despertar, como mucho cada inactividad / 4 con mensajes retenidos
+  int64_t tick = std::max<int64_t>(10, std::min<int64_t>(1000, inactividadMs / 4));
+  int64_t siguienteTick = trafico.empty() ? 0 : trafico.front().llegadaMs;
+
+  auto inicio = std::chrono::steady_clock::now();
+  for (const Llegada &llegada : trafico)
+  {
+    while (reordenador.hayRetenidos() && siguienteTick < llegada.llegadaMs)
+    {
+      ahora = siguienteTick;
+      reordenador.avanzar(ahora);
+      siguienteTick += tick;
+    }
+    ahora = llegada.llegadaMs;
+    if (siguienteTick < ahora)
+      siguienteTick = ahora + tick;
+    if (llegada.mensaje->eventoMs < reordenador.masReciente(llegada.mensaje->serie))
+      resultado.tardeDirecto++;
+    reordenador.insertar(llegada.mensaje, ahora);
+    resultado.maxRetenidos = std::max(resultado.maxRetenidos, reordenador.estadisticas().retenidos);
+  }
+  while (reordenador.hayRetenidos())
+  {
+    ahora = siguienteTick;
+    reordenador.avanzar(ahora);
+    siguienteTick += tick;
+  }
+  resultado.segundos = std::chrono::duration<double>(std::chrono::steady_clock::now() - inicio).count();
+  resultado.contadores = reordenador.estadisticas();
+  return resultado;
+}
+
+static int64_t percentil(std::vector<int64_t> &valores, double p)
+{
+  if (valores.empty())
+    return 0;
+  size_t i = std::min(valores.size() - 1, (size_t)(p * (valores.size() - 1)));
+  std::nth_element(valores.begin(), valores.begin() + i, valores.end());
+  return valores[i];
+}
+
+int main(int argc, char **argv)
+{
+  Opciones opciones;
+  if (!leerOpciones(argc, argv, opciones))
+  {
+    fprintf(stderr, "uso: %s [--nodos N] [--horas H] [--puntos N] [--ventanas ms,...] [--inactividades ms,...]\n", argv[0]);
+    return 2;
+  }
+
+  std::vector<Llegada> trafico = generarTrafico(opciones);
+  printf("Trafico: %d nodos, %.1f h simuladas, %zu mensajes en %d series, %zu puntos por serie\n\n",
+         opciones.nodos, opciones.horas, trafico.size(), opciones.nodos * 3, opciones.puntos);
+  printf("%8s %8s %9s %8s %8s %8s %8s | %-26s | %-20s | %8s %10s\n", "ventana", "inactiv.", "en orden", "reord.", "tardios",
+         "forzados", "desord.", "historico p50/p99/max (s)", "extremo p50/p99 (s)", "max ret.", "msg/s");
+
+  int codigo = 0;
+  for (int64_t inactividadMs : opciones.inactividades)
+  {
+    for (int64_t ventanaMs : opciones.ventanas)
+    {
+      Resultado r = ejecutar(trafico, opciones, ventanaMs, inactividadMs);
+      double total = (double)trafico.size();
+      printf("%7.0fs %7.0fs %8.2f%% %7.2f%% %7.2f%% %8llu %8zu | %7.1f %7.1f %9.1f | %8.1f %10.1f | %8zu %10.0f\n",
+             ventanaMs / 1000.0, inactividadMs / 1000.0, 100.0 * r.contadores.enOrden / total, 100.0 * r.contadores.reordenados / total,
+             100.0 * r.contadores.tardios / total, (unsigned long long)r.contadores.forzados, r.desordenados,
+             percentil(r.retencionMs, 0.50) / 1000.0, percentil(r.retencionMs, 0.99) / 1000.0, percentil(r.retencionMs, 1.0) / 1000.0,
+             percentil(r.extremoMs, 0.50) / 1000.0, percentil(r.extremoMs, 0.99) / 1000.0,
+             r.maxRetenidos, total / r.segundos);
+      if (r.desordenados > 0)
+        codigo = 1;
+    }
+  }
+
+  ConfigReordenacion porDefecto;
+  Resultado r = ejecutar(trafico, opciones, porDefecto.ventanaMs, porDefecto.inactividadMs);
+  printf("\nConfiguracion por defecto (ventana %.0f s, inactividad %.0f s): %.2f%% reordenados, %.2f%% tardios\n",
+         porDefecto.ventanaMs / 1000.0, porDefecto.inactividadMs / 1000.0, 100.0 * r.contadores.reordenados / trafico.size(),
+         100.0 * r.contadores.tardios / trafico.size());
+  printf("Directo: sin retencion, %.2f%% repartido como tarde\n", 100.0 * r.tardeDirecto / trafico.size());
+  if (r.contadores.reordenados == 0 || r.desordenados > 0)
+  {
+    printf("La configuracion por defecto no reordena el trafico\n");
+    codigo = 1;
+  }
+  return codigo;
+}
@@ -0,0 +1,209 @@
+#include "cliente_mqtt.h"
+
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#define MQTT_CONNECT 0x10
+#define MQTT_CONNACK 0x20
+#define MQTT_PUBLISH 0x30
+#define MQTT_PUBACK 0x40
+#define MQTT_SUBSCRIBE 0x82
+#define MQTT_SUBACK 0x90
+#define MQTT_PINGREQ 0xC0
+#define MQTT_MAX_PAQUETE (1024 * 1024) // Paquetes mayores se consideran un error de protocolo
+
+static void escribirLongitud(std::string &paquete, size_t longitud) // "Remaining length" de la cabecera fija
+{
+  do
+  {
+    uint8_t octeto = longitud % 128;
+    longitud /= 128;
+    paquete.push_back((char)(octeto | (longitud > 0 ? 0x80 : 0)));
+  } while (longitud > 0);
+}
+
+static void escribirCadena(std::string &destino, const std::string &cadena)
+{
+  destino.push_back((char)(cadena.size() >> 8));
+  destino.push_back((char)(cadena.size() & 0xFF));
+  destino += cadena;
+}
+
+static std::string paquete(uint8_t cabecera, const std::string &cuerpo)
+{
+  std::string resultado(1, (char)cabecera);
+  escribirLongitud(resultado, cuerpo.size());
+  return resultado + cuerpo;
+}
+
+void ClienteMqtt::ejecutar(const Callback &alRecibir, const std::atomic<bool> &activo)
+{
+  while (activo)
+  {
+    if (!conectar())
+    {
+      cerrar();
+      std::this_thread::sleep_for(std::chrono::seconds(5));
+      continue;
+    }
+    fprintf(stderr, "Suscrito a %s en %s:%d\n", config.filtro.c_str(), config.host.c_str(), config.puerto);
+
+    uint8_t cabecera;
+    std::string cuerpo;
+    while (activo && leerPaquete(cabecera, cuerpo, activo))
+    {
+      if ((cabecera & 0xF0) != MQTT_PUBLISH || cuerpo.size() < 2)
+        continue;
+
+      size_t longitudTopic = ((uint8_t)cuerpo[0] << 8) | (uint8_t)cuerpo[1];
+      int qos = (cabecera >> 1) & 0x03;
+      size_t inicioPayload = 2 + longitudTopic + (qos > 0 ? 2 : 0);
+      if (inicioPayload > cuerpo.size())
+        break;
+
+      if (qos == 1) // El broker puede bajar la QoS pero no subirla; se confirma por si acaso
+        enviar(paquete(MQTT_PUBACK, cuerpo.substr(2 + longitudTopic, 2)));
+
+      alRecibir(cuerpo.substr(2, longitudTopic), cuerpo.substr(inicioPayload));
+    }
+    fprintf(stderr, "Conexion con el broker perdida\n");
+    cerrar();
+  }
+}
+
+bool ClienteMqtt::conectar()
+{
+  addrinfo pista = {}, *direcciones = nullptr;
+  pista.ai_family = AF_UNSPEC;
+  pista.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(config.host.c_str(), std::to_string(config.puerto).c_str(), &pista, &direcciones) != 0)
+    return false;
+
+  // Con SO_SNDTIMEO, en Linux connect() y send() tampoco esperan más de esperaConexion
+  timeval espera = {config.esperaConexion, 0};
+  for (addrinfo *d = direcciones; d != nullptr && fd < 0; d = d->ai_next)
+  {
+    fd = socket(d->ai_family, d->ai_socktype, d->ai_protocol);
+    if (fd >= 0 && (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &espera, sizeof(espera)) != 0 ||
+                    connect(fd, d->ai_addr, d->ai_addrlen) != 0))
+      cerrar();
+  }
+  freeaddrinfo(direcciones);
+  if (fd < 0)
+    return false;
+
+  std::string connect;
+  escribirCadena(connect, "MQTT");
+  connect.push_back(4); // MQTT 3.1.1
+  uint8_t flags = 0x02; // Clean session
+  if (!config.usuario.empty())
+    flags |= 0x80;
+  if (!config.password.empty())
+    flags |= 0x40;
+  connect.push_back((char)flags);
+  connect.push_back((char)(config.keepAlive >> 8));
+  connect.push_back((char)(config.keepAlive & 0xFF));
+  escribirCadena(connect, config.clientId);
+  if (!config.usuario.empty())
+    escribirCadena(connect, config.usuario);
+  if (!config.password.empty())
+    escribirCadena(connect, config.password);
+
+  // Un broker que acepta el TCP pero no responde cuenta como conexión fallida: se cierra y se reintenta
+  auto limite = std::chrono::steady_clock::now() + std::chrono::seconds(config.esperaConexion);
+  std::atomic<bool> siempre(true);
+  uint8_t cabecera;
+  std::string cuerpo;
+  if (!enviar(paquete(MQTT_CONNECT, connect)) || !leerPaquete(cabecera, cuerpo, siempre, limite) ||
+      cabecera != MQTT_CONNACK || cuerpo.size() != 2 || cuerpo[1] != 0)
+  {
+    fprintf(stderr, "El broker ha rechazado la conexion o no ha respondido\n");
+    return false;
+  }
+
+  std::string subscribe = {0, 1}; // Packet id 1
+  escribirCadena(subscribe, config.filtro);
+  subscribe.push_back(0); // QoS 0
+  if (!enviar(paquete(MQTT_SUBSCRIBE, subscribe)) || !leerPaquete(cabecera, cuerpo, siempre, limite) || cabecera != MQTT_SUBACK)
+  {
+    fprintf(stderr, "El broker no ha confirmado la suscripcion\n");
+    return false;
+  }
+  return true;
+}
+
+bool ClienteMqtt::enviar(const std::string &datos)
+{
+  size_t enviados = 0;
+  while (enviados < datos.size())
+  {
+    ssize_t n = send(fd, datos.data() + enviados, datos.size() - enviados, MSG_NOSIGNAL);
+    if (n <= 0)
+      return false;
+    enviados += n;
+  }
+  ultimoEnvio = std::chrono::steady_clock::now();
+  return true;
+}
+
+// Lee un paquete completo; entre paquetes envía PINGREQ para que el broker no cierre la conexión. Falla si el paquete
+// no ha terminado de llegar en limite.
+bool ClienteMqtt::leerPaquete(uint8_t &cabecera, std::string &cuerpo, const std::atomic<bool> &activo,
+                              std::chrono::steady_clock::time_point limite)
+{
+  auto leer = [&](void *destino, size_t len) -> bool
+  {
+    size_t leidos = 0;
+    while (leidos < len)
+    {
+      pollfd p = {fd, POLLIN, 0};
+      int listo = poll(&p, 1, 1000);
+      if (!activo || listo < 0 || std::chrono::steady_clock::now() >= limite)
+        return false;
+      // El keep alive cuenta lo que envía el cliente, no lo que recibe: aunque lleguen publicaciones hay que hacer ping
+      if (std::chrono::steady_clock::now() - ultimoEnvio > std::chrono::seconds(config.keepAlive / 2) &&
+          !enviar(std::string{(char)MQTT_PINGREQ, 0}))
+        return false;
+      if (listo == 0)
+        continue;
+      ssize_t n = recv(fd, (char *)destino + leidos, len - leidos, 0);
+      if (n <= 0)
+        return false;
+      leidos += n;
+    }
+    return true;
+  };
+
+  if (!leer(&cabecera, 1))
+    return false;
+
+  size_t longitud = 0;
+  for (int desplazamiento = 0;; desplazamiento += 7)
+  {
+    uint8_t octeto;
+    if (desplazamiento > 21 || !leer(&octeto, 1))
+      return false;
+    longitud |= (size_t)(octeto & 0x7F) << desplazamiento;
+    if (!(octeto & 0x80))
+      break;
+  }
+  if (longitud > MQTT_MAX_PAQUETE)
+    return false;
+
+  cuerpo.resize(longitud);
+  return longitud == 0 || leer(&cuerpo[0], longitud);
+}
+
+void ClienteMqtt::cerrar()
+{
+  if (fd >= 0)
+    close(fd);
+  fd = -1;
+}
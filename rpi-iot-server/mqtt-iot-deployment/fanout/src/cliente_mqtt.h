@@ -0,0 +1,42 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+
+typedef struct // Configuración de la suscripción al broker
+{
+  std::string host = "mosquitto";
+  int puerto = 1883;
+  std::string usuario;
+  std::string password;
+  std::string filtro = "#"; // Filtro de la única suscripción que se mantiene con el broker
+  std::string clientId = "fanout";
+  int keepAlive = 30;       // Segundos
+  int esperaConexion = 10;  // Segundos máximos para conectar y recibir CONNACK y SUBACK
+} ConfigMqtt;
+
+// Cliente MQTT 3.1.1 mínimo, solo de suscripción con QoS 0. Mantiene una única conexión con el broker para todos
+// los clientes del fan-out y se reconecta solo si se cae.
+class ClienteMqtt
+{
+public:
+  using Callback = std::function<void(const std::string &topic, const std::string &payload)>;
+
+  explicit ClienteMqtt(const ConfigMqtt &config) : config(config) {}
+
+  // Bucle de conexión y recepción; vuelve cuando activo pasa a false
+  void ejecutar(const Callback &alRecibir, const std::atomic<bool> &activo);
+
+private:
+  bool conectar();
+  bool enviar(const std::string &paquete);
+  bool leerPaquete(uint8_t &cabecera, std::string &cuerpo, const std::atomic<bool> &activo,
+                   std::chrono::steady_clock::time_point limite = std::chrono::steady_clock::time_point::max());
+  void cerrar();
+
+  ConfigMqtt config;
+  int fd = -1;
+  std::chrono::steady_clock::time_point ultimoEnvio; // Último paquete enviado al broker, para el keep alive
+};
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+
+// Comprueba si un topic cumple un filtro con los comodines de MQTT: '+' sustituye a un nivel y '#' (al final) al resto
+inline bool cumpleFiltro(const std::string &filtro, const std::string &topic)
+{
+  size_t f = 0, t = 0;
+  while (f < filtro.size())
+  {
+    size_t finFiltro = filtro.find('/', f);
+    if (finFiltro == std::string::npos)
+      finFiltro = filtro.size();
+    std::string nivel = filtro.substr(f, finFiltro - f);
+
+    if (nivel == "#")
+      return true;
+    if (t > topic.size())
+      return false;
+
+    size_t finTopic = topic.find('/', t);
+    if (finTopic == std::string::npos)
+      finTopic = topic.size();
+    if (nivel != "+" && nivel != topic.substr(t, finTopic - t))
+      return false;
+
+    f = finFiltro + 1;
+    t = finTopic + 1;
+  }
+  return t > topic.size() && f > filtro.size();
+}
@@ -0,0 +1,82 @@
+// Servicio de fan-out: mantiene una única suscripción con Mosquitto y reparte los mensajes a muchos dashboards
+// por Server-Sent Events (GET /events) o WebSocket (GET /ws), con filtros de topic (?filtro=/red/temperature/+).
+// El directo sale en cuanto llega; el histórico de cada serie se reordena por tiempo de evento. GET /stats devuelve los contadores del servicio.
+// La configuración se lee de variables de entorno.
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include "almacen_series.h"
+#include "cliente_mqtt.h"
+#include "mensaje.h"
+#include "servidor_fanout.h"
+
+static std::atomic<bool> activo(true);
+
+static std::string entorno(const char *nombre, const char *defecto)
+{
+  const char *valor = getenv(nombre);
+  return valor != nullptr ? valor : defecto;
+}
+
+static long entornoNumero(const char *nombre, long defecto)
+{
+  const char *valor = getenv(nombre);
+  return valor != nullptr ? atol(valor) : defecto;
+}
+
+int main()
+{
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, [](int) { activo = false; });
+  signal(SIGTERM, [](int) { activo = false; });
+
+  ConfigMqtt configMqtt;
+  configMqtt.host = entorno("MQTT_HOST", "mosquitto");
+  configMqtt.puerto = entornoNumero("MQTT_PORT", 1883);
+  configMqtt.usuario = entorno("MQTT_USER", "");
+  configMqtt.password = entorno("MQTT_PASSWORD", "");
+  configMqtt.filtro = entorno("MQTT_TOPIC", "#");
+  configMqtt.clientId = entorno("MQTT_CLIENT_ID", "fanout");
+
+  ConfigServidor configServidor;
+  configServidor.puerto = entornoNumero("HTTP_PORT", 8080);
+  configServidor.maxClientes = entornoNumero("MAX_CLIENTES", 256);
+  configServidor.colaSubmuestreoBytes = entornoNumero("COLA_SUBMUESTREO_BYTES", 256 * 1024);
+  configServidor.colaExpulsionBytes = entornoNumero("COLA_EXPULSION_BYTES", 1024 * 1024);
+  configServidor.timeoutLentoMs = entornoNumero("TIMEOUT_LENTO_MS", 15000);
+
+  ConfigReordenacion configReordenacion;
+  configReordenacion.ventanaMs = entornoNumero("VENTANA_REORDENACION_MS", 300000);
+  configReordenacion.inactividadMs = entornoNumero("INACTIVIDAD_REORDENACION_MS", 2000);
+  configReordenacion.puntosPorSerie = entornoNumero("PUNTOS_REORDENACION", 64);
+  configReordenacion.maxSeries = entornoNumero("MAX_SERIES", 4096);
+
+  long puntosPorSerie = entornoNumero("PUNTOS_POR_SERIE", 64);
+  if (puntosPorSerie <= 0) // El anillo de cada serie se indexa módulo puntosPorSerie
+  {
+    fprintf(stderr, "PUNTOS_POR_SERIE tiene que ser mayor que 0\n");
+    return 1;
+  }
+
+  AlmacenSeries almacen(puntosPorSerie, configReordenacion.maxSeries);
+  ServidorFanout servidor(configServidor, configReordenacion, almacen);
+  if (!servidor.iniciar())
+    return 1;
+  fprintf(stderr, "Fan-out escuchando en el puerto %d\n", configServidor.puerto);
+
+  ClienteMqtt cliente(configMqtt);
+  std::thread hiloMqtt([&]()
+                       { cliente.ejecutar([&](const std::string &topic, const std::string &payload)
+                                          {
+                                            int64_t ahora = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                                std::chrono::system_clock::now().time_since_epoch()).count();
+                                            servidor.publicar(codificarMensaje(topic, payload, ahora)); },
+                                          activo); });
+
+  servidor.ejecutar(activo);
+  hiloMqtt.join();
+  return 0;
+}
@@ -0,0 +1,86 @@
+#include "mensaje.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include "websocket.h"
+
+static void escaparJson(std::string &destino, const std::string &texto)
+{
+  destino.push_back('"');
+  for (char c : texto)
+  {
+    if (c == '"' || c == '\\')
+    {
+      destino.push_back('\\');
+      destino.push_back(c);
+    }
+    else if ((unsigned char)c < 0x20)
+    {
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\u%04x", c);
+      destino += escape;
+    }
+    else
+    {
+      destino.push_back(c);
+    }
+  }
+  destino.push_back('"');
+}
+
+// Extrae el campo "timestamp" (segundos epoch, como lo publica el gateway) del payload
+static int64_t tiempoEvento(const std::string &payload, int64_t recibidoMs)
+{
+  size_t pos = payload.find("\"timestamp\"");
+  if (pos == std::string::npos)
+    return recibidoMs;
+  pos = payload.find_first_not_of(" :", pos + 11);
+  if (pos == std::string::npos)
+    return recibidoMs;
+
+  char *fin;
+  long long segundos = strtoll(payload.c_str() + pos, &fin, 10);
+  if (fin == payload.c_str() + pos || segundos <= 0) // Sin número, o nodo aún sin hora sincronizada
+    return recibidoMs;
+  return (int64_t)segundos * 1000;
+}
+
+static void completarCodificacion(Mensaje &mensaje, const std::string &json, const char *evento)
+{
+  mensaje.sse.clear();
+  if (evento != nullptr)
+    mensaje.sse = std::string("event: ") + evento + "\n";
+  mensaje.sse += "data: " + json + "\n\n";
+  mensaje.websocket = marcoWs(WS_OPCODE_TEXTO, json);
+}
+
+MensajePtr codificarMensaje(const std::string &topic, const std::string &payload, int64_t recibidoMs)
+{
+  auto mensaje = std::make_shared<Mensaje>();
+  mensaje->serie = topic;
+  mensaje->recibidoMs = recibidoMs;
+  mensaje->eventoMs = tiempoEvento(payload, recibidoMs);
+
+  // Los payloads del gateway y del publicador dummy ya son JSON y se incrustan tal cual; el resto va como cadena
+  std::string json = "{\"topic\":";
+  escaparJson(json, topic);
+  json += ",\"recibido\":" + std::to_string(recibidoMs) + ",\"payload\":";
+  bool esJson = !payload.empty() && (payload[0] == '{' || payload[0] == '[') && payload.find('\n') == std::string::npos;
+  if (esJson)
+    json += payload;
+  else
+    escaparJson(json, payload);
+  json += "}";
+
+  completarCodificacion(*mensaje, json, nullptr);
+  return mensaje;
+}
+
+MensajePtr marcarTardio(const MensajePtr &mensaje)
+{
+  auto tardio = std::make_shared<Mensaje>(*mensaje);
+  // El JSON se recupera del evento SSE ("data: " + json + "\n\n") y se le añade el campo al principio
+  std::string json = "{\"tarde\":true," + mensaje->sse.substr(7, mensaje->sse.size() - 9);
+  completarCodificacion(*tardio, json, "tarde");
+  return tardio;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Mensaje ya codificado para los clientes. Se codifica una sola vez al llegar del broker y todos los clientes
+// comparten el mismo objeto (shared_ptr), tanto en sus colas de salida como en el histórico de cada serie.
+struct Mensaje
+{
+  std::string serie;     // Topic MQTT del que viene; cada topic es una serie
+  int64_t recibidoMs;    // Instante de llegada al fan-out (epoch en milisegundos)
+  int64_t eventoMs;      // Tiempo de evento: el "timestamp" del payload o, si no lo tiene, recibidoMs
+  std::string sse;       // Evento Server-Sent Events listo para escribir en el socket
+  std::string websocket; // Marco WebSocket de texto listo para escribir en el socket
+};
+
+using MensajePtr = std::shared_ptr<const Mensaje>;
+
+MensajePtr codificarMensaje(const std::string &topic, const std::string &payload, int64_t recibidoMs);
+
+// Copia del mensaje para la ruta de datos tardíos: lleva "tarde":true en el JSON y, en SSE, el evento "tarde", para
+// que los dashboards que solo escuchan "message" no reciban puntos fuera de orden
+MensajePtr marcarTardio(const MensajePtr &mensaje);
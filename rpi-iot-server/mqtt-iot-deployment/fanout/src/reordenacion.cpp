@@ -0,0 +1,118 @@
+#include "reordenacion.h"
+
+#include <algorithm>
+
+void Reordenador::insertar(const MensajePtr &mensaje, int64_t ahoraMs)
+{
+  auto it = series.find(mensaje->serie);
+  if (it == series.end())
+  {
+    if (series.size() >= config.maxSeries)
+    {
+      contadores.sinReordenar++;
+      tramo.assign(1, mensaje);
+      ordenados(tramo);
+      tramo.clear();
+      return;
+    }
+    it = series.emplace(mensaje->serie, Serie()).first;
+    it->second.buffer.reserve(config.puntosPorSerie + 1);
+  }
+  Serie &serie = it->second;
+  serie.ultimaLlegadaMs = ahoraMs;
+
+  if (mensaje->eventoMs < serie.marcaAguaMs)
+  {
+    contadores.tardios++;
+    tramo.assign(1, mensaje);
+    tardios(tramo);
+    tramo.clear();
+    return;
+  }
+
+  if (mensaje->eventoMs >= serie.maxEventoMs)
+  {
+    contadores.enOrden++;
+    serie.maxEventoMs = mensaje->eventoMs;
+  }
+  else
+  {
+    contadores.reordenados++;
+  }
+
+  serie.buffer.push_back(Punto{mensaje->eventoMs, siguienteOrden++, mensaje});
+  std::push_heap(serie.buffer.begin(), serie.buffer.end(), posterior);
+  contadores.retenidos++;
+
+  int64_t marcaAgua = serie.maxEventoMs - config.ventanaMs;
+  if (serie.buffer.size() > config.puntosPorSerie) // Buffer lleno: la marca de agua avanza hasta el punto más antiguo
+  {
+    contadores.forzados++;
+    marcaAgua = std::max(marcaAgua, serie.buffer.front().eventoMs);
+  }
+  if (marcaAgua > serie.marcaAguaMs)
+    emitirHasta(serie, marcaAgua);
+}
+
+void Reordenador::avanzar(int64_t ahoraMs)
+{
+  if (contadores.retenidos == 0)
+    return;
+  for (auto &par : series)
+  {
+    Serie &serie = par.second;
+    // Como si el tiempo de evento de la serie siguiera avanzando al ritmo del reloj desde la última llegada
+    if (!serie.buffer.empty() && ahoraMs - serie.ultimaLlegadaMs >= config.inactividadMs)
+      emitirHasta(serie, serie.maxEventoMs - config.ventanaMs + (ahoraMs - serie.ultimaLlegadaMs));
+  }
+}
+
+void Reordenador::vaciar()
+{
+  for (auto &par : series)
+  {
+    if (!par.second.buffer.empty())
+      emitirHasta(par.second, par.second.maxEventoMs);
+  }
+}
+
+int64_t Reordenador::masReciente(const std::string &serie) const
+{
+  auto it = series.find(serie);
+  return it != series.end() ? it->second.maxEventoMs : INT64_MIN;
+}
+
+void Reordenador::recorrerRetenidos(const std::function<bool(const std::string &)> &seleccionar,
+                                    const std::function<void(const MensajePtr &)> &visitar) const
+{
+  std::vector<Punto> ordenados;
+  for (const auto &par : series)
+  {
+    if (par.second.buffer.empty() || !seleccionar(par.first))
+      continue;
+    ordenados = par.second.buffer;
+    std::sort(ordenados.begin(), ordenados.end(), [](const Punto &a, const Punto &b) { return posterior(b, a); });
+    for (const Punto &punto : ordenados)
+      visitar(punto.mensaje);
+  }
+}
+
+void Reordenador::emitirHasta(Serie &serie, int64_t marcaAguaMs)
+{
+  serie.marcaAguaMs = std::max(serie.marcaAguaMs, marcaAguaMs);
+
+  while (!serie.buffer.empty() && serie.buffer.front().eventoMs <= serie.marcaAguaMs)
+  {
+    std::pop_heap(serie.buffer.begin(), serie.buffer.end(), posterior);
+    tramo.push_back(std::move(serie.buffer.back().mensaje));
+    serie.buffer.pop_back();
+  }
+  if (tramo.empty())
+    return;
+
+  contadores.retenidos -= tramo.size();
+  contadores.emitidos += tramo.size();
+  contadores.tramos++;
+  ordenados(tramo);
+  tramo.clear();
+}
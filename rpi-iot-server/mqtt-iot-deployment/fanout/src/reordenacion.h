@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "mensaje.h"
+
+typedef struct // Configuración de la etapa de reordenación
+{
+  int64_t ventanaMs = 300000;   // Desorden máximo, en tiempo de evento, que se corrige dentro de una serie
+  int64_t inactividadMs = 2000; // Con la serie sin mensajes este tiempo (reloj del servidor) la marca de agua sigue al reloj
+  size_t puntosPorSerie = 64;   // Puntos retenidos como máximo por serie; con el buffer lleno se emite el más antiguo
+  size_t maxSeries = 4096;      // Series con buffer; los mensajes de las que no caben pasan sin reordenar
+} ConfigReordenacion;
+
+typedef struct // Contadores de la etapa de reordenación
+{
+  uint64_t enOrden = 0;      // Llegaron con el tiempo de evento más reciente de su serie
+  uint64_t reordenados = 0;  // Llegaron desordenados pero dentro de la ventana y salieron en su sitio
+  uint64_t tardios = 0;      // Llegaron con tiempo de evento anterior a la marca de agua: van por la ruta de datos tardíos
+  uint64_t forzados = 0;     // Emitidos antes de tiempo porque el buffer de su serie estaba lleno
+  uint64_t sinReordenar = 0; // De series que no caben en maxSeries
+  uint64_t tramos = 0;       // Tramos ordenados emitidos
+  uint64_t emitidos = 0;     // Mensajes emitidos en tramos ordenados
+  size_t retenidos = 0;      // Mensajes en los buffers en este momento
+} EstadisticasReordenacion;
+
+// Etapa de ingesta del histórico que reordena por tiempo de evento los mensajes de cada serie. Los batches del gateway, sus
+// reintentos y los backfills llegan con timestamps más antiguos que lo ya recibido, así que cada serie tiene un buffer
+// acotado (montículo por tiempo de evento) y una marca de agua: el tiempo de evento más reciente visto menos la
+// ventana. Todo lo que queda por debajo de la marca de agua sale en un único tramo ordenado; lo que llega por debajo
+// de ella ya no puede colocarse en su sitio y sale por la ruta de datos tardíos. Si una serie deja de recibir
+// mensajes, la marca de agua avanza con el reloj del servidor desde su último punto menos la ventana: lo retenido sale
+// como mucho una ventana después de la última llegada, sin esperar al siguiente batch y sin renunciar a la ventana.
+//
+// La ventana tiene que cubrir más que lo que abarca un batch en tiempo de evento (10 lecturas cada 20 s): con menos,
+// un batch reintentado al que adelanta el siguiente queda entero por debajo de la marca de agua y nunca se reordena.
+//
+// La memoria está acotada por maxSeries * puntosPorSerie punteros (cada buffer se reserva al crear la serie).
+// No es segura entre hilos: la usa solo el bucle de eventos del servidor.
+class Reordenador
+{
+public:
+  // Recibe cada tramo, de una sola serie y en orden de tiempo de evento
+  using Salida = std::function<void(const std::vector<MensajePtr> &tramo)>;
+
+  Reordenador(const ConfigReordenacion &config, Salida ordenados, Salida tardios)
+      : config(config), ordenados(std::move(ordenados)), tardios(std::move(tardios)) {}
+
+  void insertar(const MensajePtr &mensaje, int64_t ahoraMs);
+
+  // En las series sin mensajes desde hace inactividadMs, hace avanzar la marca de agua con el reloj y emite lo que queda debajo
+  void avanzar(int64_t ahoraMs);
+
+  // Emite todo lo retenido
+  void vaciar();
+
+  // Tiempo de evento más reciente recibido de la serie (INT64_MIN si no tiene buffer)
+  int64_t masReciente(const std::string &serie) const;
+
+  // Recorre, en orden de tiempo de evento, lo retenido de las series cuyo nombre cumple el predicado
+  void recorrerRetenidos(const std::function<bool(const std::string &)> &seleccionar,
+                         const std::function<void(const MensajePtr &)> &visitar) const;
+
+  bool hayRetenidos() const { return contadores.retenidos > 0; }
+  const EstadisticasReordenacion &estadisticas() const { return contadores; }
+  const ConfigReordenacion &configuracion() const { return config; }
+
+private:
+  struct Punto
+  {
+    int64_t eventoMs;
+    uint64_t orden; // Orden de llegada, para desempatar puntos con el mismo tiempo de evento
+    MensajePtr mensaje;
+  };
+
+  struct Serie
+  {
+    std::vector<Punto> buffer;       // Montículo con el punto más antiguo en la cima
+    int64_t maxEventoMs = INT64_MIN; // Tiempo de evento más reciente visto
+    int64_t marcaAguaMs = INT64_MIN; // Todo lo emitido tiene tiempo de evento <= marca de agua
+    int64_t ultimaLlegadaMs = 0;
+  };
+
+  // Comparador del montículo: deja en la cima el punto con menor tiempo de evento (y, a igualdad, el que llegó antes)
+  static bool posterior(const Punto &a, const Punto &b)
+  {
+    return a.eventoMs != b.eventoMs ? a.eventoMs > b.eventoMs : a.orden > b.orden;
+  }
+
+  void emitirHasta(Serie &serie, int64_t marcaAguaMs);
+
+  ConfigReordenacion config;
+  Salida ordenados;
+  Salida tardios;
+  std::unordered_map<std::string, Serie> series;
+  std::vector<MensajePtr> tramo; // Reutilizado en cada emisión
+  uint64_t siguienteOrden = 0;
+  EstadisticasReordenacion contadores;
+};
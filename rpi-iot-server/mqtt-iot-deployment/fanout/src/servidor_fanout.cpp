@@ -0,0 +1,581 @@
+#include "servidor_fanout.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include "filtro_topic.h"
+#include "websocket.h"
+
+#define MAX_PETICION 8192 // Tamaño máximo de la petición HTTP inicial
+#define MAX_IOVEC 64      // Mensajes que se escriben en una sola llamada a writev
+
+static int64_t ahoraMs()
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::string decodificarUrl(const std::string &texto)
+{
+  std::string resultado;
+  for (size_t i = 0; i < texto.size(); i++)
+  {
+    if (texto[i] == '%' && i + 2 < texto.size())
+    {
+      resultado.push_back((char)strtol(texto.substr(i + 1, 2).c_str(), nullptr, 16));
+      i += 2;
+    }
+    else
+    {
+      resultado.push_back(texto[i]); // '+' se deja tal cual: es el comodín de un nivel de MQTT
+    }
+  }
+  return resultado;
+}
+
+static std::string cabecera(const std::string &peticion, const char *nombre) // Valor de una cabecera HTTP, sin distinguir mayúsculas
+{
+  std::string minusculas = peticion;
+  std::transform(minusculas.begin(), minusculas.end(), minusculas.begin(), ::tolower);
+  std::string buscado = "\r\n" + std::string(nombre) + ":";
+  std::transform(buscado.begin(), buscado.end(), buscado.begin(), ::tolower);
+
+  size_t inicio = minusculas.find(buscado);
+  if (inicio == std::string::npos)
+    return "";
+  inicio += buscado.size();
+  size_t fin = peticion.find("\r\n", inicio);
+  std::string valor = peticion.substr(inicio, fin - inicio);
+  valor.erase(0, valor.find_first_not_of(' '));
+  valor.erase(valor.find_last_not_of(' ') + 1);
+  return valor;
+}
+
+ServidorFanout::~ServidorFanout()
+{
+  for (auto &cliente : clientes)
+    close(cliente.first);
+  if (escucha >= 0)
+    close(escucha);
+  if (aviso >= 0)
+    close(aviso);
+  if (epoll >= 0)
+    close(epoll);
+}
+
+bool ServidorFanout::iniciar()
+{
+  escucha = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  int si = 1, no = 0;
+  setsockopt(escucha, SOL_SOCKET, SO_REUSEADDR, &si, sizeof(si));
+  setsockopt(escucha, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no)); // Acepta también IPv4
+
+  sockaddr_in6 direccion = {};
+  direccion.sin6_family = AF_INET6;
+  direccion.sin6_addr = in6addr_any;
+  direccion.sin6_port = htons(config.puerto);
+  if (bind(escucha, (sockaddr *)&direccion, sizeof(direccion)) != 0 || listen(escucha, 64) != 0)
+  {
+    perror("No se puede escuchar en el puerto HTTP");
+    return false;
+  }
+
+  aviso = eventfd(0, EFD_NONBLOCK);
+  epoll = epoll_create1(0);
+  epoll_event evento = {};
+  evento.events = EPOLLIN;
+  evento.data.fd = escucha;
+  epoll_ctl(epoll, EPOLL_CTL_ADD, escucha, &evento);
+  evento.data.fd = aviso;
+  epoll_ctl(epoll, EPOLL_CTL_ADD, aviso, &evento);
+  return true;
+}
+
+ServidorFanout::ServidorFanout(const ConfigServidor &config, const ConfigReordenacion &configReordenacion, AlmacenSeries &almacen)
+    : config(config), almacen(almacen),
+      reordenador(configReordenacion,
+                  [this](const std::vector<MensajePtr> &tramo)
+                  {
+                    for (const MensajePtr &mensaje : tramo)
+                      this->almacen.guardar(mensaje);
+                  },
+                  [](const std::vector<MensajePtr> &) {}) // Ya repartidos en directo; fuera del histórico, que se mantiene en orden
+{
+}
+
+void ServidorFanout::publicar(MensajePtr mensaje)
+{
+  bool despertar;
+  {
+    std::lock_guard<std::mutex> lock(mutexEntrantes);
+    despertar = entrantes.empty(); // Si ya había mensajes, el bucle ya está avisado
+    entrantes.push_back(std::move(mensaje));
+  }
+  if (despertar)
+  {
+    uint64_t uno = 1;
+    if (write(aviso, &uno, sizeof(uno)) < 0)
+      perror("eventfd");
+  }
+}
+
+void ServidorFanout::ejecutar(const std::atomic<bool> &activo)
+{
+  epoll_event eventos[64];
+  int64_t ultimaRevision = ahoraMs();
+  while (activo)
+  {
+    // Con mensajes retenidos se despierta a menudo para emitirlos en cuanto su serie queda inactiva
+    int espera = reordenador.hayRetenidos() ? (int)std::max<int64_t>(10, std::min<int64_t>(1000, reordenador.configuracion().inactividadMs / 4)) : 1000;
+    int n = epoll_wait(epoll, eventos, 64, espera);
+    for (int i = 0; i < n; i++)
+    {
+      int fd = eventos[i].data.fd;
+      if (fd == escucha)
+      {
+        aceptar();
+        continue;
+      }
+      if (fd == aviso)
+      {
+        uint64_t contador;
+        if (read(aviso, &contador, sizeof(contador)) >= 0)
+          repartirEntrantes();
+        continue;
+      }
+
+      auto it = clientes.find(fd);
+      if (it == clientes.end())
+        continue;
+      if (eventos[i].events & (EPOLLERR | EPOLLHUP))
+      {
+        cerrar(fd);
+        continue;
+      }
+      if (eventos[i].events & EPOLLOUT)
+        escribir(*it->second);
+      if ((eventos[i].events & EPOLLIN) && clientes.count(fd))
+        leer(*it->second);
+    }
+
+    if (reordenador.hayRetenidos())
+      reordenador.avanzar(ahoraMs());
+
+    if (ahoraMs() - ultimaRevision >= 1000)
+    {
+      revisarLentos();
+      ultimaRevision = ahoraMs();
+    }
+  }
+}
+
+void ServidorFanout::aceptar()
+{
+  for (;;)
+  {
+    int fd = accept4(escucha, nullptr, nullptr, SOCK_NONBLOCK);
+    if (fd < 0)
+      return;
+    if (clientes.size() >= config.maxClientes)
+    {
+      const char respuesta[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+      send(fd, respuesta, sizeof(respuesta) - 1, MSG_NOSIGNAL);
+      close(fd);
+      continue;
+    }
+
+    int si = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &si, sizeof(si));
+    epoll_event evento = {};
+    evento.events = EPOLLIN;
+    evento.data.fd = fd;
+    epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &evento);
+
+    auto cliente = std::make_unique<Cliente>();
+    cliente->fd = fd;
+    cliente->ultimoProgresoMs = cliente->ultimoEnvioMs = ahoraMs();
+    clientes[fd] = std::move(cliente);
+  }
+}
+
+void ServidorFanout::leer(Cliente &cliente)
+{
+  char buffer[4096];
+  for (;;)
+  {
+    ssize_t n = recv(cliente.fd, buffer, sizeof(buffer), 0);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+    {
+      cerrar(cliente.fd);
+      return;
+    }
+    if (n < 0)
+      break;
+    // Un cliente SSE no debería mandar nada más; se descarta para que no acumule memoria
+    if (cliente.protocolo != Protocolo::SSE)
+      cliente.entrada.append(buffer, n);
+  }
+
+  if (cliente.protocolo == Protocolo::HTTP)
+    atenderPeticion(cliente);
+  else if (cliente.protocolo == Protocolo::WEBSOCKET)
+    atenderWebSocket(cliente);
+}
+
+void ServidorFanout::atenderPeticion(Cliente &cliente)
+{
+  size_t fin = cliente.entrada.find("\r\n\r\n");
+  if (fin == std::string::npos)
+  {
+    if (cliente.entrada.size() > MAX_PETICION)
+      cerrar(cliente.fd);
+    return;
+  }
+
+  std::string peticion = cliente.entrada.substr(0, fin + 2);
+  cliente.entrada.erase(0, fin + 4);
+
+  size_t espacio = peticion.find(' ');
+  size_t espacio2 = peticion.find(' ', espacio + 1);
+  std::string metodo = peticion.substr(0, espacio);
+  std::string objetivo = espacio == std::string::npos ? "" : peticion.substr(espacio + 1, espacio2 - espacio - 1);
+  std::string ruta = objetivo.substr(0, objetivo.find('?'));
+
+  // Filtros de la query: /events?filtro=/red/temperature/%2B&filtro=/red/presence/%23
+  size_t query = objetivo.find('?');
+  while (query != std::string::npos)
+  {
+    size_t siguiente = objetivo.find('&', query + 1);
+    std::string parametro = objetivo.substr(query + 1, siguiente == std::string::npos ? std::string::npos : siguiente - query - 1);
+    if (parametro.compare(0, 7, "filtro=") == 0)
+      cliente.filtros.push_back(decodificarUrl(parametro.substr(7)));
+    query = siguiente;
+  }
+  if (cliente.filtros.empty())
+    cliente.filtros.push_back("#");
+
+  if (metodo == "GET" && ruta == "/events")
+  {
+    cliente.protocolo = Protocolo::SSE;
+    cliente.directo = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+                      "Connection: keep-alive\r\nAccess-Control-Allow-Origin: *\r\n\r\n";
+  }
+  else if (metodo == "GET" && ruta == "/ws" && !cabecera(peticion, "Sec-WebSocket-Key").empty())
+  {
+    cliente.protocolo = Protocolo::WEBSOCKET;
+    cliente.directo = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                      "Sec-WebSocket-Accept: " + claveAceptacionWs(cabecera(peticion, "Sec-WebSocket-Key")) + "\r\n\r\n";
+  }
+  else
+  {
+    std::string cuerpo = metodo == "GET" && ruta == "/stats" ? estadisticas() : "";
+    const char *estado = cuerpo.empty() ? "404 Not Found" : "200 OK";
+    cliente.directo = std::string("HTTP/1.1 ") + estado + "\r\nContent-Type: application/json\r\nContent-Length: " +
+                      std::to_string(cuerpo.size()) + "\r\nConnection: close\r\n\r\n" + cuerpo;
+    cliente.cerrarTrasEscribir = true;
+    escribir(cliente);
+    return;
+  }
+
+  // Histórico reciente de las series que le interesan, antes de los mensajes en directo. Lo retenido por la
+  // reordenación ya se repartió en directo pero aún no está en el histórico: va detrás, que es más reciente.
+  auto interesa = [&](const std::string &serie) { return quiere(cliente, serie); };
+  auto enviar = [&](const MensajePtr &mensaje) { encolar(cliente, mensaje); };
+  almacen.recorrer(interesa, enviar);
+  reordenador.recorrerRetenidos(interesa, enviar);
+  escribir(cliente);
+}
+
+void ServidorFanout::atenderWebSocket(Cliente &cliente)
+{
+  uint8_t opcode;
+  std::string payload;
+  size_t n;
+  while ((n = leerMarcoWs(cliente.entrada, opcode, payload)) > 0)
+  {
+    cliente.entrada.erase(0, n);
+    if (opcode == WS_OPCODE_PING)
+    {
+      cliente.directo += marcoWs(WS_OPCODE_PONG, payload);
+    }
+    else if (opcode == WS_OPCODE_CIERRE)
+    {
+      cliente.directo += marcoWs(WS_OPCODE_CIERRE, "");
+      cliente.cerrarTrasEscribir = true;
+    }
+  }
+  if (cliente.entrada.size() > MAX_PETICION)
+  {
+    cerrar(cliente.fd);
+    return;
+  }
+  if (!cliente.directo.empty())
+    escribir(cliente);
+}
+
+void ServidorFanout::repartirEntrantes()
+{
+  std::vector<MensajePtr> lote;
+  {
+    std::lock_guard<std::mutex> lock(mutexEntrantes);
+    lote.swap(entrantes);
+  }
+
+  int64_t ahora = ahoraMs();
+  recibidos += lote.size();
+  for (const MensajePtr &mensaje : lote)
+  {
+    // El directo no espera a la reordenación: lo que llega por detrás de lo ya repartido de su serie sale como "tarde"
+    bool tardio = mensaje->eventoMs < reordenador.masReciente(mensaje->serie);
+    repartir(tardio ? marcarTardio(mensaje) : mensaje);
+    reordenador.insertar(mensaje, ahora); // Camino del histórico
+  }
+  reordenador.avanzar(ahora);
+  escribirPendientes();
+}
+
+void ServidorFanout::repartir(const MensajePtr &mensaje)
+{
+  for (auto &par : clientes)
+  {
+    Cliente &cliente = *par.second;
+    if (cliente.protocolo != Protocolo::HTTP && !cliente.cerrarTrasEscribir && quiere(cliente, mensaje->serie))
+      encolar(cliente, mensaje);
+  }
+}
+
+// Se escribe una vez por lote, así un cliente rápido recibe varios mensajes en un solo writev
+void ServidorFanout::escribirPendientes()
+{
+  std::vector<int> pendientes;
+  for (auto &par : clientes)
+  {
+    if (!par.second->cola.empty() && !par.second->esperandoEscritura)
+      pendientes.push_back(par.first);
+  }
+  for (int fd : pendientes)
+  {
+    auto it = clientes.find(fd);
+    if (it != clientes.end())
+      escribir(*it->second);
+  }
+}
+
+void ServidorFanout::encolar(Cliente &cliente, const MensajePtr &mensaje)
+{
+  size_t longitud = datos(cliente, mensaje).size();
+
+  if (cliente.submuestreando)
+  {
+    // Se sustituye el punto pendiente de la misma serie; el primero puede estar a medio escribir y no se toca
+    size_t primero = cliente.offsetCola > 0 ? 1 : 0;
+    for (size_t i = primero; i < cliente.cola.size(); i++)
+    {
+      if (cliente.cola[i]->serie == mensaje->serie)
+      {
+        cliente.bytesPendientes = cliente.bytesPendientes - datos(cliente, cliente.cola[i]).size() + longitud;
+        cliente.cola[i] = mensaje;
+        submuestreados++;
+        return;
+      }
+    }
+  }
+
+  cliente.cola.push_back(mensaje);
+  cliente.bytesPendientes += longitud;
+
+  // Solo cuentan los clientes cuyo socket ya está lleno; uno rápido vacía la cola en el siguiente writev
+  if (cliente.esperandoEscritura && cliente.bytesPendientes > config.colaExpulsionBytes)
+  {
+    fprintf(stderr, "Cliente %d expulsado: %zu bytes pendientes\n", cliente.fd, cliente.bytesPendientes);
+    expulsados++;
+    cliente.cola.clear();
+    cliente.bytesPendientes = 0;
+    cliente.directo.clear();
+    cliente.offsetDirecto = cliente.offsetCola = 0;
+    cliente.cerrarTrasEscribir = true;
+    shutdown(cliente.fd, SHUT_RDWR); // El bucle de eventos lo cierra al recibir EPOLLHUP
+  }
+}
+
+void ServidorFanout::escribir(Cliente &cliente)
+{
+  // Consume hasta maxMensajes de la cola con los bytes escritos; devuelve los que sobran
+  auto consumirCola = [&](size_t restantes, size_t maxMensajes)
+  {
+    for (size_t i = 0; i < maxMensajes && restantes > 0 && !cliente.cola.empty(); i++)
+    {
+      size_t pendiente = datos(cliente, cliente.cola.front()).size() - cliente.offsetCola;
+      if (restantes < pendiente)
+      {
+        cliente.offsetCola += restantes;
+        cliente.bytesPendientes -= restantes;
+        return (size_t)0;
+      }
+      restantes -= pendiente;
+      cliente.bytesPendientes -= pendiente;
+      cliente.cola.pop_front();
+      cliente.offsetCola = 0;
+      entregados++;
+    }
+    return restantes;
+  };
+
+  while (!cliente.directo.empty() || !cliente.cola.empty())
+  {
+    iovec iov[MAX_IOVEC];
+    int n = 0;
+    // Un mensaje de la cola a medio escribir termina antes que lo directo: un pong o un cierre en medio de un marco
+    // corrompería el flujo WebSocket
+    size_t enCurso = cliente.offsetCola > 0 ? 1 : 0;
+    if (enCurso)
+    {
+      const std::string &bytes = datos(cliente, cliente.cola.front());
+      iov[n].iov_base = (void *)(bytes.data() + cliente.offsetCola);
+      iov[n++].iov_len = bytes.size() - cliente.offsetCola;
+    }
+    if (!cliente.directo.empty())
+    {
+      iov[n].iov_base = (void *)(cliente.directo.data() + cliente.offsetDirecto);
+      iov[n++].iov_len = cliente.directo.size() - cliente.offsetDirecto;
+    }
+    for (size_t i = enCurso; i < cliente.cola.size() && n < MAX_IOVEC; i++)
+    {
+      const std::string &bytes = datos(cliente, cliente.cola[i]);
+      iov[n].iov_base = (void *)bytes.data();
+      iov[n++].iov_len = bytes.size();
+    }
+
+    ssize_t escritos = writev(cliente.fd, iov, n);
+    if (escritos < 0)
+    {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+        cerrar(cliente.fd);
+        return;
+      }
+      break;
+    }
+    cliente.ultimoProgresoMs = cliente.ultimoEnvioMs = ahoraMs();
+
+    // Se consumen los bytes escritos en el mismo orden: el mensaje en curso, lo directo y el resto de la cola
+    size_t restantes = consumirCola(escritos, enCurso);
+    if (cliente.offsetCola > 0)
+      continue;
+    if (!cliente.directo.empty())
+    {
+      size_t pendiente = cliente.directo.size() - cliente.offsetDirecto;
+      if (restantes < pendiente)
+      {
+        cliente.offsetDirecto += restantes;
+        continue;
+      }
+      restantes -= pendiente;
+      cliente.directo.clear();
+      cliente.offsetDirecto = 0;
+    }
+    consumirCola(restantes, SIZE_MAX);
+  }
+
+  // Se submuestrea mientras el socket no admite más y lo pendiente supera el umbral; se vuelve a normal con la mitad
+  if (cliente.bytesPendientes > config.colaSubmuestreoBytes)
+    cliente.submuestreando = true;
+  else if (cliente.bytesPendientes < config.colaSubmuestreoBytes / 2)
+    cliente.submuestreando = false;
+
+  bool pendiente = !cliente.directo.empty() || !cliente.cola.empty();
+  if (!pendiente && cliente.cerrarTrasEscribir)
+  {
+    cerrar(cliente.fd);
+    return;
+  }
+  if (pendiente != cliente.esperandoEscritura)
+  {
+    epoll_event evento = {};
+    evento.events = EPOLLIN | (pendiente ? (uint32_t)EPOLLOUT : 0u);
+    evento.data.fd = cliente.fd;
+    epoll_ctl(epoll, EPOLL_CTL_MOD, cliente.fd, &evento);
+    cliente.esperandoEscritura = pendiente;
+  }
+}
+
+void ServidorFanout::revisarLentos()
+{
+  int64_t ahora = ahoraMs();
+  std::vector<int> expulsar, keepAlive;
+  for (auto &par : clientes)
+  {
+    Cliente &cliente = *par.second;
+    bool pendiente = !cliente.directo.empty() || !cliente.cola.empty();
+    if ((pendiente || cliente.protocolo == Protocolo::HTTP) && ahora - cliente.ultimoProgresoMs > config.timeoutLentoMs)
+      expulsar.push_back(par.first); // No lee lo que se le manda o no termina de enviar la petición
+    else if (!pendiente && cliente.protocolo == Protocolo::SSE && ahora - cliente.ultimoEnvioMs > config.keepAliveSseMs)
+      keepAlive.push_back(par.first);
+  }
+
+  for (int fd : keepAlive) // Fuera del recorrido: escribir() puede cerrar el cliente
+  {
+    Cliente &cliente = *clientes[fd];
+    cliente.directo = ": keep-alive\n\n"; // Comentario SSE: mantiene viva la conexión a través de proxies
+    escribir(cliente);
+  }
+  for (int fd : expulsar)
+  {
+    fprintf(stderr, "Cliente %d expulsado: sin progreso en %lld ms\n", fd, (long long)config.timeoutLentoMs);
+    expulsados++;
+    cerrar(fd);
+  }
+}
+
+void ServidorFanout::cerrar(int fd)
+{
+  epoll_ctl(epoll, EPOLL_CTL_DEL, fd, nullptr);
+  close(fd);
+  clientes.erase(fd);
+}
+
+bool ServidorFanout::quiere(const Cliente &cliente, const std::string &serie) const
+{
+  for (const std::string &filtro : cliente.filtros)
+  {
+    if (cumpleFiltro(filtro, serie))
+      return true;
+  }
+  return false;
+}
+
+const std::string &ServidorFanout::datos(const Cliente &cliente, const MensajePtr &mensaje) const
+{
+  return cliente.protocolo == Protocolo::WEBSOCKET ? mensaje->websocket : mensaje->sse;
+}
+
+std::string ServidorFanout::estadisticas() const
+{
+  const EstadisticasReordenacion &r = reordenador.estadisticas();
+  size_t sse = 0, websocket = 0, submuestreando = 0, bytesPendientes = 0;
+  for (const auto &par : clientes)
+  {
+    sse += par.second->protocolo == Protocolo::SSE;
+    websocket += par.second->protocolo == Protocolo::WEBSOCKET;
+    submuestreando += par.second->submuestreando;
+    bytesPendientes += par.second->bytesPendientes;
+  }
+  return "{\"clientes_sse\":" + std::to_string(sse) + ",\"clientes_ws\":" + std::to_string(websocket) +
+         ",\"clientes_submuestreados\":" + std::to_string(submuestreando) + ",\"bytes_pendientes\":" + std::to_string(bytesPendientes) +
+         ",\"series\":" + std::to_string(almacen.numSeries()) + ",\"series_rechazadas\":" + std::to_string(almacen.seriesRechazadas()) +
+         ",\"recibidos\":" + std::to_string(recibidos) + ",\"entregados\":" + std::to_string(entregados) +
+         ",\"submuestreados\":" + std::to_string(submuestreados) + ",\"expulsados\":" + std::to_string(expulsados) +
+         ",\"reordenacion\":{\"en_orden\":" + std::to_string(r.enOrden) + ",\"reordenados\":" + std::to_string(r.reordenados) +
+         ",\"tardios\":" + std::to_string(r.tardios) + ",\"forzados\":" + std::to_string(r.forzados) +
+         ",\"sin_reordenar\":" + std::to_string(r.sinReordenar) + ",\"tramos\":" + std::to_string(r.tramos) +
+         ",\"retenidos\":" + std::to_string(r.retenidos) + "}}";
+}
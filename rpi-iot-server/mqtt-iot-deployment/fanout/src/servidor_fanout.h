@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "almacen_series.h"
+#include "mensaje.h"
+#include "reordenacion.h"
+
+typedef struct // Configuración del servidor de fan-out
+{
+  int puerto = 8080;
+  size_t maxClientes = 256;
+  size_t colaSubmuestreoBytes = 256 * 1024; // Con más bytes pendientes, el cliente solo recibe el último punto de cada serie
+  size_t colaExpulsionBytes = 1024 * 1024;  // Con más bytes pendientes, el cliente se desconecta
+  int64_t timeoutLentoMs = 15000;           // Tiempo máximo sin poder escribir nada a un cliente con datos pendientes
+  int64_t keepAliveSseMs = 15000;           // Cada cuánto se manda un comentario a los clientes SSE sin tráfico
+} ConfigServidor;
+
+// Servidor HTTP de un solo hilo (epoll) que reparte los mensajes del broker entre clientes SSE (/events) y
+// WebSocket (/ws), cada uno con sus filtros de topic (?filtro=/red/temperature/+). Los mensajes se codifican una
+// vez y los clientes comparten el mismo buffer. Un cliente lento nunca bloquea a los demás: primero se le
+// submuestrea (se sustituye el punto pendiente de cada serie por el más reciente) y, si sigue sin leer, se le expulsa.
+// Los mensajes se reparten en directo en cuanto llegan; los que son más antiguos que lo ya repartido de su serie salen
+// como evento "tarde". Aparte, la etapa de reordenación alimenta el histórico, que guarda cada serie en orden de tiempo
+// de evento y nunca retrasa el directo.
+class ServidorFanout
+{
+public:
+  ServidorFanout(const ConfigServidor &config, const ConfigReordenacion &configReordenacion, AlmacenSeries &almacen);
+  ~ServidorFanout();
+
+  bool iniciar();
+
+  // Entrega un mensaje al servidor. Se puede llamar desde otro hilo (el del cliente MQTT).
+  void publicar(MensajePtr mensaje);
+
+  // Bucle de eventos; vuelve cuando activo pasa a false
+  void ejecutar(const std::atomic<bool> &activo);
+
+private:
+  enum class Protocolo
+  {
+    HTTP,     // Esperando la petición
+    SSE,      // Server-Sent Events
+    WEBSOCKET // WebSocket tras el handshake
+  };
+
+  struct Cliente
+  {
+    int fd;
+    Protocolo protocolo = Protocolo::HTTP;
+    std::string entrada;              // Bytes recibidos pendientes de procesar
+    std::string directo;              // Bytes propios del cliente (cabeceras, pong...) que salen antes que la cola
+    std::vector<std::string> filtros; // Filtros de topic pedidos por el cliente
+    std::deque<MensajePtr> cola;      // Mensajes compartidos pendientes de escribir
+    size_t offsetDirecto = 0;         // Bytes ya escritos de directo
+    size_t offsetCola = 0;            // Bytes ya escritos del primer mensaje de la cola
+    size_t bytesPendientes = 0;       // Bytes de la cola aún sin escribir
+    bool submuestreando = false;
+    bool cerrarTrasEscribir = false;
+    bool esperandoEscritura = false;  // EPOLLOUT activado
+    int64_t ultimoProgresoMs = 0;
+    int64_t ultimoEnvioMs = 0;
+  };
+
+  void aceptar();
+  void leer(Cliente &cliente);
+  void atenderPeticion(Cliente &cliente);
+  void atenderWebSocket(Cliente &cliente);
+  void repartirEntrantes();
+  void repartir(const MensajePtr &mensaje);
+  void escribirPendientes();
+  void encolar(Cliente &cliente, const MensajePtr &mensaje);
+  void escribir(Cliente &cliente);
+  void revisarLentos();
+  void cerrar(int fd);
+  bool quiere(const Cliente &cliente, const std::string &serie) const;
+  const std::string &datos(const Cliente &cliente, const MensajePtr &mensaje) const;
+  std::string estadisticas() const;
+
+  ConfigServidor config;
+  AlmacenSeries &almacen;
+  Reordenador reordenador;
+  int epoll = -1;
+  int escucha = -1;
+  int aviso = -1; // eventfd con el que el hilo MQTT despierta al bucle de eventos
+  std::unordered_map<int, std::unique_ptr<Cliente>> clientes;
+
+  std::mutex mutexEntrantes;
+  std::vector<MensajePtr> entrantes; // Mensajes llegados del broker pendientes de repartir
+
+  uint64_t recibidos = 0;
+  uint64_t entregados = 0;
+  uint64_t submuestreados = 0;
+  uint64_t expulsados = 0;
+};
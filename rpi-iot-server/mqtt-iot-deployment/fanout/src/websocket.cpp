@@ -0,0 +1,144 @@
+#include "websocket.h"
+
+static uint32_t rotar(uint32_t valor, int bits) { return (valor << bits) | (valor >> (32 - bits)); }
+
+static std::string sha1(const std::string &mensaje)
+{
+  uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+  std::string datos = mensaje;
+  uint64_t bits = (uint64_t)mensaje.size() * 8;
+  datos.push_back((char)0x80);
+  while (datos.size() % 64 != 56)
+    datos.push_back(0);
+  for (int i = 7; i >= 0; i--)
+    datos.push_back((char)(bits >> (8 * i)));
+
+  for (size_t bloque = 0; bloque < datos.size(); bloque += 64)
+  {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++)
+    {
+      const uint8_t *p = (const uint8_t *)&datos[bloque + 4 * i];
+      w[i] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    }
+    for (int i = 16; i < 80; i++)
+      w[i] = rotar(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++)
+    {
+      uint32_t f, k;
+      if (i < 20)
+        f = (b & c) | (~b & d), k = 0x5A827999;
+      else if (i < 40)
+        f = b ^ c ^ d, k = 0x6ED9EBA1;
+      else if (i < 60)
+        f = (b & c) | (b & d) | (c & d), k = 0x8F1BBCDC;
+      else
+        f = b ^ c ^ d, k = 0xCA62C1D6;
+      uint32_t temporal = rotar(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = rotar(b, 30);
+      b = a;
+      a = temporal;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+
+  std::string resumen;
+  for (uint32_t valor : h)
+    for (int i = 3; i >= 0; i--)
+      resumen.push_back((char)(valor >> (8 * i)));
+  return resumen;
+}
+
+static std::string base64(const std::string &datos)
+{
+  static const char alfabeto[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string resultado;
+  for (size_t i = 0; i < datos.size(); i += 3)
+  {
+    uint32_t grupo = (uint8_t)datos[i] << 16;
+    if (i + 1 < datos.size())
+      grupo |= (uint8_t)datos[i + 1] << 8;
+    if (i + 2 < datos.size())
+      grupo |= (uint8_t)datos[i + 2];
+    resultado.push_back(alfabeto[(grupo >> 18) & 0x3F]);
+    resultado.push_back(alfabeto[(grupo >> 12) & 0x3F]);
+    resultado.push_back(i + 1 < datos.size() ? alfabeto[(grupo >> 6) & 0x3F] : '=');
+    resultado.push_back(i + 2 < datos.size() ? alfabeto[grupo & 0x3F] : '=');
+  }
+  return resultado;
+}
+
+std::string claveAceptacionWs(const std::string &clave)
+{
+  return base64(sha1(clave + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"));
+}
+
+std::string marcoWs(uint8_t opcode, const std::string &payload)
+{
+  std::string marco(1, (char)(0x80 | opcode)); // FIN + opcode
+  if (payload.size() < 126)
+  {
+    marco.push_back((char)payload.size());
+  }
+  else if (payload.size() <= 0xFFFF)
+  {
+    marco.push_back(126);
+    marco.push_back((char)(payload.size() >> 8));
+    marco.push_back((char)(payload.size() & 0xFF));
+  }
+  else
+  {
+    marco.push_back(127);
+    for (int i = 7; i >= 0; i--)
+      marco.push_back((char)((uint64_t)payload.size() >> (8 * i)));
+  }
+  return marco + payload;
+}
+
+size_t leerMarcoWs(const std::string &datos, uint8_t &opcode, std::string &payload)
+{
+  if (datos.size() < 2)
+    return 0;
+  const uint8_t *p = (const uint8_t *)datos.data();
+  opcode = p[0] & 0x0F;
+  bool conMascara = p[1] & 0x80;
+  uint64_t longitud = p[1] & 0x7F;
+  size_t n = 2;
+
+  if (longitud == 126 || longitud == 127)
+  {
+    size_t bytes = longitud == 126 ? 2 : 8;
+    if (datos.size() < n + bytes)
+      return 0;
+    longitud = 0;
+    for (size_t i = 0; i < bytes; i++)
+      longitud = (longitud << 8) | p[n + i];
+    n += bytes;
+  }
+
+  uint8_t mascara[4] = {0, 0, 0, 0};
+  if (conMascara)
+  {
+    if (datos.size() < n + 4)
+      return 0;
+    for (int i = 0; i < 4; i++)
+      mascara[i] = p[n + i];
+    n += 4;
+  }
+  if (datos.size() - n < longitud)
+    return 0;
+
+  payload.assign(datos, n, longitud);
+  for (size_t i = 0; i < payload.size(); i++)
+    payload[i] ^= mascara[i % 4];
+  return n + longitud;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#define WS_OPCODE_TEXTO 0x1
+#define WS_OPCODE_CIERRE 0x8
+#define WS_OPCODE_PING 0x9
+#define WS_OPCODE_PONG 0xA
+
+// Valor de Sec-WebSocket-Accept para la Sec-WebSocket-Key del cliente (RFC 6455, sección 4.2.2)
+std::string claveAceptacionWs(const std::string &clave);
+
+// Marco WebSocket sin máscara (los del servidor no la llevan) con el payload completo
+std::string marcoWs(uint8_t opcode, const std::string &payload);
+
+// Extrae el primer marco completo de datos. Devuelve los bytes consumidos o 0 si aún no ha llegado entero.
+size_t leerMarcoWs(const std::string &datos, uint8_t &opcode, std::string &payload);